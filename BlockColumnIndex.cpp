@@ -0,0 +1,59 @@
+
+#include <algorithm>
+#include "BlockColumnIndex.h"
+
+void BlockColumnIndex::clear(void)
+{
+	m_keys.clear();
+	m_columns.clear();
+	m_y.clear();
+	m_format.clear();
+	m_blockCount = 0;
+}
+
+void BlockColumnIndex::finalize(void)
+{
+	std::sort(m_keys.begin(), m_keys.end());
+	m_keys.erase(std::unique(m_keys.begin(), m_keys.end(), samePos), m_keys.end());
+
+	m_columns.clear();
+	m_y.clear();
+	m_y.reserve(m_keys.size());
+	m_format.clear();
+	m_format.reserve(m_keys.size());
+	uint64_t columnKey = ~uint64_t(0);
+	for (std::vector<uint64_t>::const_iterator k = m_keys.begin(); k != m_keys.end(); ++k) {
+		if (keyColumn(*k) != columnKey) {
+			columnKey = keyColumn(*k);
+			if (!m_columns.empty())
+				m_columns.back().yEnd = m_y.size();
+			Column column;
+			column.x = keyX(*k);
+			column.z = keyZ(*k);
+			column.yBegin = m_y.size();
+			column.yEnd = m_y.size();
+			m_columns.push_back(column);
+		}
+		m_y.push_back(int16_t(keyY(*k)));
+		m_format.push_back(uint8_t(keyFormat(*k)));
+	}
+	if (!m_columns.empty())
+		m_columns.back().yEnd = m_y.size();
+	m_blockCount = m_keys.size();
+
+	// The keys are no longer needed
+	std::vector<uint64_t>().swap(m_keys);
+}
+
+void BlockColumnIndex::retainColumns(const std::vector<bool> &retain)
+{
+	size_t count = 0;
+	m_blockCount = 0;
+	for (size_t i = 0; i < m_columns.size(); i++) {
+		if (retain[i]) {
+			m_columns[count++] = m_columns[i];
+			m_blockCount += m_columns[i].depth();
+		}
+	}
+	m_columns.resize(count);
+}
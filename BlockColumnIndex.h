@@ -0,0 +1,61 @@
+
+#ifndef BLOCKCOLUMNINDEX_H
+#define BLOCKCOLUMNINDEX_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+#include "BlockPos.h"
+
+// Index of the map blocks to be rendered, grouped by column (x,z).
+//
+// Columns are stored in the order in which they are rendered: z descending,
+// then x ascending. The y coordinates of the blocks in a column are stored
+// contiguously, in descending order (i.e. in the order the blocks are
+// needed), along with the format of their database keys (see BlockPos), so
+// that string-keyed backends can look them up again.
+class BlockColumnIndex
+{
+public:
+	struct Column {
+		int x;
+		int z;
+		size_t yBegin;		// Index of the topmost block in the y list
+		size_t yEnd;
+		size_t depth(void) const { return yEnd - yBegin; }
+	};
+	typedef std::vector<Column> ColumnList;
+
+	BlockColumnIndex(void) : m_blockCount(0) {}
+	void clear(void);
+	// Add blocks using add(), and call finalize() when done.
+	void add(const BlockPos &pos) { m_keys.push_back(key(pos.x, pos.y, pos.z, pos.databaseFormat())); }
+	void finalize(void);
+	// Remove the columns for which retain[i] (i: index in columns()) is false
+	void retainColumns(const std::vector<bool> &retain);
+
+	const ColumnList &columns(void) const { return m_columns; }
+	int y(size_t index) const { return m_y[index]; }
+	BlockPos blockPos(const Column &column, size_t index) const { return BlockPos(column.x, m_y[index], column.z, BlockPos::StrFormat(m_format[index])); }
+	size_t blockCount(void) const { return m_blockCount; }
+
+private:
+	// Keys sort in rendering order. Block coordinates are limited to 16 bits. The
+	// lowest 2 bits are the format of the database key.
+	static uint64_t key(int x, int y, int z, BlockPos::StrFormat format) { return (uint64_t(uint16_t(0x7fff - z)) << 34) | (uint64_t(uint16_t(x + 0x8000)) << 18) | (uint64_t(uint16_t(0x7fff - y)) << 2) | (format & 3); }
+	static uint64_t keyPos(uint64_t k) { return k >> 2; }
+	static uint64_t keyColumn(uint64_t k) { return k >> 18; }
+	static int keyX(uint64_t k) { return int((k >> 18) & 0xffff) - 0x8000; }
+	static int keyY(uint64_t k) { return 0x7fff - int((k >> 2) & 0xffff); }
+	static int keyZ(uint64_t k) { return 0x7fff - int((k >> 34) & 0xffff); }
+	static int keyFormat(uint64_t k) { return int(k & 3); }
+	static bool samePos(uint64_t k1, uint64_t k2) { return keyPos(k1) == keyPos(k2); }
+
+	std::vector<uint64_t> m_keys;
+	ColumnList m_columns;
+	std::vector<int16_t> m_y;
+	std::vector<uint8_t> m_format;
+	size_t m_blockCount;
+};
+
+#endif // BLOCKCOLUMNINDEX_H
@@ -6,9 +6,8 @@
 #include <limits>
 #include <climits>
 #include <cctype>
+#include <stdint.h>
 #include <string>
-#include <sstream>
-#include <iomanip>
 #include <stdexcept>
 
 struct BlockPos {
@@ -37,21 +36,34 @@ struct BlockPos {
 //#endif
 	BlockPos() : dimension{0, 0, 0}, m_strFormat(Unknown) {}
 	BlockPos(int _x, int _y, int _z) : dimension{_x, _y, _z}, m_strFormat(Unknown) {}
+	// A position obtained from the database earlier (see databaseFormat())
+	BlockPos(int _x, int _y, int _z, StrFormat format) : dimension{_x, _y, _z}, m_strFormat(format) {}
 	BlockPos(const BlockPos &pos) : dimension{pos.x, pos.y, pos.z}, m_strFormat(pos.m_strFormat) {}
 	BlockPos(int64_t i) { operator=(i); }
 	BlockPos(const std::string &s) { operator=(s); }
+	BlockPos(const char *s, size_t length) { assign(s, length); }
 	int64_t databasePosI64(void) const { return getDBPos(); }
 	std::string databasePosStr(StrFormat defaultFormat = Unknown) const;
 	std::string databasePosStrFmt(StrFormat format) const;
+	// Versions that do not allocate. The buffer must be at least StrBufferSize bytes.
+	// The string is null-terminated; its length is returned.
+	size_t databasePosStr(char *buffer, StrFormat defaultFormat = Unknown) const;
+	size_t databasePosStrFmt(char *buffer, StrFormat format) const;
+	// The format of the database key, to be passed on to BlockPos(x, y, z, format) if
+	// the position is stored without the key.
+	StrFormat databaseFormat(void) const { return m_strFormat; }
 
 	bool operator<(const BlockPos& p) const;
 	bool operator==(const BlockPos& p) const;
 	void operator=(const BlockPos &p) { x = p.x; y = p.y; z = p.z; m_strFormat = p.m_strFormat; }
 	void operator=(int64_t i) { setFromDBPos(i); m_strFormat = I64; }
-	void operator=(const std::string &s);
+	void operator=(const std::string &s) { assign(s.c_str(), s.length()); }
+	void assign(const char *s, size_t length);
 
 	static const int Any = INT_MIN;
 	static const int Invalid = INT_MAX;
+	// Maximum length of a database string key (including terminating null)
+	static const size_t StrBufferSize = 40;
 
 protected:
 // Include code copied from the minetest codebase.
@@ -64,6 +76,10 @@ private:
 	// WARNING: see comment about m_strFormat above !!
 	StrFormat m_strFormat;
 
+	static bool parseInt(const char *&p, const char *end, int64_t &value);
+	static size_t formatInt(char *buffer, int64_t value);
+	bool parseXYZ(const char *p, const char *end);
+
 };
 
 struct NodeCoord : BlockPos
@@ -114,64 +130,140 @@ namespace std {
 	};
 }
 
-inline void BlockPos::operator=(const std::string &s)
+// Parse a (decimal) integer from a database key string. No allocations, no locale
+// dependencies. Returns false if no digits were found, or in case of overflow.
+inline bool BlockPos::parseInt(const char *&p, const char *end, int64_t &value)
+{
+	bool negative = false;
+	if (p != end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	if (p == end || *p < '0' || *p > '9')
+		return false;
+	const uint64_t limit = uint64_t(std::numeric_limits<int64_t>::max()) + (negative ? 1 : 0);
+	uint64_t v = 0;
+	for (; p != end && *p >= '0' && *p <= '9'; p++) {
+		unsigned digit = *p - '0';
+		if (v > (limit - digit) / 10)
+			return false;
+		v = v * 10 + digit;
+	}
+	value = negative ? int64_t(0 - v) : int64_t(v);
+	return true;
+}
+
+// Parse '<x>,<y>,<z>' from a database key string
+inline bool BlockPos::parseXYZ(const char *p, const char *end)
 {
-	std::istringstream is(s);
-	if (isdigit(is.peek()) || is.peek() == '-' || is.peek() == '+') {
+	int64_t v[3];
+	for (int i = 0; i < 3; i++) {
+		if (i && (p == end || *p++ != ','))
+			return false;
+		if (!parseInt(p, end, v[i]) || v[i] < INT_MIN || v[i] > INT_MAX)
+			return false;
+	}
+	if (p != end)
+		return false;
+	x = int(v[0]);
+	y = int(v[1]);
+	z = int(v[2]);
+	return true;
+}
+
+inline void BlockPos::assign(const char *s, size_t length)
+{
+	const char *p = s;
+	const char *end = s + length;
+	if (p != end && (isdigit(*p) || *p == '-' || *p == '+')) {
 		int64_t ipos;
-		is >> ipos;
-		if (is.bad() || !is.eof()) {
-			throw std::runtime_error(std::string("Failed to decode i64 (minetest) coordinate string from database (") + s + ")" );
+		if (parseInt(p, end, ipos) && p == end) {
+			operator=(ipos);
+			m_strFormat = I64;
+		}
+		else if (p != end && *p == ',') {
+			if (!parseXYZ(s, end)) {
+				throw std::runtime_error(std::string("Failed to decode xyz coordinate string from database (") + std::string(s, length) + ")" );
+			}
+			m_strFormat = XYZ;
+		}
+		else {
+			throw std::runtime_error(std::string("Failed to decode i64 (minetest) coordinate string from database (") + std::string(s, length) + ")" );
 		}
-		operator=(ipos);
-		m_strFormat = I64;
 	}
-	else if (is.peek() == 'a') {
+	else if (p != end && *p == 'a') {
 		// Freeminer new format (a<x>,<y>,<z>)
-		char c1, c2;
-		is >> c1;
-		is >> x;
-		is >> c1;
-		is >> y;
-		is >> c2;
-		is >> z;
-		if (is.bad() || !is.eof() || c1 != ',' || c2 != ',') {
-			throw std::runtime_error(std::string("Failed to decode axyz (freeminer) coordinate string from database (") + s + ")" );
+		if (!parseXYZ(p + 1, end)) {
+			throw std::runtime_error(std::string("Failed to decode axyz (freeminer) coordinate string from database (") + std::string(s, length) + ")" );
 		}
 		m_strFormat = AXYZ;
 	}
 	else {
-		throw std::runtime_error(std::string("Failed to detect format of coordinate string from database (") + s + ")" );
+		throw std::runtime_error(std::string("Failed to detect format of coordinate string from database (") + std::string(s, length) + ")" );
 	}
 }
 
 inline std::string BlockPos::databasePosStr(StrFormat defaultFormat) const
+{
+	char buffer[StrBufferSize];
+	return std::string(buffer, databasePosStr(buffer, defaultFormat));
+}
+
+inline size_t BlockPos::databasePosStr(char *buffer, StrFormat defaultFormat) const
 {
 	StrFormat format = m_strFormat;
 	if (format == Unknown)
 		format = defaultFormat;
-	return databasePosStrFmt(format);
+	return databasePosStrFmt(buffer, format);
 }
 
-
 inline std::string BlockPos::databasePosStrFmt(StrFormat format) const
 {
-	std::ostringstream os;
+	char buffer[StrBufferSize];
+	return std::string(buffer, databasePosStrFmt(buffer, format));
+}
+
+// Format a (decimal) integer. Returns the number of characters written.
+inline size_t BlockPos::formatInt(char *buffer, int64_t value)
+{
+	char digits[20];
+	size_t n = 0;
+	size_t length = 0;
+	uint64_t v = value < 0 ? 0 - uint64_t(value) : uint64_t(value);
+	do {
+		digits[n++] = char('0' + v % 10);
+		v /= 10;
+	} while (v);
+	if (value < 0)
+		buffer[length++] = '-';
+	while (n)
+		buffer[length++] = digits[--n];
+	return length;
+}
+
+inline size_t BlockPos::databasePosStrFmt(char *buffer, StrFormat format) const
+{
+	size_t length = 0;
 	switch(format) {
 	case Unknown:
 		throw std::runtime_error(std::string("Internal error: Converting BlockPos to unknown string type"));
 		break;
 	case I64:
-		os << databasePosI64();
-		break;
-	case XYZ:
-		os << x << ',' << y << ',' << z;
+		length = formatInt(buffer, databasePosI64());
 		break;
 	case AXYZ:
-		os << 'a' << x << ',' << y << ',' << z;
+		buffer[length++] = 'a';
+		// Fall through
+	case XYZ:
+		length += formatInt(buffer + length, x);
+		buffer[length++] = ',';
+		length += formatInt(buffer + length, y);
+		buffer[length++] = ',';
+		length += formatInt(buffer + length, z);
 		break;
 	}
-	return os.str();
+	buffer[length] = '\0';
+	return length;
 }
 
 // operator< should order the positions in the
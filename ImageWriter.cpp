@@ -0,0 +1,89 @@
+
+#include "ImageWriter.h"
+
+static const char *formatNames[] = { "png", "ppm", "pam", "rgba", "height16", "heightfloat", "pyramid" };
+
+bool ImageWriter::parseFormat(const std::string &name, Format &format)
+{
+	for (int i = FormatPng; i <= FormatPyramid; i++) {
+		if (name == formatNames[i]) {
+			format = Format(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+ThreadedImageWriter::ThreadedImageWriter(ImageWriter *writer) :
+	m_writer(writer),
+	m_pixels(0),
+	m_heights(0),
+	m_rows(0),
+	m_stop(false),
+	m_thread(&ThreadedImageWriter::run, this)
+{
+}
+
+ThreadedImageWriter::~ThreadedImageWriter()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_condition.notify_all();
+	m_thread.join();
+	delete m_writer;
+}
+
+void ThreadedImageWriter::waitIdle(std::unique_lock<std::mutex> &lock)
+{
+	while (m_pixels)
+		m_condition.wait(lock);
+	if (m_error) {
+		std::exception_ptr error = m_error;
+		m_error = std::exception_ptr();
+		std::rethrow_exception(error);
+	}
+}
+
+void ThreadedImageWriter::writeRows(const int *pixels, const float *heights, int rows)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		waitIdle(lock);
+		m_pixels = pixels;
+		m_heights = heights;
+		m_rows = rows;
+	}
+	m_condition.notify_all();
+}
+
+void ThreadedImageWriter::finish(void)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	waitIdle(lock);
+	m_writer->finish();
+}
+
+void ThreadedImageWriter::run(void)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		while (!m_pixels && !m_stop)
+			m_condition.wait(lock);
+		if (!m_pixels)
+			break;
+		lock.unlock();
+		std::exception_ptr error;
+		try {
+			m_writer->writeRows(m_pixels, m_heights, m_rows);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		lock.lock();
+		m_error = error;
+		m_pixels = 0;
+		m_condition.notify_all();
+	}
+}
@@ -0,0 +1,69 @@
+
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Writes an image file one band of rows at a time, top to bottom.
+//
+// Pixels are libgd truecolor values (0xAARRGGBB, with gd's 7-bit alpha).
+// Heights are the height of the surface at each pixel (NAN if there is none).
+// They are only provided to writers that use them.
+class ImageWriter
+{
+public:
+	enum Format {
+		FormatPng,
+		FormatPpm,
+		FormatPam,
+		FormatRgba,
+		FormatHeight16,
+		FormatHeightFloat,
+		FormatPyramid,
+	};
+	static bool parseFormat(const std::string &name, Format &format);
+	static bool formatUsesHeights(Format format) { return format == FormatHeight16 || format == FormatHeightFloat; }
+
+	virtual ~ImageWriter() {}
+	virtual bool usesHeights(void) const { return false; }
+	virtual void writeRows(const int *pixels, const float *heights, int rows) = 0;
+	// Write any remaining data. All rows of the image must have been written.
+	virtual void finish(void) = 0;
+};
+
+// Runs another image writer on a background thread, so that encoding the
+// image overlaps with rendering it.
+//
+// writeRows() returns as soon as the rows of the previous call have been
+// written. The pixels passed must therefore remain valid until the next call
+// to writeRows() or finish().
+class ThreadedImageWriter : public ImageWriter
+{
+public:
+	// Takes ownership of writer
+	ThreadedImageWriter(ImageWriter *writer);
+	virtual ~ThreadedImageWriter();
+	virtual bool usesHeights(void) const { return m_writer->usesHeights(); }
+	virtual void writeRows(const int *pixels, const float *heights, int rows);
+	virtual void finish(void);
+
+private:
+	void run(void);
+	void waitIdle(std::unique_lock<std::mutex> &lock);
+
+	ImageWriter *m_writer;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	const int *m_pixels;
+	const float *m_heights;
+	int m_rows;
+	bool m_stop;
+	std::exception_ptr m_error;
+	std::thread m_thread;
+};
+
+#endif // IMAGEWRITER_H
@@ -0,0 +1,167 @@
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include "MapStateFile.h"
+
+#define MAPSTATE_MAGIC		"MMSTATE1"
+#define MAPSTATE_MAGIC_SIZE	8
+
+MapStateFile::MapStateFile(const std::string &path) :
+	m_path(path),
+	m_tempPath(path + ".tmp"),
+	m_previousFile(0),
+	m_file(0),
+	m_width(0),
+	m_hasHeights(false),
+	m_surfaceOffset(0),
+	m_previousSurfaceHeight(0),
+	m_previousSurfaceDepth(0)
+{
+}
+
+MapStateFile::~MapStateFile()
+{
+	if (m_previousFile)
+		fclose(m_previousFile);
+	if (m_file) {
+		fclose(m_file);
+		remove(m_tempPath.c_str());
+	}
+}
+
+bool MapStateFile::load(const std::string &signature, int width, int height, bool hasHeights)
+{
+	m_previousFile = fopen(m_path.c_str(), "rb");
+	if (!m_previousFile)
+		return false;
+	char magic[MAPSTATE_MAGIC_SIZE];
+	uint32_t signatureLength;
+	int32_t header[5];
+	uint64_t blockCount;
+	bool match = fread(magic, sizeof(magic), 1, m_previousFile) == 1
+		&& !memcmp(magic, MAPSTATE_MAGIC, MAPSTATE_MAGIC_SIZE)
+		&& fread(&signatureLength, sizeof(signatureLength), 1, m_previousFile) == 1
+		&& signatureLength == signature.length();
+	if (match) {
+		std::vector<char> previousSignature(signatureLength + 1);
+		match = fread(&previousSignature[0], 1, signatureLength, m_previousFile) == signatureLength
+			&& !memcmp(&previousSignature[0], signature.c_str(), signatureLength)
+			&& fread(header, sizeof(header), 1, m_previousFile) == 1
+			&& header[0] == width && header[1] == height && header[2] == hasHeights
+			&& fread(&blockCount, sizeof(blockCount), 1, m_previousFile) == 1
+			&& blockCount < (uint64_t(1) << 32);
+	}
+	if (match) {
+		m_previousBlocks.resize(blockCount);
+		match = !blockCount || fread(&m_previousBlocks[0], sizeof(Block), blockCount, m_previousFile) == blockCount;
+	}
+	if (!match) {
+		fclose(m_previousFile);
+		m_previousFile = 0;
+		m_previousBlocks.clear();
+		return false;
+	}
+	m_width = width;
+	m_hasHeights = hasHeights;
+	m_previousSurfaceHeight = header[3];
+	m_previousSurfaceDepth = header[4];
+	return true;
+}
+
+void MapStateFile::readRows(int *pixels, float *heights, int rows)
+{
+	for (int y = 0; y < rows; y++) {
+		readData(pixels + size_t(y) * m_width, m_width * sizeof(int));
+		if (m_hasHeights)
+			readData(heights + size_t(y) * m_width, m_width * sizeof(float));
+	}
+}
+
+void MapStateFile::create(const std::string &signature, int width, int height, bool hasHeights, const BlockList &blocks)
+{
+	m_file = fopen(m_tempPath.c_str(), "wb");
+	if (!m_file) {
+		std::ostringstream oss;
+		oss << "Error opening '" << m_tempPath << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	m_width = width;
+	m_hasHeights = hasHeights;
+	uint32_t signatureLength = signature.length();
+	writeData(MAPSTATE_MAGIC, MAPSTATE_MAGIC_SIZE);
+	writeData(&signatureLength, sizeof(signatureLength));
+	writeData(signature.c_str(), signatureLength);
+	int32_t header[3] = { width, height, hasHeights };
+	writeData(header, sizeof(header));
+	// The surface height and depth are only known at the end
+	m_surfaceOffset = MAPSTATE_MAGIC_SIZE + sizeof(signatureLength) + signatureLength + sizeof(header);
+	int32_t surface[2] = { 0, 0 };
+	writeData(surface, sizeof(surface));
+	uint64_t blockCount = blocks.size();
+	writeData(&blockCount, sizeof(blockCount));
+	if (blockCount)
+		writeData(&blocks[0], blockCount * sizeof(Block));
+}
+
+void MapStateFile::writeRows(const int *pixels, const float *heights, int rows)
+{
+	for (int y = 0; y < rows; y++) {
+		writeData(pixels + size_t(y) * m_width, m_width * sizeof(int));
+		if (m_hasHeights)
+			writeData(heights + size_t(y) * m_width, m_width * sizeof(float));
+	}
+}
+
+void MapStateFile::commit(int surfaceHeight, int surfaceDepth)
+{
+	int32_t surface[2] = { surfaceHeight, surfaceDepth };
+	if (fseek(m_file, m_surfaceOffset, SEEK_SET)) {
+		std::ostringstream oss;
+		oss << "Error writing '" << m_tempPath << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	writeData(surface, sizeof(surface));
+	int result = fclose(m_file);
+	m_file = 0;
+	if (result) {
+		std::ostringstream oss;
+		oss << "Error writing '" << m_tempPath << "': " << std::strerror(errno);
+		remove(m_tempPath.c_str());
+		throw std::runtime_error(oss.str());
+	}
+	if (m_previousFile) {
+		fclose(m_previousFile);
+		m_previousFile = 0;
+	}
+#if MSDOS || __OS2__ || __NT__ || _WIN32
+	// rename() doesn't replace existing files on windows
+	remove(m_path.c_str());
+#endif
+	if (rename(m_tempPath.c_str(), m_path.c_str())) {
+		std::ostringstream oss;
+		oss << "Error renaming '" << m_tempPath << "' to '" << m_path << "': " << std::strerror(errno);
+		remove(m_tempPath.c_str());
+		throw std::runtime_error(oss.str());
+	}
+}
+
+void MapStateFile::readData(void *data, size_t size)
+{
+	if (fread(data, 1, size, m_previousFile) != size) {
+		std::ostringstream oss;
+		oss << "Error reading '" << m_path << "': " << (ferror(m_previousFile) ? std::strerror(errno) : "file truncated")
+			<< " (remove it to render the entire map)";
+		throw std::runtime_error(oss.str());
+	}
+}
+
+void MapStateFile::writeData(const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, m_file) != size) {
+		std::ostringstream oss;
+		oss << "Error writing '" << m_tempPath << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
@@ -0,0 +1,62 @@
+
+#ifndef MAPSTATEFILE_H
+#define MAPSTATEFILE_H
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// The state of a rendered map, as needed to update it incrementally: the
+// fingerprints of the map blocks it was rendered from, and its pixels (and
+// heights) before the overlays (scales, players, ...) were drawn.
+//
+// The previous state is read while the new state is written to a temporary file,
+// which replaces the previous state when commit() is called. Until then (e.g. if
+// rendering fails), the previous state is kept.
+//
+// The file is a cache for the machine that wrote it: numbers are stored in the
+// machine's native format.
+class MapStateFile
+{
+public:
+	struct Block {
+		uint64_t key;			// Block position, encoded by the caller
+		uint64_t fingerprint;
+		bool operator<(const Block &other) const { return key < other.key || (key == other.key && fingerprint < other.fingerprint); }
+	};
+	typedef std::vector<Block> BlockList;
+
+	MapStateFile(const std::string &path);
+	~MapStateFile();
+	// Open the previous state. Returns false if there is none, or if it belongs to
+	// a different map (signature) or image.
+	bool load(const std::string &signature, int width, int height, bool hasHeights);
+	const BlockList &previousBlocks(void) const { return m_previousBlocks; }
+	int previousSurfaceHeight(void) const { return m_previousSurfaceHeight; }
+	int previousSurfaceDepth(void) const { return m_previousSurfaceDepth; }
+	// Read the next rows of the previous state. heights may be NULL if there are none.
+	void readRows(int *pixels, float *heights, int rows);
+
+	void create(const std::string &signature, int width, int height, bool hasHeights, const BlockList &blocks);
+	void writeRows(const int *pixels, const float *heights, int rows);
+	// Finish the new state, and have it replace the previous state.
+	void commit(int surfaceHeight, int surfaceDepth);
+
+private:
+	void readData(void *data, size_t size);
+	void writeData(const void *data, size_t size);
+
+	std::string m_path;
+	std::string m_tempPath;
+	FILE *m_previousFile;
+	FILE *m_file;
+	int m_width;
+	bool m_hasHeights;
+	long m_surfaceOffset;
+	BlockList m_previousBlocks;
+	int m_previousSurfaceHeight;
+	int m_previousSurfaceDepth;
+};
+
+#endif // MAPSTATEFILE_H
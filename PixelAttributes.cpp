@@ -10,13 +10,25 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "PixelAttributes.h"
 
 using namespace std;
 
-PixelAttribute::AlphaMixingMode PixelAttribute::m_mixMode = PixelAttribute::AlphaMixCumulative;
+// Alignment of the attribute arrays, suitable for vector loads
+#define PIXELATTRIBUTES_ALIGNMENT 64
 
 PixelAttributes::PixelAttributes():
+	m_lineCount(0),
+	m_ringOffset(0),
+	m_channelSize(0),
+	m_lineSize(0),
+	m_data(0),
+	m_emptyFlags(0),
 	m_pixelAttributes(0)
 {
 }
@@ -33,48 +45,75 @@ void PixelAttributes::setParameters(int width, int lines, int nextY, int scale,
 	m_previousLine = 0;
 	m_firstLine = 1;
 	m_lastLine = m_firstLine + lines - 1;
-	m_emptyLine = m_lastLine + 1;
-	m_lineCount = m_emptyLine + 1;
+	m_lineCount = m_lastLine + 1;
+	m_ringOffset = 0;
+	const size_t channelAlign = PIXELATTRIBUTES_ALIGNMENT / sizeof(float);
+	m_channelSize = (m_width + channelAlign - 1) / channelAlign * channelAlign;
+	m_lineSize = 7 * m_channelSize * sizeof(float) + (m_width + PIXELATTRIBUTES_ALIGNMENT - 1) / PIXELATTRIBUTES_ALIGNMENT * PIXELATTRIBUTES_ALIGNMENT;
 	m_firstY = 0;
 	m_nextY = nextY;
 	m_lastY = -1;
 	m_firstUnshadedY = 0;
 	m_scale = scale;
 
-	m_pixelAttributes = new PixelAttribute *[m_lineCount];
-	if (!m_pixelAttributes)
+	// One allocation holds all lines, followed by the flags of an empty line
+	m_data = new char[m_lineCount * m_lineSize + m_width + PIXELATTRIBUTES_ALIGNMENT];
+	m_pixelAttributes = new PixelLine[m_lineCount];
+	if (!m_data || !m_pixelAttributes)
 		throw std::runtime_error("Failed to allocate memory for PixelAttributes");
 
+	char *data = m_data + (PIXELATTRIBUTES_ALIGNMENT - reinterpret_cast<uintptr_t>(m_data) % PIXELATTRIBUTES_ALIGNMENT) % PIXELATTRIBUTES_ALIGNMENT;
 	for (int i = 0; i < m_lineCount; ++i) {
-		m_pixelAttributes[i] = new PixelAttribute[m_width];
-		if (!m_pixelAttributes[i])
-			throw std::runtime_error("Failed to allocate memory for PixelAttributes");
-	}
-	for (int i=0; i<m_lineCount; i++)
-		for (int j=0; j<m_width; j++) {
-			m_pixelAttributes[i][j].m_a=0;
-			if (defaultEmpty)
-				m_pixelAttributes[i][j].nextEmpty = (j - 1) % (16 / scale) == 0;
-			else
-				m_pixelAttributes[i][j].nextEmpty = false;
-		}
+		PixelLine &line = m_pixelAttributes[i];
+		float *channel = reinterpret_cast<float *>(data + i * m_lineSize);
+		line.n = channel; channel += m_channelSize;
+		line.h = channel; channel += m_channelSize;
+		line.t = channel; channel += m_channelSize;
+		line.a = channel; channel += m_channelSize;
+		line.r = channel; channel += m_channelSize;
+		line.g = channel; channel += m_channelSize;
+		line.b = channel; channel += m_channelSize;
+		line.flags = reinterpret_cast<uint8_t *>(channel);
+	}
+	m_emptyFlags = reinterpret_cast<uint8_t *>(data + m_lineCount * m_lineSize);
+	for (int j = 0; j < m_width; j++) {
+		if (defaultEmpty && (j - 1) % (16 / scale) == 0)
+			m_emptyFlags[j] = PixelLine::NextEmpty;
+		else
+			m_emptyFlags[j] = 0;
+	}
+	for (int i = 0; i < m_lineCount; ++i)
+		clearLine(m_pixelAttributes[i]);
+}
+
+// The attribute arrays of a line are contiguous, so they can be cleared at once
+void PixelAttributes::clearLine(const PixelLine &line)
+{
+	memset(line.n, 0, 7 * m_channelSize * sizeof(float));
+	memcpy(line.flags, m_emptyFlags, m_width);
+}
+
+const PixelLine &PixelAttributes::dummyLine(void)
+{
+	static float channels[7];
+	static uint8_t flags;
+	static const PixelLine line = { &channels[0], &channels[1], &channels[2], &channels[3], &channels[4], &channels[5], &channels[6], &flags };
+	return line;
 }
 
 void PixelAttributes::scroll(int keepY)
 {
 	int scroll = keepY - m_firstY;
 	if (scroll > 0) {
-		int i;
-		for (i = m_previousLine; i + scroll <= m_lastLine; i++) {
-			PixelAttribute *tmp;
-			tmp = m_pixelAttributes[i];
-			m_pixelAttributes[i] = m_pixelAttributes[i + scroll];
-			m_pixelAttributes[i + scroll] = tmp;
+		// Rotate the ring buffer, and clear the lines that have become available
+		if (scroll >= m_lineCount) {
+			for (int i = 0; i < m_lineCount; i++)
+				clearLine(m_pixelAttributes[i]);
 		}
-
-		size_t lineLength = m_width * sizeof(PixelAttribute);
-		for (; i <= m_lastLine; ++i) {
-			memcpy(m_pixelAttributes[i], m_pixelAttributes[m_emptyLine], lineLength);
+		else {
+			m_ringOffset = (m_ringOffset + scroll) % m_lineCount;
+			for (int i = m_lineCount - scroll; i <= m_lastLine; i++)
+				clearLine(line(i));
 		}
 
 		m_firstY += scroll;
@@ -84,19 +123,185 @@ void PixelAttributes::scroll(int keepY)
 	}
 }
 
+void PixelAttributes::savePixels(int y, int x, int count, char *data)
+{
+	if (!lineExists(y)) {
+		memset(data, 0, pixelDataSize(count));
+		return;
+	}
+	const PixelLine &l = line(yCoord2Line(y));
+	float *channels[7] = { l.n, l.h, l.t, l.a, l.r, l.g, l.b };
+	for (int c = 0; c < 7; c++) {
+		memcpy(data, channels[c] + x + 1, count * sizeof(float));
+		data += count * sizeof(float);
+	}
+	memcpy(data, l.flags + x + 1, count);
+}
+
+void PixelAttributes::loadPixels(int y, int x, int count, const char *data)
+{
+	if (!lineExists(y))
+		return;
+	const PixelLine &l = line(yCoord2Line(y));
+	float *channels[7] = { l.n, l.h, l.t, l.a, l.r, l.g, l.b };
+	for (int c = 0; c < 7; c++) {
+		memcpy(channels[c] + x + 1, data, count * sizeof(float));
+		data += count * sizeof(float);
+	}
+	memcpy(l.flags + x + 1, data, count);
+}
+
 void PixelAttributes::freeAttributes()
 {
 	if (m_pixelAttributes) {
-		for (int i = 0; i < m_lineCount; ++i) {
-			if (m_pixelAttributes[i] != 0) {
-				delete[] m_pixelAttributes[i];
-			}
-		}
 		delete[] m_pixelAttributes;
 		m_pixelAttributes = 0;
 	}
+	if (m_data) {
+		delete[] m_data;
+		m_data = 0;
+		m_emptyFlags = 0;
+	}
+}
+
+
+// Add pixels xBegin .. xEnd-1 of line y to line y / scale of 'scaled', so that
+// every pixel of 'scaled' accumulates a box of scale x scale pixels.
+void PixelAttributes::scaleLine(PixelAttributes &scaled, int y, int xBegin, int xEnd, int scale)
+{
+	if (!lineExists(y) || !scaled.lineExists(y / scale))
+		return;
+	const PixelLine &scaledLine = scaled.line(scaled.yCoord2Line(y / scale));
+	switch (scale) {
+	case 2: scaleLine<2>(scaledLine, y, xBegin, xEnd, scale); break;
+	case 4: scaleLine<4>(scaledLine, y, xBegin, xEnd, scale); break;
+	case 8: scaleLine<8>(scaledLine, y, xBegin, xEnd, scale); break;
+	case 16: scaleLine<16>(scaledLine, y, xBegin, xEnd, scale); break;
+	default: scaleLine<0>(scaledLine, y, xBegin, xEnd, scale); break;
+	}
+}
+
+#if defined(__SSE2__)
+// Load 4 consecutive boxes of scaleFactor floats, and return the n-th float of each box in element[n].
+template<int scaleFactor>
+static inline void loadBoxElements(const float *data, __m128 *element)
+{
+	if (scaleFactor == 2) {
+		__m128 v0 = _mm_loadu_ps(data);
+		__m128 v1 = _mm_loadu_ps(data + 4);
+		element[0] = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0));
+		element[1] = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1));
+	}
+	else {
+		const int quads = scaleFactor / 4;
+		for (int q = 0; q < quads; q++) {
+			__m128 v0 = _mm_loadu_ps(data + 4 * q);
+			__m128 v1 = _mm_loadu_ps(data + 4 * (quads + q));
+			__m128 v2 = _mm_loadu_ps(data + 4 * (2 * quads + q));
+			__m128 v3 = _mm_loadu_ps(data + 4 * (3 * quads + q));
+			_MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+			element[4 * q] = v0;
+			element[4 * q + 1] = v1;
+			element[4 * q + 2] = v2;
+			element[4 * q + 3] = v3;
+		}
+	}
 }
+#endif
+
+// Box filter, specialized per scale factor (scaleFactor 0: any factor, no vectorization)
+//
+// Four complete boxes of normalized, valid pixels are added to four scaled pixels at once.
+// The pixels of a box are added in the same order, and with the same operations as
+// PixelAttribute::add() does, so the result is identical.
+template<int scaleFactor>
+void PixelAttributes::scaleLine(const PixelLine &scaledLine, int y, int xBegin, int xEnd, int scale)
+{
+	if (scaleFactor)
+		scale = scaleFactor;
+	const PixelLine &line = this->line(yCoord2Line(y));
+	int x = xBegin;
+	while (x < xEnd) {
+		// Array indices are offset by one (see attribute())
+		int i = x + 1;
+		if (line.flags[i] & PixelLine::NextEmpty) {
+			scaledLine.flags[x / scale + 1] |= PixelLine::NextEmpty;
+			x += 16;
+			continue;
+		}
+#if defined(__SSE2__)
+		if (scaleFactor && x % scaleFactor == 0 && x + 4 * scaleFactor <= xEnd) {
+			bool normal = true;
+			for (int j = i; j < i + 4 * scaleFactor; j++) {
+				if (line.flags[j] != PixelLine::Valid || line.n[j]) {
+					normal = false;
+					break;
+				}
+			}
+			if (normal) {
+				int d = x / scaleFactor + 1;
+				const __m128 zero = _mm_setzero_ps();
+				const __m128 one = _mm_set1_ps(1);
+				__m128 valid = _mm_castsi128_ps(_mm_set_epi32(
+					-int(scaledLine.flags[d + 3] & PixelLine::Valid), -int(scaledLine.flags[d + 2] & PixelLine::Valid),
+					-int(scaledLine.flags[d + 1] & PixelLine::Valid), -int(scaledLine.flags[d] & PixelLine::Valid)));
+				__m128 n = _mm_loadu_ps(scaledLine.n + d);
+				__m128 h = _mm_and_ps(valid, _mm_loadu_ps(scaledLine.h + d));
+				__m128 t = _mm_and_ps(valid, _mm_loadu_ps(scaledLine.t + d));
+				__m128 a = _mm_and_ps(valid, _mm_loadu_ps(scaledLine.a + d));
+				__m128 r = _mm_and_ps(valid, _mm_loadu_ps(scaledLine.r + d));
+				__m128 g = _mm_and_ps(valid, _mm_loadu_ps(scaledLine.g + d));
+				__m128 b = _mm_and_ps(valid, _mm_loadu_ps(scaledLine.b + d));
+				// Convert normalized pixels to sums (and invalid pixels to empty sums)
+				__m128 normalized = _mm_cmpeq_ps(n, zero);
+				r = _mm_or_ps(_mm_and_ps(normalized, _mm_mul_ps(r, a)), _mm_andnot_ps(normalized, r));
+				g = _mm_or_ps(_mm_and_ps(normalized, _mm_mul_ps(g, a)), _mm_andnot_ps(normalized, g));
+				b = _mm_or_ps(_mm_and_ps(normalized, _mm_mul_ps(b, a)), _mm_andnot_ps(normalized, b));
+				n = _mm_and_ps(valid, _mm_or_ps(_mm_and_ps(normalized, one), _mm_andnot_ps(normalized, n)));
 
+				__m128 pa[scaleFactor ? scaleFactor : 1], pv[scaleFactor ? scaleFactor : 1];
+				loadBoxElements<scaleFactor>(line.a + i, pa);
+				#define ADD_COLOR(c) \
+					loadBoxElements<scaleFactor>(line.c + i, pv); \
+					for (int k = 0; k < scaleFactor; k++) \
+						c = _mm_add_ps(c, _mm_mul_ps(pv[k], pa[k]));
+				ADD_COLOR(r)
+				ADD_COLOR(g)
+				ADD_COLOR(b)
+				#undef ADD_COLOR
+				for (int k = 0; k < scaleFactor; k++)
+					a = _mm_add_ps(a, pa[k]);
+				loadBoxElements<scaleFactor>(line.h + i, pv);
+				for (int k = 0; k < scaleFactor; k++)
+					h = _mm_add_ps(h, pv[k]);
+				// An invalid pixel is replaced by the first pixel added, without its thickness
+				loadBoxElements<scaleFactor>(line.t + i, pv);
+				t = _mm_add_ps(t, _mm_and_ps(valid, pv[0]));
+				for (int k = 1; k < scaleFactor; k++)
+					t = _mm_add_ps(t, pv[k]);
+				for (int k = 0; k < scaleFactor; k++)
+					n = _mm_add_ps(n, one);
+
+				_mm_storeu_ps(scaledLine.n + d, n);
+				_mm_storeu_ps(scaledLine.h + d, h);
+				_mm_storeu_ps(scaledLine.t + d, t);
+				_mm_storeu_ps(scaledLine.a + d, a);
+				_mm_storeu_ps(scaledLine.r + d, r);
+				_mm_storeu_ps(scaledLine.g + d, g);
+				_mm_storeu_ps(scaledLine.b + d, b);
+				for (int j = d; j < d + 4; j++)
+					scaledLine.flags[j] |= PixelLine::Valid;
+				x += 4 * scaleFactor;
+				continue;
+			}
+		}
+#endif
+		PixelAttributeRef pixel(line, i);
+		if (pixel.is_valid() || pixel.color().to_uint())
+			PixelAttributeRef(scaledLine, x / scale + 1).add(pixel);
+		x++;
+	}
+}
 
 static inline double colorSafeBounds(double color)
 {
@@ -112,43 +317,196 @@ static inline double colorSafeBounds(double color)
 }
 
 
-void PixelAttributes::renderShading(double emphasis, bool drawAlpha)
+static inline void shadePixel(const PixelLine &line, const PixelLine &previousLine, int x, double emphasis, bool drawAlpha)
+{
+	if (!(line.flags[x] & previousLine.flags[x] & line.flags[x - 1] & PixelLine::Valid))
+		return;
+	if (!line.a[x])
+		return;
+	double h = line.h[x];
+	double h1 = line.a[x - 1] ? line.h[x - 1] : h;
+	double h2 = previousLine.a[x] ? previousLine.h[x] : h;
+	double d = (h - h1) + (h - h2);
+	if (d > 3) {
+		d = 3;
+	}
+	d = d * 12 / 255 * emphasis;
+	if (drawAlpha)
+		d = d * (1 - line.t[x]);
+	line.r[x] = colorSafeBounds(line.r[x] + d);
+	line.g[x] = colorSafeBounds(line.g[x] + d);
+	line.b[x] = colorSafeBounds(line.b[x] + d);
+}
+
+// Shade the (normalized) pixels x .. end-1 of a line.
+// The vector versions compute in double precision as well, so that the result is
+// identical to the scalar computation.
+static void shadePixels(const PixelLine &line, const PixelLine &previousLine, int x, int end, double emphasis, bool drawAlpha)
+{
+#if defined(__AVX2__)
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1);
+	const __m256d maxD = _mm256_set1_pd(3);
+	const __m256d mul = _mm256_set1_pd(12);
+	const __m256d div = _mm256_set1_pd(255);
+	const __m256d vEmphasis = _mm256_set1_pd(emphasis);
+	const __m256i validBit = _mm256_set1_epi64x(PixelLine::Valid);
+	for (; x + 4 <= end; x += 4) {
+		uint32_t flags, leftFlags, upFlags;
+		memcpy(&flags, line.flags + x, 4);
+		memcpy(&leftFlags, line.flags + x - 1, 4);
+		memcpy(&upFlags, previousLine.flags + x, 4);
+		uint32_t valid = flags & leftFlags & upFlags & (PixelLine::Valid * 0x01010101U);
+		if (!valid)
+			continue;
+		__m256i validMask = _mm256_cmpeq_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(valid)), validBit);
+		__m256d a = _mm256_cvtps_pd(_mm_loadu_ps(line.a + x));
+		__m256d mask = _mm256_andnot_pd(_mm256_cmp_pd(a, zero, _CMP_EQ_OQ), _mm256_castsi256_pd(validMask));
+		if (!_mm256_movemask_pd(mask))
+			continue;
+		__m256d h = _mm256_cvtps_pd(_mm_loadu_ps(line.h + x));
+		__m256d h1 = _mm256_cvtps_pd(_mm_loadu_ps(line.h + x - 1));
+		__m256d a1 = _mm256_cvtps_pd(_mm_loadu_ps(line.a + x - 1));
+		__m256d h2 = _mm256_cvtps_pd(_mm_loadu_ps(previousLine.h + x));
+		__m256d a2 = _mm256_cvtps_pd(_mm_loadu_ps(previousLine.a + x));
+		h1 = _mm256_blendv_pd(h1, h, _mm256_cmp_pd(a1, zero, _CMP_EQ_OQ));
+		h2 = _mm256_blendv_pd(h2, h, _mm256_cmp_pd(a2, zero, _CMP_EQ_OQ));
+		__m256d d = _mm256_add_pd(_mm256_sub_pd(h, h1), _mm256_sub_pd(h, h2));
+		d = _mm256_min_pd(d, maxD);
+		d = _mm256_mul_pd(_mm256_div_pd(_mm256_mul_pd(d, mul), div), vEmphasis);
+		if (drawAlpha)
+			d = _mm256_mul_pd(d, _mm256_sub_pd(one, _mm256_cvtps_pd(_mm_loadu_ps(line.t + x))));
+		float *channels[3] = { line.r, line.g, line.b };
+		for (int c = 0; c < 3; c++) {
+			__m256d color = _mm256_cvtps_pd(_mm_loadu_ps(channels[c] + x));
+			__m256d shaded = _mm256_min_pd(_mm256_max_pd(_mm256_add_pd(color, d), zero), one);
+			_mm_storeu_ps(channels[c] + x, _mm256_cvtpd_ps(_mm256_blendv_pd(color, shaded, mask)));
+		}
+	}
+#elif defined(__SSE2__)
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d one = _mm_set1_pd(1);
+	const __m128d maxD = _mm_set1_pd(3);
+	const __m128d mul = _mm_set1_pd(12);
+	const __m128d div = _mm_set1_pd(255);
+	const __m128d vEmphasis = _mm_set1_pd(emphasis);
+	for (; x + 2 <= end; x += 2) {
+		uint8_t valid0 = line.flags[x] & line.flags[x - 1] & previousLine.flags[x] & PixelLine::Valid;
+		uint8_t valid1 = line.flags[x + 1] & line.flags[x] & previousLine.flags[x + 1] & PixelLine::Valid;
+		if (!valid0 && !valid1)
+			continue;
+		__m128d a = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(line.a + x))));
+		__m128d mask = _mm_andnot_pd(_mm_cmpeq_pd(a, zero), _mm_castsi128_pd(_mm_set_epi64x(-int64_t(valid1), -int64_t(valid0))));
+		if (!_mm_movemask_pd(mask))
+			continue;
+		#define LOAD2(p) _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))))
+		#define SELECT(m, t, f) _mm_or_pd(_mm_and_pd(m, t), _mm_andnot_pd(m, f))
+		__m128d h = LOAD2(line.h + x);
+		__m128d h1 = SELECT(_mm_cmpeq_pd(LOAD2(line.a + x - 1), zero), h, LOAD2(line.h + x - 1));
+		__m128d h2 = SELECT(_mm_cmpeq_pd(LOAD2(previousLine.a + x), zero), h, LOAD2(previousLine.h + x));
+		__m128d d = _mm_add_pd(_mm_sub_pd(h, h1), _mm_sub_pd(h, h2));
+		d = _mm_min_pd(d, maxD);
+		d = _mm_mul_pd(_mm_div_pd(_mm_mul_pd(d, mul), div), vEmphasis);
+		if (drawAlpha)
+			d = _mm_mul_pd(d, _mm_sub_pd(one, LOAD2(line.t + x)));
+		float *channels[3] = { line.r, line.g, line.b };
+		for (int c = 0; c < 3; c++) {
+			__m128d color = LOAD2(channels[c] + x);
+			__m128d shaded = _mm_min_pd(_mm_max_pd(_mm_add_pd(color, d), zero), one);
+			_mm_storel_epi64(reinterpret_cast<__m128i *>(channels[c] + x), _mm_castps_si128(_mm_cvtpd_ps(SELECT(mask, shaded, color))));
+		}
+		#undef LOAD2
+		#undef SELECT
+	}
+#endif
+	for (; x < end; x++)
+		shadePixel(line, previousLine, x, emphasis, drawAlpha);
+}
+
+// Normalize the pixels of a scaled line, after all pixels have been added
+void PixelAttributes::normalizeLine(int y, int xBegin, int xEnd)
+{
+	if (!lineExists(y))
+		return;
+	const PixelLine &line = this->line(yCoord2Line(y));
+	for (int x = xBegin; x < xEnd; x++) {
+		int i = x + 1;
+		if (line.flags[i] & PixelLine::NextEmpty) {
+			x += 16 / m_scale - 1;
+			continue;
+		}
+		if (!line.n[i])
+			continue;
+		PixelAttributeRef pixel(line, i);
+		if (pixel.is_valid() || pixel.color().to_uint())
+			pixel.normalize();
+	}
+}
+
+// Convert pixels xBegin .. xEnd-1 of line y to libgd colors, and store them in pixels[0 ..].
+// Pixels without color are not stored.
+// Returns the next pixel to be converted (which is beyond xEnd if an empty area was skipped).
+int PixelAttributes::convertLine(int y, int xBegin, int xEnd, int *pixels)
+{
+	if (!lineExists(y))
+		return xEnd;
+	const PixelLine &line = this->line(yCoord2Line(y));
+	int x;
+	for (x = xBegin; x < xEnd; x++) {
+		int i = x + 1;
+		if (line.flags[i] & PixelLine::NextEmpty) {
+			x += 16 / m_scale - 1;
+			continue;
+		}
+		Color color = PixelAttributeRef(line, i).color();
+		if ((line.flags[i] & PixelLine::Valid) || color.to_uint())
+			pixels[x - xBegin] = color.to_libgd();
+	}
+	return x;
+}
+
+// Store the heights of the valid pixels of line y. Other heights are not changed.
+void PixelAttributes::convertLineHeights(int y, int xBegin, int xEnd, float *heights)
+{
+	if (!lineExists(y))
+		return;
+	const PixelLine &line = this->line(yCoord2Line(y));
+	for (int x = xBegin; x < xEnd; x++) {
+		int i = x + 1;
+		if (line.flags[i] & PixelLine::NextEmpty) {
+			x += 16 / m_scale - 1;
+			continue;
+		}
+		if (line.flags[i] & PixelLine::Valid)
+			heights[x - xBegin] = line.h[i] / (line.n[i] ? line.n[i] : 1);
+	}
+}
+
+// Shade all lines that have not been shaded yet, up to line yLimit
+void PixelAttributes::renderShading(int yLimit, double emphasis, bool drawAlpha)
 {
+	if (yLimit > m_lastY)
+		yLimit = m_lastY;
 	int y;
-	for (y = yCoord2Line(m_firstUnshadedY); y <= yCoord2Line(m_lastY); y++) {
-		for (int x = 1; x < m_width; x++) {
-			if (m_pixelAttributes[y][x].nextEmpty) {
-				x += 16 / m_scale - 1;
+	for (y = yCoord2Line(m_firstUnshadedY); y <= yCoord2Line(yLimit); y++) {
+		const PixelLine &line = this->line(y);
+		const PixelLine &previousLine = this->line(y - 1);
+		int x = 1;
+		while (x < m_width) {
+			if (line.flags[x] & PixelLine::NextEmpty) {
+				x += 16 / m_scale;
 				continue;
 			}
-			if (!m_pixelAttributes[y][x].isNormalized())
-				m_pixelAttributes[y][x].normalize();
-			if (!m_pixelAttributes[y][x].is_valid()) {
-				if (x + 1 < m_width && !m_pixelAttributes[y][x + 1].isNormalized())
-					m_pixelAttributes[y][x + 1].normalize();
-				x++;
-				continue;
+			// Shade the pixels up to the next empty area at once
+			int end = x + 1;
+			while (end < m_width && !(line.flags[end] & PixelLine::NextEmpty))
+				end++;
+			for (int i = x; i < end; i++) {
+				if (line.n[i])
+					PixelAttributeRef(line, i).normalize();
 			}
-			if (!m_pixelAttributes[y - 1][x].is_valid() || !m_pixelAttributes[y][x - 1].is_valid())
-				continue;
-			if (!m_pixelAttributes[y][x].m_a)
-				continue;
-			double h = m_pixelAttributes[y][x].m_h;
-			double h1 = m_pixelAttributes[y][x - 1].m_a ? m_pixelAttributes[y][x - 1].m_h : h;
-			double h2 = m_pixelAttributes[y - 1][x].m_a ? m_pixelAttributes[y - 1][x].m_h : h;
-			double d = (h - h1) + (h - h2);
-			if (d > 3) {
-				d = 3;
-			}
-			d = d * 12 / 255 * emphasis;
-			#define pixel (m_pixelAttributes[y][x])
-			//PixelAttribute &pixel = m_pixelAttributes[y][x];
-			if (drawAlpha)
-				d = d * (1 - pixel.m_t);
-			pixel.m_r = colorSafeBounds(pixel.m_r + d);
-			pixel.m_g = colorSafeBounds(pixel.m_g + d);
-			pixel.m_b = colorSafeBounds(pixel.m_b + d);
-			#undef pixel
+			shadePixels(line, previousLine, x, end, emphasis, drawAlpha);
+			x = end;
 		}
 	}
 	m_firstUnshadedY = y - yCoord2Line(0);
@@ -225,6 +583,7 @@ void PixelAttribute::add(const PixelAttribute &p)
 		m_t = 0;
 		m_h = p.m_h;
 		m_n = p.m_n;
+		m_valid = p.m_valid;
 	}
 	else if (!p.m_n) {
 		m_r += p.m_r * p.m_a;
@@ -233,6 +592,7 @@ void PixelAttribute::add(const PixelAttribute &p)
 		m_a += p.m_a;
 		m_t += p.m_t;
 		m_h += p.m_h;
+		m_valid = p.m_valid;
 		m_n++;
 	}
 	else {
@@ -242,11 +602,12 @@ void PixelAttribute::add(const PixelAttribute &p)
 		m_a += p.m_a;
 		m_t += p.m_t;
 		m_h += p.m_h;
+		m_valid = p.m_valid;
 		m_n += p.m_n;
 	}
 }
 
-void PixelAttribute::mixUnder(const PixelAttribute &p)
+void PixelAttribute::mixUnder(const PixelAttribute &p, AlphaMixingMode mixMode)
 {
 	if (!is_valid() || m_a == 0) {
 		if (!is_valid() || p.m_a != 0) {
@@ -258,8 +619,9 @@ void PixelAttribute::mixUnder(const PixelAttribute &p)
 			m_t = 0;
 		}
 		m_h = p.m_h;
+		m_valid = p.m_valid;
 	}
-	else if ((m_mixMode & AlphaMixCumulative) == AlphaMixCumulative || (m_mixMode == AlphaMixAverage && p.m_a == 1)) {
+	else if ((mixMode & AlphaMixCumulative) == AlphaMixCumulative || (mixMode == AlphaMixAverage && p.m_a == 1)) {
 		PixelAttribute pp(p);
 #ifdef DEBUG
 		assert(pp.isNormalized());
@@ -276,9 +638,11 @@ void PixelAttribute::mixUnder(const PixelAttribute &p)
 		m_a = (m_a + (1 - m_a) * pp.m_a);
 		if (pp.m_a != 1)
 			m_t = (m_t + pp.m_t) / 2;
-		else
+		else {
 			m_h = pp.m_h;
-		if ((m_mixMode & AlphaMixDarkenBit) && prev_alpha >= 254 && pp.alpha() < 255) {
+			m_valid = pp.m_valid;
+		}
+		if ((mixMode & AlphaMixDarkenBit) && prev_alpha >= 254 && pp.alpha() < 255) {
 			// Darken
 			// Parameters make deep water look good :-)
 			// (maybe this setting should be per-node-type, and obtained from the colors file ?)
@@ -288,13 +652,14 @@ void PixelAttribute::mixUnder(const PixelAttribute &p)
 		}
 	}
 #ifdef DEBUG
-	else if (m_mixMode == AlphaMixAverage && p.m_a != 1) {
+	else if (mixMode == AlphaMixAverage && p.m_a != 1) {
 #else
 	else {
 #endif
 		if (p.m_a == 1)
 			normalize();
 		double h = p.m_h;
+		bool valid = p.m_valid;
 		double t = m_t;
 		add(p);
 		if (p.m_a == 1) {
@@ -302,12 +667,13 @@ void PixelAttribute::mixUnder(const PixelAttribute &p)
 			m_t = t;
 			m_a = 1;
 			m_h = m_n * h;
+			m_valid = valid;
 		}
 	}
 #ifdef DEBUG
 	else {
 		// Internal error
-		assert(1 && m_mixMode);
+		assert(1 && mixMode);
 	}
 #endif
 }
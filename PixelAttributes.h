@@ -18,6 +18,8 @@
 #include "config.h"
 #include "Color.h"
 
+class PixelAttributeRef;
+
 class PixelAttribute {
 public:
 	enum AlphaMixingMode {
@@ -26,12 +28,11 @@ public:
 		AlphaMixCumulativeDarken = 0x03,
 		AlphaMixAverage = 0x04,
 	};
-	static void setMixMode(AlphaMixingMode mode);
-	PixelAttribute(): nextEmpty(true), m_n(0), m_h(NAN), m_t(0), m_a(0), m_r(0), m_g(0), m_b(0) {};
+	PixelAttribute(): m_n(0), m_h(0), m_t(0), m_a(0), m_r(0), m_g(0), m_b(0), m_valid(false) {};
 //	PixelAttribute(const PixelAttribute &p);
+	// A height of NAN yields a pixel that has a color, but is not valid
 	PixelAttribute(const Color &color, double height);
 	PixelAttribute(const ColorEntry &entry, double height);
-	bool nextEmpty;
 	double h(void) const { return m_h / (m_n ? m_n : 1); }
 	double t(void) const { return m_t / (m_n ? m_n : 1); }
 	double a(void) const { return m_a / (m_n ? m_n : 1); }
@@ -47,22 +48,60 @@ public:
 	bool isNormalized(void) const { return !m_n; }
 	Color color(void) const { return Color(red(), green(), blue(), alpha()); }
 
-	inline bool is_valid() const { return !isnan(m_h); }
+	inline bool is_valid() const { return m_valid; }
 	PixelAttribute &operator=(const PixelAttribute &p);
 	void normalize(double count = 0, Color defaultColor = Color(127, 127, 127));
 	void add(const PixelAttribute &p);
-	void mixUnder(const PixelAttribute &p);
+	void mixUnder(const PixelAttribute &p, AlphaMixingMode mixMode);
 private:
-	static AlphaMixingMode m_mixMode;
-	double m_n;
-	double m_h;
-	double m_t;
-	double m_a;
-	double m_r;
-	double m_g;
-	double m_b;
+	float m_n;
+	float m_h;
+	float m_t;
+	float m_a;
+	float m_r;
+	float m_g;
+	float m_b;
+	bool m_valid;
 
 friend class PixelAttributes;
+friend class PixelAttributeRef;
+};
+
+// The pixels of one line, stored as one array per attribute
+struct PixelLine
+{
+	enum Flags {
+		Valid = 0x01,
+		NextEmpty = 0x02,
+	};
+	float *n;
+	float *h;
+	float *t;
+	float *a;
+	float *r;
+	float *g;
+	float *b;
+	uint8_t *flags;
+};
+
+// Reference to a pixel stored in a PixelLine
+class PixelAttributeRef
+{
+public:
+	PixelAttributeRef(const PixelLine &line, int x) : m_line(line), m_x(x) {}
+	operator PixelAttribute() const;
+	PixelAttributeRef &operator=(const PixelAttribute &p);
+	bool nextEmpty(void) const { return m_line.flags[m_x] & PixelLine::NextEmpty; }
+	void setNextEmpty(bool empty);
+	bool is_valid() const { return m_line.flags[m_x] & PixelLine::Valid; }
+	bool isNormalized(void) const { return !m_line.n[m_x]; }
+	Color color(void) const { return PixelAttribute(*this).color(); }
+	void normalize(void);
+	void add(const PixelAttribute &p);
+	void mixUnder(const PixelAttribute &p, PixelAttribute::AlphaMixingMode mixMode);
+private:
+	const PixelLine &m_line;
+	int m_x;
 };
 
 class PixelAttributes
@@ -72,23 +111,42 @@ public:
 	virtual ~PixelAttributes();
 	void setParameters(int width, int lines, int nextY, int scale, bool defaultEmpty);
 	void scroll(int keepY);
-	PixelAttribute &attribute(int y, int x);
-	void renderShading(double emphasis, bool drawAlpha);
+	PixelAttributeRef attribute(int y, int x);
+	void scaleLine(PixelAttributes &scaled, int y, int xBegin, int xEnd, int scale);
+	void normalizeLine(int y, int xBegin, int xEnd);
+	void renderShading(int yLimit, double emphasis, bool drawAlpha);
+	int convertLine(int y, int xBegin, int xEnd, int *pixels);
+	void convertLineHeights(int y, int xBegin, int xEnd, float *heights);
+	// Copy pixels x .. x + count - 1 of line y to raw data, or back: count floats of each
+	// of n, h, t, a, r, g and b, followed by count flags (pixelDataSize(count) bytes).
+	void savePixels(int y, int x, int count, char *data);
+	void loadPixels(int y, int x, int count, const char *data);
+	static size_t pixelDataSize(int count) { return count * (7 * sizeof(float) + 1); }
 	int getNextY(void) { return m_nextY; }
 	void setLastY(int y);
 	int getLastY(void) { return m_lastY; }
 
 private:
 	int yCoord2Line(int y) { return y - m_firstY + m_firstLine; }
+	const PixelLine &line(int l);
+	bool lineExists(int y) { return yCoord2Line(y) >= m_firstLine && yCoord2Line(y) <= m_lastLine; }
+	template<int scaleFactor> void scaleLine(const PixelLine &scaledLine, int y, int xBegin, int xEnd, int scale);
+	void clearLine(const PixelLine &line);
 	void freeAttributes();
+	static const PixelLine &dummyLine(void);
 
 private:
 	int m_previousLine;
 	int m_firstLine;
 	int m_lastLine;
-	int m_emptyLine;
+	// The lines form a ring buffer: line l is stored in m_pixelAttributes[(l + m_ringOffset) % m_lineCount]
 	int m_lineCount;
-	PixelAttribute **m_pixelAttributes;
+	int m_ringOffset;
+	size_t m_channelSize;		// Floats per attribute array (padded for alignment)
+	size_t m_lineSize;		// Bytes per line (padded for alignment)
+	char *m_data;			// Memory of all lines
+	uint8_t *m_emptyFlags;		// Flags of an empty line
+	PixelLine *m_pixelAttributes;
 	int m_width;
 	int m_firstY;
 	int m_nextY;
@@ -109,23 +167,23 @@ inline void PixelAttributes::setLastY(int y)
 	m_lastY = y;
 }
 
-inline void PixelAttribute::setMixMode(AlphaMixingMode mode)
-{
-	if (mode == AlphaMixDarkenBit)
-		mode = AlphaMixCumulativeDarken;
-	m_mixMode = mode;
-}
-
-inline PixelAttribute &PixelAttributes::attribute(int y, int x)
+inline PixelAttributeRef PixelAttributes::attribute(int y, int x)
 {
 #ifdef DEBUG
 	assert(yCoord2Line(y) >= m_firstLine && yCoord2Line(y) <= m_lastLine);
 #else
-	static PixelAttribute p;
 	if (!(yCoord2Line(y) >= m_firstLine && yCoord2Line(y) <= m_lastLine))
-		return p;
+		return PixelAttributeRef(dummyLine(), 0);
 #endif
-	return m_pixelAttributes[yCoord2Line(y)][x + 1];
+	return PixelAttributeRef(line(yCoord2Line(y)), x + 1);
+}
+
+inline const PixelLine &PixelAttributes::line(int l)
+{
+	l += m_ringOffset;
+	if (l >= m_lineCount)
+		l -= m_lineCount;
+	return m_pixelAttributes[l];
 }
 
 //inline PixelAttribute::PixelAttribute(const PixelAttribute &p) :
@@ -134,14 +192,14 @@ inline PixelAttribute &PixelAttributes::attribute(int y, int x)
 //}
 
 inline PixelAttribute::PixelAttribute(const Color &color, double height) :
-	nextEmpty(false), m_n(0), m_h(height), m_t(0), m_a(color.a/255.0),
-	m_r(color.r/255.0), m_g(color.g/255.0), m_b(color.b/255.0)
+	m_n(0), m_h(std::isnan(height) ? 0 : height), m_t(0), m_a(color.a/255.0),
+	m_r(color.r/255.0), m_g(color.g/255.0), m_b(color.b/255.0), m_valid(!std::isnan(height))
 {
 }
 
 inline PixelAttribute::PixelAttribute(const ColorEntry &entry, double height) :
-	nextEmpty(false), m_n(0), m_h(height), m_t(entry.t/255.0), m_a(entry.a/255.0),
-	m_r(entry.r/255.0), m_g(entry.g/255.0), m_b(entry.b/255.0)
+	m_n(0), m_h(std::isnan(height) ? 0 : height), m_t(entry.t/255.0), m_a(entry.a/255.0),
+	m_r(entry.r/255.0), m_g(entry.g/255.0), m_b(entry.b/255.0), m_valid(!std::isnan(height))
 {
 }
 
@@ -154,8 +212,80 @@ inline PixelAttribute &PixelAttribute::operator=(const PixelAttribute &p)
 	m_r = p.m_r;
 	m_g = p.m_g;
 	m_b = p.m_b;
+	m_valid = p.m_valid;
 	return *this;
 }
 
-#endif /* end of include guard: PIXELATTRIBUTES_H_ADZ35GYF */
+inline PixelAttributeRef::operator PixelAttribute() const
+{
+	PixelAttribute p;
+	p.m_n = m_line.n[m_x];
+	p.m_h = m_line.h[m_x];
+	p.m_t = m_line.t[m_x];
+	p.m_a = m_line.a[m_x];
+	p.m_r = m_line.r[m_x];
+	p.m_g = m_line.g[m_x];
+	p.m_b = m_line.b[m_x];
+	p.m_valid = m_line.flags[m_x] & PixelLine::Valid;
+	return p;
+}
+
+// Stores all attributes, except nextEmpty
+inline PixelAttributeRef &PixelAttributeRef::operator=(const PixelAttribute &p)
+{
+	m_line.n[m_x] = p.m_n;
+	m_line.h[m_x] = p.m_h;
+	m_line.t[m_x] = p.m_t;
+	m_line.a[m_x] = p.m_a;
+	m_line.r[m_x] = p.m_r;
+	m_line.g[m_x] = p.m_g;
+	m_line.b[m_x] = p.m_b;
+	if (p.m_valid)
+		m_line.flags[m_x] |= PixelLine::Valid;
+	else
+		m_line.flags[m_x] &= ~PixelLine::Valid;
+	return *this;
+}
+
+inline void PixelAttributeRef::setNextEmpty(bool empty)
+{
+	if (empty)
+		m_line.flags[m_x] |= PixelLine::NextEmpty;
+	else
+		m_line.flags[m_x] &= ~PixelLine::NextEmpty;
+}
+
+inline void PixelAttributeRef::normalize(void)
+{
+	PixelAttribute p(*this);
+	p.normalize();
+	*this = p;
+}
+
+inline void PixelAttributeRef::add(const PixelAttribute &pixel)
+{
+	if (!is_valid()) {
+		// Plain copy: avoid loading the current value
+		*this = pixel;
+		m_line.t[m_x] = 0;
+		return;
+	}
+	PixelAttribute p(*this);
+	p.add(pixel);
+	*this = p;
+}
 
+inline void PixelAttributeRef::mixUnder(const PixelAttribute &pixel, PixelAttribute::AlphaMixingMode mixMode)
+{
+	if (!is_valid()) {
+		// Plain copy: avoid loading the current value
+		*this = pixel;
+		m_line.t[m_x] = 0;
+		return;
+	}
+	PixelAttribute p(*this);
+	p.mixUnder(pixel, mixMode);
+	*this = p;
+}
+
+#endif /* end of include guard: PIXELATTRIBUTES_H_ADZ35GYF */
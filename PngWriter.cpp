@@ -0,0 +1,437 @@
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include "PngWriter.h"
+
+#define PNG_IDAT_SIZE (256 * 1024)
+// Approximate amount of (uncompressed) image data per row group
+#define PNG_ROW_GROUP_SIZE (1024 * 1024)
+
+static const uint8_t pngSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static const char *filterNames[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+
+static inline void storeBigEndian(uint8_t *data, uint32_t value)
+{
+	data[0] = value >> 24;
+	data[1] = value >> 16;
+	data[2] = value >> 8;
+	data[3] = value;
+}
+
+static inline uint8_t paethPredictor(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	else if (pb <= pc)
+		return b;
+	else
+		return c;
+}
+
+// Filter functions. The first pixel has no left neighbour.
+static void filterNone(const uint8_t *row, const uint8_t *, uint8_t *out, int size)
+{
+	memcpy(out, row, size);
+}
+
+static void filterSub(const uint8_t *row, const uint8_t *, uint8_t *out, int size)
+{
+	for (int i = 0; i < 3; i++)
+		out[i] = row[i];
+	for (int i = 3; i < size; i++)
+		out[i] = row[i] - row[i - 3];
+}
+
+static void filterUp(const uint8_t *row, const uint8_t *prev, uint8_t *out, int size)
+{
+	for (int i = 0; i < size; i++)
+		out[i] = row[i] - prev[i];
+}
+
+static void filterAverage(const uint8_t *row, const uint8_t *prev, uint8_t *out, int size)
+{
+	for (int i = 0; i < 3; i++)
+		out[i] = row[i] - (prev[i] >> 1);
+	for (int i = 3; i < size; i++)
+		out[i] = row[i] - ((row[i - 3] + prev[i]) >> 1);
+}
+
+static void filterPaeth(const uint8_t *row, const uint8_t *prev, uint8_t *out, int size)
+{
+	for (int i = 0; i < 3; i++)
+		out[i] = row[i] - prev[i];
+	for (int i = 3; i < size; i++)
+		out[i] = row[i] - paethPredictor(row[i - 3], prev[i], prev[i - 3]);
+}
+
+typedef void (*FilterFunction)(const uint8_t *row, const uint8_t *prev, uint8_t *out, int size);
+static const FilterFunction filterFunctions[5] = { filterNone, filterSub, filterUp, filterAverage, filterPaeth };
+
+bool PngWriter::parseFilter(const std::string &name, Filter &filter)
+{
+	for (int i = FilterNone; i <= FilterAdaptive; i++) {
+		if (name == filterNames[i]) {
+			filter = Filter(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+PngWriter::RowFilter::RowFilter(int width, Filter filter) :
+	m_rowSize(width * 3),
+	m_filter(filter)
+{
+	for (int i = FilterNone; i <= FilterPaeth; i++) {
+		if (filter == FilterAdaptive || filter == i) {
+			m_filtered[i].resize(1 + m_rowSize);
+			m_filtered[i][0] = i;
+		}
+	}
+}
+
+// With the adaptive filter, the row is filtered using each of the filter types, and the
+// one that is expected to compress best is used (the minimum sum of absolute differences
+// heuristic, as recommended by the PNG specification)
+const uint8_t *PngWriter::RowFilter::filter(const uint8_t *row, const uint8_t *prev)
+{
+	if (m_filter != FilterAdaptive) {
+		filterFunctions[m_filter](row, prev, &m_filtered[m_filter][1], m_rowSize);
+		return &m_filtered[m_filter][0];
+	}
+	int best = FilterNone;
+	unsigned long bestSum = 0;
+	for (int f = FilterNone; f <= FilterPaeth; f++) {
+		uint8_t *out = &m_filtered[f][1];
+		filterFunctions[f](row, prev, out, m_rowSize);
+		unsigned long sum = 0;
+		for (int i = 0; i < m_rowSize; i++)
+			sum += abs(int8_t(out[i]));
+		if (f == FilterNone || sum < bestSum) {
+			bestSum = sum;
+			best = f;
+		}
+	}
+	return &m_filtered[best][0];
+}
+
+PngWriter::PngWriter(FILE *file, int width, int height, int level, Filter filter, int threads) :
+	m_file(file),
+	m_width(width),
+	m_height(height),
+	m_level(level),
+	m_filter(filter),
+	m_rowsWritten(0),
+	m_rowSize(width * 3),
+	m_compressed(PNG_IDAT_SIZE),
+	m_compressedSize(0),
+	m_streamInitialized(false),
+	m_row(m_rowSize),
+	m_previousRow(m_rowSize, 0),
+	m_rowFilter(0),
+	m_groupRows(0),
+	m_group(0),
+	m_adler(adler32(0, NULL, 0)),
+	m_stop(false)
+{
+	writeData(pngSignature, sizeof(pngSignature));
+	uint8_t header[13];
+	storeBigEndian(header, width);
+	storeBigEndian(header + 4, height);
+	header[8] = 8;		// Bit depth
+	header[9] = 2;		// Color type: RGB
+	header[10] = 0;		// Compression method
+	header[11] = 0;		// Filter method
+	header[12] = 0;		// No interlacing
+	writeChunk("IHDR", header, sizeof(header));
+
+	if (threads <= 1) {
+		memset(&m_stream, 0, sizeof(m_stream));
+		if (deflateInit2(&m_stream, level, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("Failed to initialize the PNG compressor");
+		m_streamInitialized = true;
+		m_rowFilter = new RowFilter(width, filter);
+	}
+	else {
+		m_groupRows = PNG_ROW_GROUP_SIZE / (m_rowSize + 1);
+		if (m_groupRows < 1)
+			m_groupRows = 1;
+		// The zlib header is written here; the row groups are compressed as raw deflate data.
+		int levelFlags = level == Z_DEFAULT_COMPRESSION || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+		uint8_t zlibHeader[2] = { 0x78, uint8_t(levelFlags << 6) };
+		zlibHeader[1] += (31 - (zlibHeader[0] * 256 + zlibHeader[1]) % 31) % 31;
+		writeImageData(zlibHeader, 2);
+		for (int i = 0; i < threads; i++)
+			m_workers.push_back(std::thread(&PngWriter::runWorker, this));
+	}
+}
+
+PngWriter::~PngWriter()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stop = true;
+		m_work.clear();
+	}
+	m_workAvailable.notify_all();
+	for (std::vector<std::thread>::iterator worker = m_workers.begin(); worker != m_workers.end(); ++worker)
+		worker->join();
+	for (std::deque<RowGroup *>::iterator group = m_groups.begin(); group != m_groups.end(); ++group)
+		delete *group;
+	delete m_group;
+	delete m_rowFilter;
+	if (m_streamInitialized)
+		deflateEnd(&m_stream);
+}
+
+void PngWriter::writeRows(const int *pixels, const float *, int rows)
+{
+	for (int y = 0; y < rows; y++)
+		writeRow(pixels + y * m_width);
+}
+
+void PngWriter::convertRow(const int *pixels, uint8_t *row)
+{
+	for (int x = 0; x < m_width; x++) {
+		row[x * 3] = pixels[x] >> 16;
+		row[x * 3 + 1] = pixels[x] >> 8;
+		row[x * 3 + 2] = pixels[x];
+	}
+}
+
+void PngWriter::writeRow(const int *pixels)
+{
+	if (m_rowsWritten >= m_height)
+		throw std::runtime_error("Too many rows written to PNG image");
+	m_rowsWritten++;
+	if (m_workers.empty()) {
+		convertRow(pixels, &m_row[0]);
+		deflateData(m_rowFilter->filter(&m_row[0], &m_previousRow[0]), m_rowSize + 1, Z_NO_FLUSH);
+		m_row.swap(m_previousRow);
+	}
+	else {
+		if (!m_group)
+			startRowGroup();
+		m_group->rowCount++;
+		convertRow(pixels, &m_group->rows[m_group->rowCount * m_rowSize]);
+		if (m_group->rowCount == m_groupRows || m_rowsWritten == m_height)
+			submitRowGroup(m_rowsWritten == m_height);
+	}
+}
+
+void PngWriter::finish(void)
+{
+	if (m_rowsWritten != m_height) {
+		std::ostringstream oss;
+		oss << "PNG image incomplete: " << m_rowsWritten << " of " << m_height << " rows written";
+		throw std::runtime_error(oss.str());
+	}
+	if (m_workers.empty()) {
+		deflateData(NULL, 0, Z_FINISH);
+	}
+	else {
+		writeRowGroups(true);
+		uint8_t trailer[4];
+		storeBigEndian(trailer, m_adler);
+		writeImageData(trailer, 4);
+	}
+	if (m_compressedSize)
+		writeChunk("IDAT", &m_compressed[0], m_compressedSize);
+	m_compressedSize = 0;
+	writeChunk("IEND", NULL, 0);
+	if (fflush(m_file)) {
+		std::ostringstream oss;
+		oss << "Error writing image: " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
+
+// Compress data, and write an IDAT chunk whenever the output buffer is full
+void PngWriter::deflateData(const uint8_t *data, size_t size, int flush)
+{
+	m_stream.next_in = const_cast<Bytef *>(data);
+	m_stream.avail_in = size;
+	for (;;) {
+		m_stream.next_out = &m_compressed[m_compressedSize];
+		m_stream.avail_out = m_compressed.size() - m_compressedSize;
+		int status = deflate(&m_stream, flush);
+		if (status == Z_STREAM_ERROR)
+			throw std::runtime_error("Failed to compress PNG image data");
+		m_compressedSize = m_compressed.size() - m_stream.avail_out;
+		if (m_compressedSize == m_compressed.size()) {
+			writeChunk("IDAT", &m_compressed[0], m_compressedSize);
+			m_compressedSize = 0;
+			continue;
+		}
+		if (flush == Z_FINISH ? status == Z_STREAM_END : m_stream.avail_in == 0)
+			break;
+	}
+}
+
+// Buffer compressed image data, and write an IDAT chunk whenever the buffer is full
+void PngWriter::writeImageData(const uint8_t *data, size_t size)
+{
+	while (size) {
+		size_t n = m_compressed.size() - m_compressedSize;
+		if (n > size)
+			n = size;
+		memcpy(&m_compressed[m_compressedSize], data, n);
+		m_compressedSize += n;
+		data += n;
+		size -= n;
+		if (m_compressedSize == m_compressed.size()) {
+			writeChunk("IDAT", &m_compressed[0], m_compressedSize);
+			m_compressedSize = 0;
+		}
+	}
+}
+
+void PngWriter::writeChunk(const char *type, const uint8_t *data, size_t size)
+{
+	uint8_t buffer[4];
+	storeBigEndian(buffer, size);
+	writeData(buffer, 4);
+	writeData(type, 4);
+	if (size)
+		writeData(data, size);
+	uLong crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+	if (size)
+		crc = crc32(crc, data, size);
+	storeBigEndian(buffer, crc);
+	writeData(buffer, 4);
+}
+
+void PngWriter::writeData(const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, m_file) != size) {
+		std::ostringstream oss;
+		oss << "Error writing image: " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
+
+void PngWriter::startRowGroup(void)
+{
+	m_group = new RowGroup;
+	m_group->rows.resize((1 + m_groupRows) * m_rowSize);
+	memcpy(&m_group->rows[0], &m_previousRow[0], m_rowSize);
+	m_group->rowCount = 0;
+	m_group->last = false;
+	m_group->done = false;
+	m_group->adler = 0;
+	m_group->size = 0;
+}
+
+// Queue the current row group for compression, and write the groups that are ready
+void PngWriter::submitRowGroup(bool last)
+{
+	memcpy(&m_previousRow[0], &m_group->rows[m_group->rowCount * m_rowSize], m_rowSize);
+	m_group->last = last;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_groups.push_back(m_group);
+		m_work.push_back(m_group);
+	}
+	m_group = 0;
+	m_workAvailable.notify_one();
+	writeRowGroups(false);
+}
+
+// Write the compressed row groups that are ready, in order. Wait for all
+// groups if requested, or else if too many groups are pending.
+void PngWriter::writeRowGroups(bool wait)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_groups.empty()) {
+		RowGroup *group = m_groups.front();
+		if (!group->done) {
+			if (!wait && m_groups.size() <= 2 * m_workers.size())
+				break;
+			m_groupDone.wait(lock);
+			continue;
+		}
+		m_groups.pop_front();
+		lock.unlock();
+		if (group->error) {
+			std::exception_ptr error = group->error;
+			delete group;
+			std::rethrow_exception(error);
+		}
+		m_adler = adler32_combine(m_adler, group->adler, group->size);
+		writeImageData(&group->compressed[0], group->compressed.size());
+		delete group;
+		lock.lock();
+	}
+}
+
+// Filter and compress the rows of a group as raw deflate data. The data ends
+// at a byte boundary (sync flush), so that the next group can be appended.
+void PngWriter::compressRowGroup(RowGroup &group, RowFilter &rowFilter, z_stream &stream)
+{
+	if (deflateReset(&stream) != Z_OK)
+		throw std::runtime_error("Failed to reset the PNG compressor");
+	group.adler = adler32(0, NULL, 0);
+	group.size = 0;
+	group.compressed.resize((m_rowSize + 1) * group.rowCount / 2 + 1024);
+	stream.next_out = &group.compressed[0];
+	stream.avail_out = group.compressed.size();
+	for (int r = 0; r < group.rowCount; r++) {
+		const uint8_t *filtered = rowFilter.filter(&group.rows[(r + 1) * m_rowSize], &group.rows[r * m_rowSize]);
+		group.adler = adler32(group.adler, filtered, m_rowSize + 1);
+		group.size += m_rowSize + 1;
+		stream.next_in = const_cast<Bytef *>(filtered);
+		stream.avail_in = m_rowSize + 1;
+		int flush = r < group.rowCount - 1 ? Z_NO_FLUSH : group.last ? Z_FINISH : Z_SYNC_FLUSH;
+		for (;;) {
+			if (deflate(&stream, flush) == Z_STREAM_ERROR)
+				throw std::runtime_error("Failed to compress PNG image data");
+			if (stream.avail_out)
+				break;
+			size_t used = group.compressed.size();
+			group.compressed.resize(used * 2);
+			stream.next_out = &group.compressed[used];
+			stream.avail_out = group.compressed.size() - used;
+		}
+	}
+	group.compressed.resize(group.compressed.size() - stream.avail_out);
+	std::vector<uint8_t>().swap(group.rows);
+}
+
+void PngWriter::runWorker(void)
+{
+	RowFilter rowFilter(m_width, m_filter);
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	bool initialized = deflateInit2(&stream, m_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		while (m_work.empty() && !m_stop)
+			m_workAvailable.wait(lock);
+		if (m_work.empty())
+			break;
+		RowGroup *group = m_work.front();
+		m_work.pop_front();
+		lock.unlock();
+		try {
+			if (!initialized)
+				throw std::runtime_error("Failed to initialize the PNG compressor");
+			compressRowGroup(*group, rowFilter, stream);
+		}
+		catch (...) {
+			group->error = std::current_exception();
+		}
+		lock.lock();
+		group->done = true;
+		m_groupDone.notify_all();
+	}
+	if (initialized)
+		deflateEnd(&stream);
+}
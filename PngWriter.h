@@ -0,0 +1,112 @@
+
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "ImageWriter.h"
+
+// Encodes an 8-bit RGB PNG file incrementally, as rows become available.
+// The alpha channel of the pixels is ignored (like gdImagePng() does by default).
+//
+// With more than one thread, the image data is split into groups of rows,
+// which are filtered and compressed in parallel (like pigz does): each group
+// is compressed independently, and ends with a sync flush (the last group
+// finishes the stream). The compressed groups are concatenated, and their
+// checksums combined, to form a single zlib stream.
+class PngWriter : public ImageWriter
+{
+public:
+	enum Filter {
+		FilterNone = 0,
+		FilterSub = 1,
+		FilterUp = 2,
+		FilterAverage = 3,
+		FilterPaeth = 4,
+		FilterAdaptive = 5,	// Select the best filter for every row
+	};
+	static bool parseFilter(const std::string &name, Filter &filter);
+
+	PngWriter(FILE *file, int width, int height, int level = Z_DEFAULT_COMPRESSION, Filter filter = FilterAdaptive, int threads = 1);
+	virtual ~PngWriter();
+	virtual void writeRows(const int *pixels, const float *heights, int rows);
+	virtual void finish(void);
+
+private:
+	// Filters rows of RGB pixels, using one or all filter types
+	class RowFilter
+	{
+	public:
+		RowFilter(int width, Filter filter);
+		// Returns the filtered row, preceded by the filter type byte
+		const uint8_t *filter(const uint8_t *row, const uint8_t *prev);
+	private:
+		int m_rowSize;
+		Filter m_filter;
+		std::vector<uint8_t> m_filtered[5];
+	};
+
+	// Consecutive rows, compressed as a unit by a worker thread
+	struct RowGroup {
+		std::vector<uint8_t> rows;	// RGB rows. The first row is the last row of the previous group.
+		int rowCount;
+		bool last;
+		bool done;
+		std::vector<uint8_t> compressed;
+		uLong adler;
+		uLong size;			// Size of the uncompressed data
+		std::exception_ptr error;
+	};
+
+	void writeRow(const int *pixels);
+	void convertRow(const int *pixels, uint8_t *row);
+	void deflateData(const uint8_t *data, size_t size, int flush);
+	void writeImageData(const uint8_t *data, size_t size);
+	void writeChunk(const char *type, const uint8_t *data, size_t size);
+	void writeData(const void *data, size_t size);
+
+	void startRowGroup(void);
+	void submitRowGroup(bool last);
+	void writeRowGroups(bool wait);
+	void compressRowGroup(RowGroup &group, RowFilter &rowFilter, z_stream &stream);
+	void runWorker(void);
+
+	FILE *m_file;
+	int m_width;
+	int m_height;
+	int m_level;
+	Filter m_filter;
+	int m_rowsWritten;
+	size_t m_rowSize;
+	std::vector<uint8_t> m_compressed;
+	size_t m_compressedSize;
+
+	// Single-threaded compression
+	z_stream m_stream;
+	bool m_streamInitialized;
+	std::vector<uint8_t> m_row;
+	std::vector<uint8_t> m_previousRow;
+	RowFilter *m_rowFilter;
+
+	// Multi-threaded compression
+	int m_groupRows;
+	RowGroup *m_group;
+	uLong m_adler;
+	std::deque<RowGroup *> m_groups;	// Submitted groups, in image order
+	std::deque<RowGroup *> m_work;		// Groups waiting to be compressed
+	std::mutex m_mutex;
+	std::condition_variable m_workAvailable;
+	std::condition_variable m_groupDone;
+	bool m_stop;
+	std::vector<std::thread> m_workers;
+};
+
+#endif // PNGWRITER_H
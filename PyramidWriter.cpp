@@ -0,0 +1,430 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include "config.h"
+#include "PyramidWriter.h"
+#if MSDOS || __OS2__ || __NT__ || _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#define PYRAMID_MAX_LEVELS	24
+
+#define TILESTATE_MAGIC		"MMTILES1"
+#define TILESTATE_MAGIC_SIZE	8
+
+// Entry of the tile state file
+struct TileStateEntry {
+	int32_t zoom;
+	int32_t x;
+	int32_t y;
+	int32_t unused;
+	uint64_t checksum;
+};
+
+// Division, rounding towards minus infinity
+static inline int floorDiv(int value, int divisor)
+{
+	return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
+static void makeDirectory(const std::string &path)
+{
+#if MSDOS || __OS2__ || __NT__ || _WIN32
+	int result = _mkdir(path.c_str());
+#else
+	int result = mkdir(path.c_str(), 0777);
+#endif
+	if (result && errno != EEXIST) {
+		std::ostringstream oss;
+		oss << "Error creating directory '" << path << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
+
+PyramidWriter::PyramidWriter(const std::string &directory, int width, int height, int originX, int originY, int levels,
+		int background, int pngLevel, PngWriter::Filter pngFilter, int threads) :
+	m_directory(directory),
+	m_width(width),
+	m_height(height),
+	m_originX(originX),
+	m_originY(originY),
+	m_background(background),
+	m_pngLevel(pngLevel),
+	m_pngFilter(pngFilter),
+	m_rowsWritten(0),
+	m_tilesWritten(0),
+	m_suppliedLevels(0),
+	m_busyWorkers(0),
+	m_stop(false)
+{
+	if (!m_directory.empty() && m_directory[m_directory.length() - 1] == PATH_SEPARATOR)
+		m_directory.erase(m_directory.length() - 1);
+	makeDirectory(m_directory);
+
+	if (!levels) {
+		for (levels = 1; levels < PYRAMID_MAX_LEVELS; levels++) {
+			int scale = 1 << (levels - 1);
+			if (floorDiv(originX + width - 1, scale) - floorDiv(originX, scale) < PYRAMID_TILE_SIZE
+					&& floorDiv(originY + height - 1, scale) - floorDiv(originY, scale) < PYRAMID_TILE_SIZE)
+				break;
+		}
+	}
+	if (levels > PYRAMID_MAX_LEVELS)
+		levels = PYRAMID_MAX_LEVELS;
+	m_levels.resize(levels);
+	for (int i = 0; i < levels; i++) {
+		Level &level = m_levels[i];
+		int scale = 1 << i;
+		level.zoom = levels - 1 - i;
+		level.tileX0 = floorDiv(floorDiv(originX, scale), PYRAMID_TILE_SIZE);
+		level.tileCount = floorDiv(floorDiv(originX + width - 1, scale), PYRAMID_TILE_SIZE) - level.tileX0 + 1;
+		level.tileY = 0;
+		level.nextY = 0;
+		level.empty = true;
+		level.pixels.resize(size_t(level.tileCount) * PYRAMID_TILE_SIZE * PYRAMID_TILE_SIZE);
+		level.heights.resize(level.pixels.size());
+		clearStrip(level);
+	}
+
+	if (threads > 1) {
+		for (int i = 0; i < threads; i++)
+			m_workers.push_back(std::thread(&PyramidWriter::runWorker, this));
+	}
+}
+
+PyramidWriter::~PyramidWriter()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stop = true;
+		for (std::deque<Tile *>::iterator tile = m_tiles.begin(); tile != m_tiles.end(); ++tile)
+			delete *tile;
+		m_tiles.clear();
+	}
+	m_tileAvailable.notify_all();
+	for (std::vector<std::thread>::iterator worker = m_workers.begin(); worker != m_workers.end(); ++worker)
+		worker->join();
+}
+
+// The state file is removed once it has been read: if writing the pyramid fails, the
+// checksums of the tiles that were written before the failure would be wrong.
+void PyramidWriter::setTileStateFile(const std::string &path)
+{
+	m_tileStatePath = path;
+	m_previousTileChecksums.clear();
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file)
+		return;
+	char magic[TILESTATE_MAGIC_SIZE];
+	if (fread(magic, sizeof(magic), 1, file) == 1 && !memcmp(magic, TILESTATE_MAGIC, TILESTATE_MAGIC_SIZE)) {
+		TileStateEntry entry;
+		while (fread(&entry, sizeof(entry), 1, file) == 1) {
+			TileKey key = { entry.zoom, entry.x, entry.y };
+			m_previousTileChecksums[key] = entry.checksum;
+		}
+	}
+	fclose(file);
+	remove(path.c_str());
+}
+
+void PyramidWriter::setSuppliedLevels(int count)
+{
+	m_suppliedLevels = count < levels() ? count : levels() - 1;
+}
+
+void PyramidWriter::writeLevelRow(int level, int y, int x, int width, const int *pixels, const float *heights)
+{
+	std::unique_lock<std::mutex> lock(m_levelMutex);
+	addRow(level, y, x, width, pixels, heights);
+}
+
+void PyramidWriter::writeRows(const int *pixels, const float *heights, int rows)
+{
+	if (m_rowsWritten + rows > m_height)
+		throw std::runtime_error("Too many rows written to image");
+	std::unique_lock<std::mutex> lock(m_levelMutex);
+	for (int y = 0; y < rows; y++) {
+		size_t offset = size_t(y) * m_width;
+		addRow(0, m_originY + m_rowsWritten, m_originX, m_width, pixels + offset, heights + offset);
+		m_rowsWritten++;
+	}
+}
+
+void PyramidWriter::finish(void)
+{
+	if (m_rowsWritten != m_height) {
+		std::ostringstream oss;
+		oss << "Image incomplete: " << m_rowsWritten << " of " << m_height << " rows written";
+		throw std::runtime_error(oss.str());
+	}
+	{
+		// Flushing a level adds its last row to the next level, so flush the most detailed level first
+		std::unique_lock<std::mutex> levelLock(m_levelMutex);
+		for (int i = 0; i < levels(); i++)
+			flushStrip(i);
+	}
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_tiles.empty() || m_busyWorkers)
+		m_tileDone.wait(lock);
+	checkErrors(lock);
+	if (!m_tileStatePath.empty()) {
+		for (TileChecksumMap::const_iterator tile = m_previousTileChecksums.begin(); tile != m_previousTileChecksums.end(); ++tile) {
+			std::string path = tilePath(tile->first.zoom, tile->first.x, tile->first.y);
+			if (remove(path.c_str()) && errno != ENOENT) {
+				std::ostringstream oss;
+				oss << "Error removing '" << path << "': " << std::strerror(errno);
+				throw std::runtime_error(oss.str());
+			}
+		}
+		m_previousTileChecksums.clear();
+		writeTileState();
+	}
+}
+
+// Add row y of a level, which starts at pixel x. Rows must be added in order.
+void PyramidWriter::addRow(int level, int y, int x, int width, const int *pixels, const float *heights)
+{
+	Level &l = m_levels[level];
+	int tileY = floorDiv(y, PYRAMID_TILE_SIZE);
+	if (!l.empty && tileY != l.tileY)
+		flushStrip(level);
+	l.tileY = tileY;
+	l.empty = false;
+	size_t offset = size_t(y - tileY * PYRAMID_TILE_SIZE) * l.tileCount * PYRAMID_TILE_SIZE + (x - l.tileX0 * PYRAMID_TILE_SIZE);
+	memcpy(&l.pixels[offset], pixels, width * sizeof(int));
+	memcpy(&l.heights[offset], heights, width * sizeof(float));
+	l.nextY = y + 1;
+	// When the second row of a pair is complete, add the scaled row to the next level
+	if ((y & 1) && computesNextLevel(level))
+		addScaledRow(level, y - 1);
+}
+
+// Scale rows y and y + 1 of a level (in the current strip), and add the result to
+// the next level. Rows that have not been added contain the background, and no heights.
+void PyramidWriter::addScaledRow(int level, int y)
+{
+	Level &l = m_levels[level];
+	int stripWidth = l.tileCount * PYRAMID_TILE_SIZE;
+	int width = stripWidth / 2;
+	const int *row0 = &l.pixels[size_t(y - l.tileY * PYRAMID_TILE_SIZE) * stripWidth];
+	const int *row1 = row0 + stripWidth;
+	const float *heights0 = &l.heights[size_t(y - l.tileY * PYRAMID_TILE_SIZE) * stripWidth];
+	const float *heights1 = heights0 + stripWidth;
+	std::vector<int> pixels(width);
+	std::vector<float> heights(width);
+	for (int x = 0; x < width; x++) {
+		int p[4] = { row0[2 * x], row0[2 * x + 1], row1[2 * x], row1[2 * x + 1] };
+		int r = 2, g = 2, b = 2;
+		for (int i = 0; i < 4; i++) {
+			r += (p[i] >> 16) & 0xff;
+			g += (p[i] >> 8) & 0xff;
+			b += p[i] & 0xff;
+		}
+		pixels[x] = ((r >> 2) << 16) | ((g >> 2) << 8) | (b >> 2);
+		float h[4] = { heights0[2 * x], heights0[2 * x + 1], heights1[2 * x], heights1[2 * x + 1] };
+		float sum = 0;
+		int count = 0;
+		for (int i = 0; i < 4; i++) {
+			if (!std::isnan(h[i])) {
+				sum += h[i];
+				count++;
+			}
+		}
+		heights[x] = count ? sum / count : NAN;
+	}
+	addRow(level + 1, floorDiv(y, 2), l.tileX0 * PYRAMID_TILE_SIZE / 2, width, &pixels[0], &heights[0]);
+}
+
+void PyramidWriter::clearStrip(Level &level)
+{
+	std::fill(level.pixels.begin(), level.pixels.end(), m_background);
+	std::fill(level.heights.begin(), level.heights.end(), float(NAN));
+}
+
+// Write the tiles of the current strip of a level that contain map data, and clear it.
+void PyramidWriter::flushStrip(int level)
+{
+	Level &l = m_levels[level];
+	if (l.empty)
+		return;
+	// The last row of the level has no second row of its pair
+	if ((l.nextY & 1) && computesNextLevel(level))
+		addScaledRow(level, l.nextY - 1);
+	int stripWidth = l.tileCount * PYRAMID_TILE_SIZE;
+	for (int t = 0; t < l.tileCount; t++) {
+		bool hasData = false;
+		for (int y = 0; y < PYRAMID_TILE_SIZE && !hasData; y++) {
+			const float *heights = &l.heights[size_t(y) * stripWidth + t * PYRAMID_TILE_SIZE];
+			for (int x = 0; x < PYRAMID_TILE_SIZE; x++) {
+				if (!std::isnan(heights[x])) {
+					hasData = true;
+					break;
+				}
+			}
+		}
+		if (!hasData)
+			continue;
+		Tile *tile = new Tile;
+		tile->zoom = l.zoom;
+		tile->x = l.tileX0 + t;
+		tile->y = l.tileY;
+		tile->pixels.resize(PYRAMID_TILE_SIZE * PYRAMID_TILE_SIZE);
+		for (int y = 0; y < PYRAMID_TILE_SIZE; y++)
+			memcpy(&tile->pixels[y * PYRAMID_TILE_SIZE], &l.pixels[size_t(y) * stripWidth + t * PYRAMID_TILE_SIZE], PYRAMID_TILE_SIZE * sizeof(int));
+		if (!m_tileStatePath.empty()) {
+			const Bytef *data = reinterpret_cast<const Bytef *>(&tile->pixels[0]);
+			uInt size = tile->pixels.size() * sizeof(int);
+			uint64_t checksum = (uint64_t(crc32(0, data, size)) << 32) | adler32(1, data, size);
+			TileKey key = { tile->zoom, tile->x, tile->y };
+			m_tileChecksums[key] = checksum;
+			TileChecksumMap::iterator previous = m_previousTileChecksums.find(key);
+			if (previous != m_previousTileChecksums.end()) {
+				bool unchanged = previous->second == checksum;
+				m_previousTileChecksums.erase(previous);
+				if (unchanged) {
+					delete tile;
+					continue;
+				}
+			}
+		}
+		submitTile(tile);
+	}
+	clearStrip(l);
+	l.empty = true;
+}
+
+// Write a tile, or have it written by a worker thread. Takes ownership of tile.
+void PyramidWriter::submitTile(Tile *tile)
+{
+	m_tilesWritten++;
+	if (m_workers.empty()) {
+		try {
+			writeTile(*tile);
+		}
+		catch (...) {
+			delete tile;
+			throw;
+		}
+		delete tile;
+		return;
+	}
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_tiles.size() >= 2 * m_workers.size() && !m_error)
+		m_tileDone.wait(lock);
+	if (m_error) {
+		delete tile;
+		checkErrors(lock);
+	}
+	m_tiles.push_back(tile);
+	m_tileAvailable.notify_one();
+}
+
+void PyramidWriter::writeTile(const Tile &tile)
+{
+	std::ostringstream path;
+	path << m_directory << PATH_SEPARATOR << tile.zoom;
+	makeDirectory(path.str());
+	path << PATH_SEPARATOR << tile.x;
+	makeDirectory(path.str());
+	path << PATH_SEPARATOR << tile.y << ".png";
+	FILE *file = fopen(path.str().c_str(), "wb");
+	if (!file) {
+		std::ostringstream oss;
+		oss << "Error opening '" << path.str() << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	try {
+		PngWriter png(file, PYRAMID_TILE_SIZE, PYRAMID_TILE_SIZE, m_pngLevel, m_pngFilter, 1);
+		png.writeRows(&tile.pixels[0], 0, PYRAMID_TILE_SIZE);
+		png.finish();
+	}
+	catch (...) {
+		fclose(file);
+		throw;
+	}
+	if (fclose(file)) {
+		std::ostringstream oss;
+		oss << "Error writing '" << path.str() << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
+
+std::string PyramidWriter::tilePath(int zoom, int x, int y) const
+{
+	std::ostringstream path;
+	path << m_directory << PATH_SEPARATOR << zoom << PATH_SEPARATOR << x << PATH_SEPARATOR << y << ".png";
+	return path.str();
+}
+
+void PyramidWriter::writeTileState(void)
+{
+	std::string tempPath = m_tileStatePath + ".tmp";
+	FILE *file = fopen(tempPath.c_str(), "wb");
+	if (!file) {
+		std::ostringstream oss;
+		oss << "Error opening '" << tempPath << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	bool ok = fwrite(TILESTATE_MAGIC, TILESTATE_MAGIC_SIZE, 1, file) == 1;
+	for (TileChecksumMap::const_iterator tile = m_tileChecksums.begin(); ok && tile != m_tileChecksums.end(); ++tile) {
+		TileStateEntry entry = { tile->first.zoom, tile->first.x, tile->first.y, 0, tile->second };
+		ok = fwrite(&entry, sizeof(entry), 1, file) == 1;
+	}
+	if (fclose(file))
+		ok = false;
+	if (ok) {
+#if MSDOS || __OS2__ || __NT__ || _WIN32
+		remove(m_tileStatePath.c_str());
+#endif
+		ok = !rename(tempPath.c_str(), m_tileStatePath.c_str());
+	}
+	if (!ok) {
+		std::ostringstream oss;
+		oss << "Error writing '" << m_tileStatePath << "': " << std::strerror(errno);
+		remove(tempPath.c_str());
+		throw std::runtime_error(oss.str());
+	}
+}
+
+void PyramidWriter::checkErrors(std::unique_lock<std::mutex> &)
+{
+	if (m_error) {
+		std::exception_ptr error = m_error;
+		m_error = std::exception_ptr();
+		std::rethrow_exception(error);
+	}
+}
+
+void PyramidWriter::runWorker(void)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (;;) {
+		while (m_tiles.empty() && !m_stop)
+			m_tileAvailable.wait(lock);
+		if (m_tiles.empty())
+			break;
+		Tile *tile = m_tiles.front();
+		m_tiles.pop_front();
+		m_busyWorkers++;
+		lock.unlock();
+		std::exception_ptr error;
+		try {
+			writeTile(*tile);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		delete tile;
+		lock.lock();
+		if (error && !m_error)
+			m_error = error;
+		m_busyWorkers--;
+		m_tileDone.notify_all();
+	}
+}
@@ -0,0 +1,128 @@
+
+#ifndef PYRAMIDWRITER_H
+#define PYRAMIDWRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ImageWriter.h"
+#include "PngWriter.h"
+
+#define PYRAMID_TILE_SIZE	256
+
+// Writes the image as a pyramid of square png tiles, for slippy (web) maps:
+// <directory>/<zoom>/<x>/<y>.png
+//
+// The image is the most detailed zoom level. Each next (less detailed) level is
+// computed from the previous level, by averaging 2x2 pixels, unless the caller
+// writes its rows (see setSuppliedLevels()). The tiles of all levels are written
+// as soon as they are complete.
+//
+// Tile coordinates are relative to the world origin, so that the tiles of maps of
+// different parts of the world match: the caller passes the position of the image
+// in the tile grid of the most detailed level (in pixels). Tiles that contain no map
+// data at all (i.e. all heights are NAN) are not written.
+//
+// With more than one thread, tiles are encoded in parallel.
+//
+// To update an existing pyramid, a state file with a checksum of every tile can be
+// used: then only tiles that changed are written, and tiles that no longer contain
+// map data are removed.
+class PyramidWriter : public ImageWriter
+{
+public:
+	// levels: number of zoom levels. 0: until the image fits in 2x2 tiles.
+	PyramidWriter(const std::string &directory, int width, int height, int originX, int originY, int levels,
+		int background, int pngLevel, PngWriter::Filter pngFilter, int threads);
+	virtual ~PyramidWriter();
+	virtual bool usesHeights(void) const { return true; }
+	virtual void writeRows(const int *pixels, const float *heights, int rows);
+	virtual void finish(void);
+	int levels(void) const { return int(m_levels.size()); }
+	// Must be called before the first row is written
+	void setTileStateFile(const std::string &path);
+	// Levels 1 .. count are not computed, but written by the caller using writeLevelRow()
+	// (e.g. scaled before shading, like the image). Must be called before the first row
+	// is written.
+	void setSuppliedLevels(int count);
+	// Write a row of a supplied level, which starts at pixel x. y and x are coordinates
+	// in the tile grid of the level, as for the image (see the constructor). Rows must be
+	// written in order. May be called on another thread than writeRows().
+	void writeLevelRow(int level, int y, int x, int width, const int *pixels, const float *heights);
+	int tilesWritten(void) const { return m_tilesWritten; }
+
+private:
+	// One zoom level. A strip of tiles (one tile high, spanning the width of the
+	// image) is assembled, and written when complete.
+	struct Level {
+		int zoom;
+		int tileX0;			// Tile coordinates of the strip
+		int tileCount;
+		int tileY;
+		int nextY;			// Next row (in pixels) expected
+		bool empty;			// No rows added to the strip yet
+		std::vector<int> pixels;
+		std::vector<float> heights;
+	};
+
+	struct Tile {
+		int zoom;
+		int x;
+		int y;
+		std::vector<int> pixels;
+	};
+
+	struct TileKey {
+		int zoom;
+		int x;
+		int y;
+		bool operator<(const TileKey &other) const { return zoom < other.zoom || (zoom == other.zoom && (x < other.x || (x == other.x && y < other.y))); }
+	};
+	typedef std::map<TileKey, uint64_t> TileChecksumMap;
+
+	void addRow(int level, int y, int x, int width, const int *pixels, const float *heights);
+	bool computesNextLevel(int level) const { return level + 1 < levels() && level + 1 > m_suppliedLevels; }
+	void addScaledRow(int level, int y);
+	void clearStrip(Level &level);
+	void flushStrip(int level);
+	void submitTile(Tile *tile);
+	void writeTile(const Tile &tile);
+	std::string tilePath(int zoom, int x, int y) const;
+	void writeTileState(void);
+	void checkErrors(std::unique_lock<std::mutex> &lock);
+	void runWorker(void);
+
+	std::string m_directory;
+	int m_width;
+	int m_height;
+	int m_originX;
+	int m_originY;
+	int m_background;
+	int m_pngLevel;
+	PngWriter::Filter m_pngFilter;
+	int m_rowsWritten;
+	int m_tilesWritten;
+	int m_suppliedLevels;
+	std::vector<Level> m_levels;
+	std::mutex m_levelMutex;		// The levels are written by more than one thread
+
+	std::string m_tileStatePath;		// Empty: write all tiles
+	TileChecksumMap m_previousTileChecksums;	// Tiles of the previous state that have not been seen yet
+	TileChecksumMap m_tileChecksums;
+
+	std::deque<Tile *> m_tiles;	// Tiles waiting to be written
+	std::mutex m_mutex;
+	std::condition_variable m_tileAvailable;
+	std::condition_variable m_tileDone;
+	int m_busyWorkers;
+	bool m_stop;
+	std::exception_ptr m_error;
+	std::vector<std::thread> m_workers;
+};
+
+#endif // PYRAMIDWRITER_H
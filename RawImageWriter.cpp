@@ -0,0 +1,166 @@
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include "RawImageWriter.h"
+
+static inline void storeLittleEndian(uint8_t *data, uint32_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+	data[2] = value >> 16;
+	data[3] = value >> 24;
+}
+
+static void convertRowRgb(const int *pixels, const float *, uint8_t *row, int width)
+{
+	for (int x = 0; x < width; x++) {
+		row[x * 3] = pixels[x] >> 16;
+		row[x * 3 + 1] = pixels[x] >> 8;
+		row[x * 3 + 2] = pixels[x];
+	}
+}
+
+// Like the png image, the pixels are opaque: the alpha of the pixels of the map is not
+// meaningful (e.g. without --drawalpha, it is the alpha of the color of the topmost node).
+static void convertRowRgba(const int *pixels, const float *, uint8_t *row, int width)
+{
+	for (int x = 0; x < width; x++) {
+		row[x * 4] = pixels[x] >> 16;
+		row[x * 4 + 1] = pixels[x] >> 8;
+		row[x * 4 + 2] = pixels[x];
+		row[x * 4 + 3] = 255;
+	}
+}
+
+static void convertRowHeight16(const int *, const float *heights, uint8_t *row, int width)
+{
+	for (int x = 0; x < width; x++) {
+		int height = RawImageWriter::Height16NoData;
+		if (!std::isnan(heights[x])) {
+			height = int(floor(heights[x] + 0.5));
+			if (height < -32767)
+				height = -32767;
+			if (height > 32767)
+				height = 32767;
+		}
+		row[x * 2] = height;
+		row[x * 2 + 1] = height >> 8;
+	}
+}
+
+static void convertRowHeightFloat(const int *, const float *heights, uint8_t *row, int width)
+{
+	for (int x = 0; x < width; x++) {
+		uint32_t value;
+		memcpy(&value, &heights[x], 4);
+		storeLittleEndian(row + x * 4, value);
+	}
+}
+
+typedef void (*ConvertFunction)(const int *pixels, const float *heights, uint8_t *row, int width);
+static const ConvertFunction convertFunctions[] = { 0, convertRowRgb, convertRowRgba, convertRowRgba, convertRowHeight16, convertRowHeightFloat };
+static const int pixelSizes[] = { 0, 3, 4, 4, 2, 4 };
+
+RawImageWriter::RawImageWriter(FILE *file, Format format, int width, int height) :
+	m_file(file),
+	m_buffer(0),
+	m_stride(0),
+	m_format(format),
+	m_width(width),
+	m_height(height),
+	m_rowsWritten(0)
+{
+	if (format < FormatPpm || format > FormatHeightFloat)
+		throw std::runtime_error("RawImageWriter: unsupported image format");
+	m_row.resize(size_t(width) * pixelSizes[format]);
+	std::ostringstream header;
+	switch (format) {
+	case FormatPpm:
+		header << "P6\n" << width << " " << height << "\n255\n";
+		break;
+	case FormatPam:
+		header << "P7\nWIDTH " << width << "\nHEIGHT " << height << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+		break;
+	case FormatRgba:
+		writeHeader("RGBA");
+		break;
+	case FormatHeight16:
+		writeHeader("HT16");
+		break;
+	case FormatHeightFloat:
+		writeHeader("HTF4");
+		break;
+	default:
+		break;
+	}
+	std::string text = header.str();
+	if (!text.empty())
+		writeData(text.c_str(), text.size());
+}
+
+RawImageWriter::RawImageWriter(uint8_t *buffer, size_t stride, Format format, int width, int height) :
+	m_file(0),
+	m_buffer(buffer),
+	m_stride(stride),
+	m_format(format),
+	m_width(width),
+	m_height(height),
+	m_rowsWritten(0)
+{
+	if (format < FormatPpm || format > FormatHeightFloat)
+		throw std::runtime_error("RawImageWriter: unsupported image format");
+	if (stride < size_t(width) * pixelSizes[format])
+		throw std::runtime_error("RawImageWriter: image rows are larger than the buffer rows");
+}
+
+void RawImageWriter::writeHeader(const char *magic)
+{
+	uint8_t header[12];
+	memcpy(header, magic, 4);
+	storeLittleEndian(header + 4, m_width);
+	storeLittleEndian(header + 8, m_height);
+	writeData(header, sizeof(header));
+}
+
+void RawImageWriter::writeRows(const int *pixels, const float *heights, int rows)
+{
+	if (m_rowsWritten + rows > m_height)
+		throw std::runtime_error("Too many rows written to image");
+	for (int y = 0; y < rows; y++) {
+		size_t offset = size_t(y) * m_width;
+		if (m_buffer) {
+			uint8_t *row = m_buffer + size_t(m_rowsWritten + y) * m_stride;
+			convertFunctions[m_format](pixels + offset, heights ? heights + offset : 0, row, m_width);
+		}
+		else {
+			convertFunctions[m_format](pixels + offset, heights ? heights + offset : 0, &m_row[0], m_width);
+			writeData(&m_row[0], m_row.size());
+		}
+	}
+	m_rowsWritten += rows;
+}
+
+void RawImageWriter::finish(void)
+{
+	if (m_rowsWritten != m_height) {
+		std::ostringstream oss;
+		oss << "Image incomplete: " << m_rowsWritten << " of " << m_height << " rows written";
+		throw std::runtime_error(oss.str());
+	}
+	if (m_file && fflush(m_file)) {
+		std::ostringstream oss;
+		oss << "Error writing image: " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
+
+void RawImageWriter::writeData(const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, m_file) != size) {
+		std::ostringstream oss;
+		oss << "Error writing image: " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
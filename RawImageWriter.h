@@ -0,0 +1,48 @@
+
+#ifndef RAWIMAGEWRITER_H
+#define RAWIMAGEWRITER_H
+
+#include <cstdio>
+#include <stdint.h>
+#include <vector>
+#include "ImageWriter.h"
+
+// Writes an image without compression, for consumers that decode it immediately.
+//
+// Formats:
+//	ppm:		binary PPM (P6): 8-bit RGB
+//	pam:		PAM (P7), tuple type RGB_ALPHA: 8-bit RGBA
+//	rgba:		'RGBA', width, height (32-bit little endian), then 8-bit RGBA pixels
+//	height16:	'HT16', width, height, then 16-bit signed little endian heights.
+//			Heights are rounded; -32768 means 'no data'
+//	heightfloat:	'HTF4', width, height, then 32-bit little endian IEEE float heights.
+//			NaN means 'no data'
+//
+// The formats can also be written to memory, in which case the header is omitted.
+class RawImageWriter : public ImageWriter
+{
+public:
+	RawImageWriter(FILE *file, Format format, int width, int height);
+	// Write the pixels to memory instead: rows of <stride> bytes, without a header
+	RawImageWriter(uint8_t *buffer, size_t stride, Format format, int width, int height);
+	virtual bool usesHeights(void) const { return formatUsesHeights(m_format); }
+	virtual void writeRows(const int *pixels, const float *heights, int rows);
+	virtual void finish(void);
+
+	static const int16_t Height16NoData = -32768;
+
+private:
+	void writeHeader(const char *magic);
+	void writeData(const void *data, size_t size);
+
+	FILE *m_file;
+	uint8_t *m_buffer;
+	size_t m_stride;
+	Format m_format;
+	int m_width;
+	int m_height;
+	int m_rowsWritten;
+	std::vector<uint8_t> m_row;
+};
+
+#endif // RAWIMAGEWRITER_H
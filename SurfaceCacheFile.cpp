@@ -0,0 +1,200 @@
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#if MSDOS || __OS2__ || __NT__ || _WIN32
+#define SURFACECACHE_MMAP 0
+#else
+#define SURFACECACHE_MMAP 1
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "SurfaceCacheFile.h"
+
+#define SURFACECACHE_MAGIC	"MMSURF01"
+#define SURFACECACHE_MAGIC_SIZE	8
+#define SURFACECACHE_ALIGNMENT	8
+
+SurfaceCacheFile::SurfaceCacheFile(const std::string &path, size_t columnSize) :
+	m_path(path),
+	m_columnSize(columnSize),
+	m_slotSize((sizeof(SlotHeader) + columnSize + SURFACECACHE_ALIGNMENT - 1) / SURFACECACHE_ALIGNMENT * SURFACECACHE_ALIGNMENT),
+	m_headerSize(0),
+	m_fd(-1),
+	m_data(0),
+	m_size(0),
+	m_slotCount(0),
+	m_fileSize(0)
+{
+}
+
+SurfaceCacheFile::~SurfaceCacheFile()
+{
+#if SURFACECACHE_MMAP
+	if (m_data)
+		munmap(m_data, m_size);
+	if (m_fd >= 0)
+		::close(m_fd);
+#endif
+}
+
+void SurfaceCacheFile::open(const std::string &signature)
+{
+	std::string header(SURFACECACHE_MAGIC, SURFACECACHE_MAGIC_SIZE);
+	uint32_t sizes[2] = { uint32_t(m_columnSize), uint32_t(signature.length()) };
+	header.append(reinterpret_cast<const char *>(sizes), sizeof(sizes));
+	header += signature;
+	header.resize((header.length() + SURFACECACHE_ALIGNMENT - 1) / SURFACECACHE_ALIGNMENT * SURFACECACHE_ALIGNMENT, '\0');
+	m_headerSize = header.length();
+
+	size_t size = 0;
+#if SURFACECACHE_MMAP
+	m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT, 0666);
+	if (m_fd < 0)
+		error("opening");
+	if (flock(m_fd, LOCK_EX | LOCK_NB)) {
+		if (errno != EWOULDBLOCK)
+			error("locking");
+		::close(m_fd);
+		m_fd = -1;
+		throw std::runtime_error("Surface cache '" + m_path + "' is in use by another mapper (a surface cache cannot be shared)");
+	}
+	struct stat st;
+	if (fstat(m_fd, &st))
+		error("opening");
+	size = st.st_size;
+#else
+	FILE *file = fopen(m_path.c_str(), "rb");
+	if (file) {
+		fseek(file, 0, SEEK_END);
+		size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		m_buffer.resize(size);
+		if (size && fread(&m_buffer[0], 1, size, file) != size)
+			size = 0;
+		fclose(file);
+	}
+#endif
+	m_fileSize = size;
+	mapFile(m_headerSize);
+	bool startOver = size < m_headerSize || memcmp(m_data, header.c_str(), m_headerSize);
+	if (startOver) {
+		// No cache, or of a different kind: start over, discarding all slots. The
+		// file keeps its size.
+		memcpy(m_data, header.c_str(), m_headerSize);
+		memset(m_data + m_headerSize, 0, m_size - m_headerSize);
+	}
+	m_slotCount = (m_size - m_headerSize) / m_slotSize;
+	for (size_t slot = 0; slot < m_slotCount; slot++) {
+		const SlotHeader *slotInfo = slotHeader(slot);
+		if (startOver || !slotInfo->stored)
+			m_free.push_back(slot);
+		else
+			m_slots[columnKey(slotInfo->x, slotInfo->z)] = slot;
+	}
+	// Use free slots in file order
+	std::reverse(m_free.begin(), m_free.end());
+}
+
+void SurfaceCacheFile::close(void)
+{
+#if SURFACECACHE_MMAP
+	if (m_data && munmap(m_data, m_size))
+		error("writing");
+	m_data = 0;
+	if (m_fd >= 0 && ::close(m_fd))
+		error("writing");
+	m_fd = -1;
+#else
+	FILE *file = fopen(m_path.c_str(), "wb");
+	if (!file)
+		error("opening");
+	bool ok = fwrite(m_data, 1, m_size, file) == m_size;
+	if (fclose(file) || !ok)
+		error("writing");
+#endif
+}
+
+size_t SurfaceCacheFile::findColumn(int x, int z, uint64_t fingerprint, bool &cached)
+{
+	size_t slot;
+	std::map<uint64_t, size_t>::iterator it = m_slots.find(columnKey(x, z));
+	if (it != m_slots.end()) {
+		slot = it->second;
+		const SlotHeader *slotInfo = slotHeader(slot);
+		if (slotInfo->stored && slotInfo->fingerprint == fingerprint) {
+			cached = true;
+			return slot;
+		}
+	}
+	else {
+		if (m_free.empty()) {
+			slot = m_slotCount++;
+		}
+		else {
+			slot = m_free.back();
+			m_free.pop_back();
+		}
+		m_slots[columnKey(x, z)] = slot;
+	}
+	SlotHeader slotInfo = { x, z, fingerprint, 0, 0 };
+	m_reserved.push_back(std::make_pair(slot, slotInfo));
+	cached = false;
+	return slot;
+}
+
+void SurfaceCacheFile::allocate(void)
+{
+	if (m_reserved.empty())
+		return;
+	mapFile(slotOffset(m_slotCount));
+	// Reserved slots are invalid until their data is stored
+	for (size_t i = 0; i < m_reserved.size(); i++)
+		*slotHeader(m_reserved[i].first) = m_reserved[i].second;
+	m_reserved.clear();
+}
+
+void SurfaceCacheFile::setStored(size_t slot)
+{
+	slotHeader(slot)->stored = 1;
+}
+
+// Map the file, extending it to at least size bytes. It never shrinks.
+void SurfaceCacheFile::mapFile(size_t size)
+{
+	if (size < m_fileSize)
+		size = m_fileSize;
+#if SURFACECACHE_MMAP
+	if (m_data)
+		munmap(m_data, m_size);
+	m_data = 0;
+	m_size = 0;
+	if (size > m_fileSize && ftruncate(m_fd, size))
+		error("resizing");
+	m_fileSize = size;
+	if (size) {
+		void *data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+		if (data == MAP_FAILED)
+			error("mapping");
+		m_data = static_cast<char *>(data);
+	}
+#else
+	m_buffer.resize(size);
+	m_data = size ? &m_buffer[0] : 0;
+	m_fileSize = size;
+#endif
+	m_size = size;
+}
+
+void SurfaceCacheFile::error(const char *action)
+{
+	std::ostringstream oss;
+	oss << "Error " << action << " surface cache '" << m_path << "': " << std::strerror(errno);
+	throw std::runtime_error(oss.str());
+}
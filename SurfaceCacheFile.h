@@ -0,0 +1,78 @@
+
+#ifndef SURFACECACHEFILE_H
+#define SURFACECACHEFILE_H
+
+#include <cstddef>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A cache of the rendered surface of block columns, before scaling and shading, so
+// that maps of any part of the world can be rendered without reading the blocks
+// again.
+//
+// The file is mapped into memory. It has a slot for every block column (x,z) it
+// ever stored; a slot is valid as long as the fingerprint of the column (computed
+// by the caller from the blocks of the column) does not change. If the cache was
+// written with a different signature (e.g. other colors), all slots are discarded.
+//
+// The file is a cache for the machine that wrote it: numbers are stored in the
+// machine's native format.
+//
+// A cache cannot be shared: while it is open, it is locked (with flock(); not on
+// Windows), and opening it again, in any process, fails. The file never shrinks,
+// so that it can safely stay mapped: slots that are discarded are reused.
+class SurfaceCacheFile
+{
+public:
+	// columnSize: bytes of data per column
+	SurfaceCacheFile(const std::string &path, size_t columnSize);
+	~SurfaceCacheFile();
+	// Open the file, and lock it. Fails if it is already open, in this or another process.
+	void open(const std::string &signature);
+	// Write the file. Without this, changes may be lost.
+	void close(void);
+	// Find the slot of a column. cached is set if it contains the data of the column with
+	// the given fingerprint; else the slot is reserved to store the new data.
+	size_t findColumn(int x, int z, uint64_t fingerprint, bool &cached);
+	// Make the slots reserved by findColumn() available. Must be called after the
+	// columns of a map were looked up, before their data is used.
+	void allocate(void);
+	const char *columnData(size_t slot) const { return m_data + slotOffset(slot) + sizeof(SlotHeader); }
+	char *columnData(size_t slot) { return m_data + slotOffset(slot) + sizeof(SlotHeader); }
+	// The data of a reserved slot has been stored: make it valid.
+	void setStored(size_t slot);
+
+private:
+	struct SlotHeader {
+		int32_t x;
+		int32_t z;
+		uint64_t fingerprint;
+		uint32_t stored;
+		uint32_t unused;
+	};
+
+	static uint64_t columnKey(int x, int z) { return (uint64_t(uint32_t(x)) << 32) | uint32_t(z); }
+	size_t slotOffset(size_t slot) const { return m_headerSize + slot * m_slotSize; }
+	SlotHeader *slotHeader(size_t slot) { return reinterpret_cast<SlotHeader *>(m_data + slotOffset(slot)); }
+	void mapFile(size_t size);
+	void error(const char *action);
+
+	std::string m_path;
+	size_t m_columnSize;
+	size_t m_slotSize;
+	size_t m_headerSize;
+	int m_fd;
+	char *m_data;
+	size_t m_size;
+	size_t m_slotCount;
+	size_t m_fileSize;
+	std::map<uint64_t, size_t> m_slots;
+	std::vector<size_t> m_free;		// Slots that do not contain a column
+	std::vector<std::pair<size_t, SlotHeader> > m_reserved;
+	std::vector<char> m_buffer;		// Without mmap(): the contents of the file
+};
+
+#endif // SURFACECACHEFILE_H
@@ -6,6 +6,7 @@
  *        Company:  LinuxOS.sk
  * =====================================================================
  */
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <climits>
@@ -15,14 +16,27 @@
 #include <gdfontt.h>
 #include <iostream>
 #include <iomanip>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <cerrno>
 #include <cstring>
+#include <chrono>
+#include <thread>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "config.h"
 #include "PlayerAttributes.h"
+#include "PngWriter.h"
+#include "PyramidWriter.h"
+#include "RawImageWriter.h"
 #include "TileGenerator.h"
+#include "TileServer.h"
 #include "ZlibDecompressor.h"
+#include "db-shared.h"
 #if USE_SQLITE3
 #include "db-sqlite3.h"
 #endif
@@ -32,6 +46,9 @@
 #if USE_REDIS
 #include "db-redis.h"
 #endif
+#if USE_POSTGRESQL
+#include "db-postgresql.h"
+#endif
 
 using namespace std;
 
@@ -45,6 +62,12 @@ static inline int64_t pythonmodulo(int64_t i, int64_t mod)
 	}
 }
 
+// Division, rounding towards minus infinity
+static inline int floorDiv(int value, int divisor)
+{
+	return value >= 0 ? value / divisor : -((-value + divisor - 1) / divisor);
+}
+
 static inline int unsignedToSigned(long i, long max_positive)
 {
 	if (i < max_positive) {
@@ -81,7 +104,7 @@ static inline void readString(string &str, const unsigned char *data, size_t off
 
 static inline void checkBlockNodeDataLimit(int version, size_t dataLength)
 {
-	int datapos = 16 * 16 * 16;
+	int datapos = 16 * 16 * 16 - 1;	// Last node
 	if (version >= 24) {
 		size_t index = datapos << 1;
 		checkDataLimit("node:24", index, 2, dataLength);
@@ -96,25 +119,121 @@ static inline void checkBlockNodeDataLimit(int version, size_t dataLength)
 	}
 }
 
-static inline int readBlockContent(const unsigned char *mapData, int version, int datapos)
+// Read the content (node id) of a node. Version class is 24 for
+// map version 24 and later, and 20 for map versions 20 to 23.
+template<int versionClass>
+static inline unsigned readBlockContent(const unsigned char *mapData, int datapos)
 {
-	if (version >= 24) {
+	if (versionClass >= 24) {
 		size_t index = datapos << 1;
 		return (mapData[index] << 8) | mapData[index + 1];
 	}
-	else if (version >= 20) {
+	else {
 		if (mapData[datapos] <= 0x80) {
 			return mapData[datapos];
 		}
 		else {
-			return (int(mapData[datapos]) << 4) | (int(mapData[datapos + 0x2000]) >> 4);
+			return (unsigned(mapData[datapos]) << 4) | (unsigned(mapData[datapos + 0x2000]) >> 4);
 		}
 	}
-	else {
-		std::ostringstream oss;
-		oss << "Unsupported map version " << version;
-		throw std::runtime_error(oss.str());
+}
+
+// Classification of node ids, for finding the surface of a map block
+// one layer of 16 nodes at a time.
+enum NodeClass {
+	NodeClassSkip = 0,		// Not drawn (e.g. air)
+	NodeClassTransparent = 1,	// Drawn, but nodes below it are visible
+	NodeClassOpaque = 2,		// Drawn, and hides nodes below it
+	NodeClassUnknown = 3,		// No color defined
+};
+
+// Bytes after the last entry of a node class table (the AVX2 gather reads 4 bytes)
+#define NODECLASS_PADDING	3
+
+// Number of image rows that are stored and written at a time
+#define IMAGE_BAND_LINES	128
+
+// Index of the lowest bit set in a (non-zero) mask
+static inline int lowestBit(unsigned mask)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(mask);
+#else
+	int bit = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+// Classify the 16 nodes of one x-row of a layer of a map block (version >= 24).
+// Node ids beyond nodeCount have class nodeClass[nodeCount].
+// Returns the bitmasks of the nodes that are not skipped, and of the opaque nodes.
+// Only the nodes in the pending mask need to be classified.
+static inline void classifyNodeRow(const unsigned char *row, const uint8_t *nodeClass, unsigned nodeCount, unsigned pending, unsigned &drawMask, unsigned &opaqueMask)
+{
+	// Rows consisting of a single node (air, stone, ...) are very common.
+	// Classify those just once.
+	uint16_t firstNode;
+	memcpy(&firstNode, row, sizeof(firstNode));
+#if defined(__AVX2__)
+	__m256i nodes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row));
+	bool uniform = _mm256_movemask_epi8(_mm256_cmpeq_epi16(nodes, _mm256_set1_epi16(firstNode))) == -1;
+#elif defined(__SSE2__)
+	__m128i first = _mm_set1_epi16(firstNode);
+	__m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row));
+	__m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 16));
+	bool uniform = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(low, first), _mm_cmpeq_epi16(high, first))) == 0xffff;
+#else
+	uint64_t words[4];
+	memcpy(words, row, sizeof(words));
+	uint64_t first = firstNode;
+	first |= first << 16;
+	first |= first << 32;
+	bool uniform = words[0] == first && words[1] == first && words[2] == first && words[3] == first;
+#endif
+	if (uniform) {
+		unsigned id = (row[0] << 8) | row[1];
+		uint8_t c = nodeClass[id < nodeCount ? id : nodeCount];
+		drawMask = c != NodeClassSkip ? 0xffff : 0;
+		opaqueMask = c == NodeClassOpaque ? 0xffff : 0;
+		return;
+	}
+
+#if defined(__AVX2__)
+	// Gather the classes of all 16 nodes (the ids are big-endian)
+	const __m256i swapBytes = _mm256_setr_epi8(
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+		1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	__m256i ids = _mm256_shuffle_epi8(nodes, swapBytes);
+	__m256i limit = _mm256_set1_epi32(nodeCount);
+	__m256i idsLow = _mm256_min_epu32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(ids)), limit);
+	__m256i idsHigh = _mm256_min_epu32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(ids, 1)), limit);
+	const int *table = reinterpret_cast<const int *>(nodeClass);
+	__m256i classMask = _mm256_set1_epi32(0xff);
+	__m256i classLow = _mm256_and_si256(_mm256_i32gather_epi32(table, idsLow, 1), classMask);
+	__m256i classHigh = _mm256_and_si256(_mm256_i32gather_epi32(table, idsHigh, 1), classMask);
+	__m256i skip = _mm256_setzero_si256();
+	__m256i opaque = _mm256_set1_epi32(NodeClassOpaque);
+	drawMask = ~(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(classLow, skip)))
+		| (_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(classHigh, skip))) << 8)) & 0xffff;
+	opaqueMask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(classLow, opaque)))
+		| (_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(classHigh, opaque))) << 8);
+#else
+	drawMask = 0;
+	opaqueMask = 0;
+	for (; pending; pending &= pending - 1) {
+		int x = lowestBit(pending);
+		unsigned id = (row[x << 1] << 8) | row[(x << 1) + 1];
+		uint8_t c = nodeClass[id < nodeCount ? id : nodeCount];
+		if (c != NodeClassSkip)
+			drawMask |= 1 << x;
+		if (c == NodeClassOpaque)
+			opaqueMask |= 1 << x;
 	}
+#endif
 }
 
 static const ColorEntry nodeColorNotDrawnObject;
@@ -126,10 +245,11 @@ struct HeightMapColor
 	Color color[2];
 };
 
-TileGenerator::TileGenerator():
+TileGeneratorSettings::TileGeneratorSettings():
 	verboseCoordinates(0),
 	verboseReadColors(0),
 	verboseStatistics(false),
+	verboseUnknownNodes(false),
 	progressIndicator(false),
 	m_heightMap(false),
 	m_heightMapYScale(1),
@@ -144,6 +264,7 @@ TileGenerator::TileGenerator():
 	m_drawPlayers(false),
 	m_drawScale(DRAWSCALE_NONE),
 	m_drawAlpha(false),
+	m_mixMode(PixelAttribute::AlphaMixCumulative),
 	m_drawAir(false),
 	m_shading(true),
 	m_backend(DEFAULT_BACKEND),
@@ -151,18 +272,22 @@ TileGenerator::TileGenerator():
 	m_blockGeometry(false),
 	m_scaleFactor(1),
 	m_sqliteCacheWorldRow(false),
+	m_fetchSurfaceFirst(false),
 	m_chunkSize(0),
 	m_sideScaleMajor(0),
 	m_sideScaleMinor(0),
 	m_heightScaleMajor(0),
 	m_heightScaleMinor(0),
-	m_image(0),
-	m_xMin(INT_MAX/16-1),
-	m_xMax(INT_MIN/16+1),
-	m_zMin(INT_MAX/16-1),
-	m_zMax(INT_MIN/16+1),
-	m_yMin(INT_MAX/16-1),
-	m_yMax(INT_MIN/16+1),
+	m_pngCompression(Z_DEFAULT_COMPRESSION),
+	m_pngFilter(PngWriter::FilterAdaptive),
+	m_pngThreads(0),
+	m_outputFormat(ImageWriter::FormatPng),
+	m_pyramidLevels(0),
+	m_incremental(false),
+	m_serverThreads(0),
+	m_serverMemoryTiles(TILESERVER_MEMORY_TILES_DEFAULT),
+	m_serverDiskTiles(TILESERVER_DISK_TILES_DEFAULT),
+	m_dataChecksum(0),
 	m_reqXMin(MAPBLOCK_MIN),
 	m_reqXMax(MAPBLOCK_MAX),
 	m_reqYMin(MAPBLOCK_MIN),
@@ -175,15 +300,17 @@ TileGenerator::TileGenerator():
 	m_mapYStartNodeOffset(0),
 	m_mapXEndNodeOffset(0),
 	m_mapYEndNodeOffset(0),
+	m_mapXStartNodeOffsetOrig(0),
+	m_mapYStartNodeOffsetOrig(0),
+	m_mapXEndNodeOffsetOrig(0),
+	m_mapYEndNodeOffsetOrig(0),
 	m_tileXOrigin(TILECENTER_AT_WORLDCENTER),
 	m_tileZOrigin(TILECENTER_AT_WORLDCENTER),
+	m_tileXCentered(false),
+	m_tileYCentered(false),
 	m_tileWidth(0),
 	m_tileHeight(0),
-	m_tileBorderSize(1),
-	m_tileMapXOffset(0),
-	m_tileMapYOffset(0),
-	m_surfaceHeight(INT_MIN),
-	m_surfaceDepth(INT_MAX)
+	m_tileBorderSize(1)
 {
 	// Load default grey colors.
 	m_heightMapColors.push_back(HeightMapColor(INT_MIN, Color(0,0,0), -129, Color(0,0,0)));
@@ -191,8 +318,63 @@ TileGenerator::TileGenerator():
 	m_heightMapColors.push_back(HeightMapColor(128, Color(255,255,255), INT_MAX, Color(255,255,255)));
 }
 
+TileGenerator::TileGenerator():
+	m_db(0),
+	m_worldDatabase(0),
+	m_image(0),
+	m_imageRows(0),
+	m_imageBandIndex(0),
+	m_imageBandBegin(0),
+	m_imageBandEnd(0),
+	m_imageFile(0),
+	m_imageBuffer(0),
+	m_imageBufferStride(0),
+	m_imageWriter(0),
+	m_pyramidWriter(0),
+	m_mapState(0),
+	m_havePreviousMapState(false),
+	m_surfaceCache(0),
+	m_xMin(INT_MAX/16-1),
+	m_xMax(INT_MIN/16+1),
+	m_zMin(INT_MAX/16-1),
+	m_zMax(INT_MIN/16+1),
+	m_yMin(INT_MAX/16-1),
+	m_yMax(INT_MIN/16+1),
+	m_tileMapXOffset(0),
+	m_tileMapYOffset(0),
+	m_tileBorderXCount(0),
+	m_tileBorderYCount(0),
+	m_contextMargin(0),
+	m_surfaceHeight(INT_MIN),
+	m_surfaceDepth(INT_MAX),
+	m_nodeIDMapping(&m_nodeIDMappingEmpty),
+	m_renderMapBlockLayers(0),
+	m_renderMapBlockNodes(0),
+	m_heightMapColorTableMin(0),
+	m_blocksRendered(0),
+	m_blocksRequested(0),
+	m_unpackErrors(0)
+{
+}
+
 TileGenerator::~TileGenerator()
 {
+	closeImage();
+	if (m_surfaceCache) {
+		// The cache of a world opened by openWorld()
+		try {
+			m_surfaceCache->close();
+		}
+		catch (std::exception &e) {
+			std::cerr << "Exception: " << e.what() << std::endl;
+		}
+		delete m_surfaceCache;
+	}
+	delete m_db;
+	if (m_worldDatabase) {
+		delete m_worldDatabase->db;
+		delete m_worldDatabase;
+	}
 }
 
 void TileGenerator::setHeightMap(bool enable)
@@ -237,6 +419,11 @@ void TileGenerator::setSqliteCacheWorldRow(bool cacheWorldRow)
 	m_sqliteCacheWorldRow = cacheWorldRow;
 }
 
+void TileGenerator::setFetchSurfaceFirst(bool surfaceFirst)
+{
+	m_fetchSurfaceFirst = surfaceFirst;
+}
+
 void TileGenerator::setScaleColor(const Color &scaleColor)
 {
 	m_scaleColor = scaleColor;
@@ -340,6 +527,13 @@ void TileGenerator::setDrawAlpha(bool drawAlpha)
     m_drawAlpha = drawAlpha;
 }
 
+void TileGenerator::setAlphaMixMode(PixelAttribute::AlphaMixingMode mode)
+{
+	if (mode == PixelAttribute::AlphaMixDarkenBit)
+		mode = PixelAttribute::AlphaMixCumulativeDarken;
+	m_mixMode = mode;
+}
+
 void TileGenerator::setDrawAir(bool drawAir)
 {
 	m_drawAir = drawAir;
@@ -458,6 +652,59 @@ void TileGenerator::setChunkSize(int size)
 	m_chunkSize = size;
 }
 
+void TileGenerator::setPngCompression(int level)
+{
+	m_pngCompression = level;
+}
+
+void TileGenerator::setPngFilter(PngWriter::Filter filter)
+{
+	m_pngFilter = filter;
+}
+
+// 0: use one thread per processor
+void TileGenerator::setPngThreads(int threads)
+{
+	m_pngThreads = threads;
+}
+
+void TileGenerator::setOutputFormat(ImageWriter::Format format)
+{
+	m_outputFormat = format;
+}
+
+// 0: until the map fits in 2x2 tiles
+void TileGenerator::setPyramidLevels(int levels)
+{
+	m_pyramidLevels = levels;
+}
+
+// Render only what changed since the previous time (the map state is saved in a
+// separate file). The state is only used if the settings that determine the pixels
+// of the map are the same.
+void TileGenerator::setIncremental(bool incremental)
+{
+	m_incremental = incremental;
+}
+
+// Keep the surface of the block columns in a cache file, and render the block columns
+// that are in it (and did not change) from the cache.
+void TileGenerator::setSurfaceCache(const std::string &path)
+{
+	m_surfaceCachePath = path;
+}
+
+void TileGenerator::setServerThreads(int threads)
+{
+	m_serverThreads = threads;
+}
+
+void TileGenerator::setServerCacheSize(int memoryTiles, int diskTiles)
+{
+	m_serverMemoryTiles = memoryTiles;
+	m_serverDiskTiles = diskTiles;
+}
+
 void TileGenerator::sanitizeParameters(void)
 {
 	if (m_scaleFactor > 1) {
@@ -492,6 +739,13 @@ void TileGenerator::sanitizeParameters(void)
 			    << m_tileWidth << " x " << m_tileHeight << std::endl;
 		}
 	}
+	if (m_outputFormat == ImageWriter::FormatPyramid) {
+		// The pixels must map to the tile grid
+		if (borderLeft() || borderRight() || borderTop() || borderBottom())
+			throw std::runtime_error("Pyramid output cannot be combined with --drawscale or --drawheightscale");
+		if ((m_tileWidth || m_tileHeight) && m_tileBorderSize)
+			throw std::runtime_error("Pyramid output cannot be combined with --tiles (unless the tile border size is 0)");
+	}
 }
 
 void TileGenerator::generate(const std::string &input, const std::string &output)
@@ -503,28 +757,417 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 
 	openDb(input_path);
 	sanitizeParameters();
+	renderWorld(input, input_path, output);
+}
+
+// Render the map, and render it again whenever the world changes, until the process
+// is stopped. The database (if possible), the colors and the node id mappings of the
+// blocks are kept between renders, and only the parts of the map that changed are
+// rendered (see setIncremental()).
+void TileGenerator::watch(const std::string &input, const std::string &output, int interval)
+{
+	string input_path = input;
+	if (input_path[input.length() - 1] != PATH_SEPARATOR) {
+		input_path += PATH_SEPARATOR;
+	}
+
+	openDb(input_path);
+	sanitizeParameters();
+	RenderParameters parameters;
+	saveRenderParameters(parameters);
+	for (bool first = true; ; first = false) {
+		if (!m_db)
+			openDb(input_path);
+		// Before rendering, so that changes made while rendering are not missed
+		uint64_t version = m_db->getDataVersion();
+		try {
+			renderWorld(input, input_path, output);
+		}
+		catch (std::runtime_error &e) {
+			// E.g. the world is being written. Try again later.
+			if (first)
+				throw;
+			std::cerr << "Exception: " << e.what() << std::endl;
+			closeImage();
+			delete m_surfaceCache;
+			m_surfaceCache = 0;
+			version = 0;
+		}
+		if (!version) {
+			// Changes can't be detected: update the map every time. The database is
+			// not kept open, as some backends lock it.
+			delete m_db;
+			m_db = 0;
+			std::this_thread::sleep_for(std::chrono::seconds(interval));
+		}
+		else {
+			do {
+				std::this_thread::sleep_for(std::chrono::seconds(interval));
+			} while (m_db->getDataVersion() == version);
+			m_db->clearBlockCache();
+		}
+		restoreRenderParameters(parameters);
+	}
+}
+
+// Serve the tiles of a slippy map of the world over HTTP, rendering them when they are
+// requested (see TileServer). output is the directory of the tile cache.
+void TileGenerator::serve(const std::string &input, const std::string &output, const std::string &address, int port)
+{
+	string input_path = input;
+	if (input_path[input.length() - 1] != PATH_SEPARATOR) {
+		input_path += PATH_SEPARATOR;
+	}
+
+	// The tiles must map to the tile grid, and fit together
+	if (m_outputFormat != ImageWriter::FormatPng)
+		throw std::runtime_error("Serving tiles cannot be combined with --output-format");
+	if (m_incremental || !m_surfaceCachePath.empty())
+		throw std::runtime_error("Serving tiles cannot be combined with --incremental or --surface-cache");
+	if (borderLeft() || borderRight() || borderTop() || borderBottom())
+		throw std::runtime_error("Serving tiles cannot be combined with --drawscale or --drawheightscale");
+	if (m_tileWidth || m_tileHeight)
+		throw std::runtime_error("Serving tiles cannot be combined with --tiles");
+	if (m_reqXMin != MAPBLOCK_MIN || m_reqXMax != MAPBLOCK_MAX || m_reqZMin != MAPBLOCK_MIN || m_reqZMax != MAPBLOCK_MAX)
+		throw std::runtime_error("Serving tiles cannot be combined with a map geometry");
+	for (std::vector<DrawObject>::const_iterator object = m_drawObjects.begin(); object != m_drawObjects.end(); ++object)
+		if (!object->world)
+			throw std::runtime_error("Serving tiles cannot be combined with drawing in map coordinates (--drawmap...)");
+
+	openDb(input_path);
+	sanitizeParameters();
+	DBShared::Database database(m_db);
+	DBShared db(database);
+	db.getDataVersion();
+
+	int levels = m_pyramidLevels;
+	if (!levels) {
+		// As for a pyramid of the world: until the world fits in 2x2 tiles
+		int xMin = INT_MAX, xMax = INT_MIN, zMin = INT_MAX, zMax = INT_MIN;
+		const DB::BlockPosList &blocks = db.getBlockPos();
+		for (DB::BlockPosList::const_iterator pos = blocks.begin(); pos != blocks.end(); ++pos) {
+			if (pos->y < m_reqYMin || pos->y > m_reqYMax)
+				continue;
+			if (pos->x < xMin) xMin = pos->x;
+			if (pos->x > xMax) xMax = pos->x;
+			if (pos->z < zMin) zMin = pos->z;
+			if (pos->z > zMax) zMax = pos->z;
+		}
+		for (levels = 1; xMin <= xMax && levels < 24; levels++) {
+			// Pixel coordinates of the world in the least detailed level
+			int scale = m_scaleFactor << (levels - 1);
+			if (floorDiv(xMax * 16 + 15, scale) - floorDiv(xMin * 16, scale) < PYRAMID_TILE_SIZE
+					&& floorDiv(-zMin * 16 - 1, scale) - floorDiv(-zMax * 16 - 16, scale) < PYRAMID_TILE_SIZE)
+				break;
+		}
+	}
+
+	std::vector<std::unique_ptr<TileGenerator> > renderers;
+	RenderParameters parameters;
+	saveRenderParameters(parameters);
+	TileServer server(output, levels, m_scaleFactor, m_bgColor.to_libgd(), m_pngCompression, m_pngFilter);
+	server.setCacheSize(m_serverMemoryTiles, m_serverDiskTiles);
+	server.setDataVersionFunction([&db]() { return db.getDataVersion(); });
+	int threads = m_serverThreads;
+	if (!threads)
+		threads = std::thread::hardware_concurrency();
+	if (!threads)
+		threads = 1;
+	// E.g. PostgreSQL: every thread reads blocks with a connection of its own
+	bool ownConnections = m_db->preferConnectionPerThread();
+	for (int i = 0; i < threads; i++) {
+		TileGenerator *renderer = createTileRenderer(new DBShared(database, ownConnections ? createDb(input_path) : 0));
+		renderers.push_back(std::unique_ptr<TileGenerator>(renderer));
+		server.addWorker([renderer, &parameters, &input, &input_path](int scale, int x, int y, const std::string &path) {
+			return renderer->renderTile(parameters, input, input_path, scale, x, y, path);
+		});
+	}
+	cout << "Serving zoom levels 0 to " << levels - 1 << " at http://" << (address.empty() ? "localhost" : address)
+		<< ":" << port << "/<zoom>/<x>/<y>.png" << std::endl;
+	server.run(address, port);
+}
+
+// A generator with the same settings, for rendering tiles on another thread. It reads
+// the blocks using db, and owns it.
+TileGenerator *TileGenerator::createTileRenderer(DB *db) const
+{
+	TileGenerator *renderer = new TileGenerator();
+	static_cast<TileGeneratorSettings &>(*renderer) = *this;
+	renderer->m_db = db;
+	renderer->m_shrinkGeometry = false;
+	renderer->m_blockGeometry = false;
+	renderer->m_pngThreads = 1;
+	renderer->progressIndicator = false;
+	return renderer;
+}
+
+// Render tile (x, y) of the tile grid of the given scale factor (see PyramidWriter) as
+// a png file. Returns false if the tile contains no map blocks.
+bool TileGenerator::renderTile(const RenderParameters &parameters, const std::string &input, const std::string &inputPath,
+	int scale, int x, int y, const std::string &path)
+{
+	int size = PYRAMID_TILE_SIZE * scale;
+	if (!prepareRegion(parameters, input, inputPath, scale, x * size, -(y + 1) * size, size, size))
+		return false;
+	try {
+		createImage(path);
+		renderMap();
+		writeImage();
+	}
+	catch (...) {
+		closeImage();
+		throw;
+	}
+	return true;
+}
+
+// Prepare rendering the map of the nodes from (xMin, zMin) up to (xMin + xSize - 1,
+// zMin + zSize - 1) with the given scale factor: load its blocks, and compute the map
+// parameters. Returns false if the region contains no map blocks; it is then not
+// prepared any further.
+bool TileGenerator::prepareRegion(const RenderParameters &parameters, const std::string &input, const std::string &inputPath,
+	int scale, int xMin, int zMin, int xSize, int zSize)
+{
+	restoreRenderParameters(parameters);
+	m_scaleFactor = scale;
+	// The shading of the westernmost column and the northernmost row of the map depends
+	// on the nodes west and north of it, so they are rendered as well.
+	m_contextMargin = 1;
+	int zMax = zMin + zSize - 1;
+	setGeometry(NodeCoord(xMin - scale, zMin, 0), NodeCoord(xMin + xSize - 1, zMax + scale, 0));
 	loadBlocks();
+	if (!haveBlocksInside(xMin, zMax))
+		return false;
 	computeMapParameters(input);
-	createImage();
-	renderMap();
-	if ((m_drawScale & DRAWSCALE_MASK)) {
-		renderScale();
+	if (m_drawPlayers) {
+		loadPlayers(inputPath);
 	}
-	if (m_heightMap && (m_drawScale & DRAWHEIGHTSCALE_MASK)) {
-		renderHeightScale();
+	if (!m_drawObjects.empty()) {
+		convertDrawObjects();
 	}
-	if (m_drawOrigin) {
-		renderOrigin();
+	return true;
+}
+
+// Whether any of the loaded map blocks has nodes east of xMin and south of zMax, i.e.
+// is not only part of the context margin of the map.
+bool TileGenerator::haveBlocksInside(int xMin, int zMax) const
+{
+	const BlockColumnIndex::ColumnList &columns = m_blockIndex.columns();
+	for (BlockColumnIndex::ColumnList::const_iterator column = columns.begin(); column != columns.end(); ++column) {
+		if (column->x * 16 + 15 >= xMin && column->z * 16 <= zMax)
+			return true;
+	}
+	return false;
+}
+
+// Render the maps of the jobs, which may be of any parts of the world, reading the world
+// only once: the lists of the map blocks and of their fingerprints are read once, and the
+// surface of every block column is rendered once, and shared by all maps that contain it,
+// using the surface cache (see setSurfaceCache()). Without a surface cache, a temporary
+// one is used, next to the first output file.
+void TileGenerator::generateJobs(const std::string &input, const std::vector<Job> &jobs)
+{
+	string input_path = input;
+	if (input_path[input.length() - 1] != PATH_SEPARATOR) {
+		input_path += PATH_SEPARATOR;
+	}
+
+	if (jobs.empty())
+		throw std::runtime_error("No maps to render");
+	// Only the blocks of the maps are needed
+	NodeCoord corner1 = jobs[0].corner1;
+	NodeCoord corner2 = jobs[0].corner2;
+	for (std::vector<Job>::const_iterator job = jobs.begin(); job != jobs.end(); ++job) {
+		for (int i = 0; i < 2; i++) {
+			if (job->corner1.dimension[i] < corner1.dimension[i])
+				corner1.dimension[i] = job->corner1.dimension[i];
+			if (job->corner2.dimension[i] > corner2.dimension[i])
+				corner2.dimension[i] = job->corner2.dimension[i];
+		}
+	}
+	setGeometry(corner1, corner2);
+	openSharedDb(input_path);
+
+	int scaleFactor = m_scaleFactor;
+	RenderParameters parameters;
+	saveRenderParameters(parameters);
+	std::string temporaryCache;
+	if (m_surfaceCachePath.empty()) {
+		temporaryCache = stateFilePath(jobs[0].output, ".surfacecache");
+		m_surfaceCachePath = temporaryCache;
+	}
+	try {
+		for (std::vector<Job>::const_iterator job = jobs.begin(); job != jobs.end(); ++job) {
+			restoreRenderParameters(parameters);
+			m_scaleFactor = job->scaleFactor ? job->scaleFactor : scaleFactor;
+			setGeometry(job->corner1, job->corner2);
+			sanitizeParameters();
+			renderWorld(input, input_path, job->output);
+		}
+	}
+	catch (...) {
+		closeImage();
+		delete m_surfaceCache;
+		m_surfaceCache = 0;
+		if (!temporaryCache.empty())
+			remove(temporaryCache.c_str());
+		throw;
+	}
+	if (!temporaryCache.empty()) {
+		remove(temporaryCache.c_str());
+		m_surfaceCachePath.clear();
 	}
+}
+
+// Open the world, for rendering any number of maps of regions of it into memory (see
+// renderRegion()). The list of map blocks is kept until the database changes.
+void TileGenerator::openWorld(const std::string &input)
+{
+	// The maps must have the requested size
+	if (m_incremental)
+		throw std::runtime_error("Rendering regions cannot be combined with incremental rendering");
+	if (borderLeft() || borderRight() || borderTop() || borderBottom())
+		throw std::runtime_error("Rendering regions cannot be combined with drawing scales");
+	if (m_tileWidth || m_tileHeight)
+		throw std::runtime_error("Rendering regions cannot be combined with tiles");
+
+	m_worldInput = input;
+	m_worldInputPath = input;
+	if (m_worldInputPath[input.length() - 1] != PATH_SEPARATOR) {
+		m_worldInputPath += PATH_SEPARATOR;
+	}
+	openSharedDb(m_worldInputPath);
+	sanitizeParameters();
+	m_shrinkGeometry = false;
+	m_blockGeometry = false;
+	saveRenderParameters(m_worldParameters);
+	// The cache is kept open (and locked) for all maps of the world
+	if (!m_surfaceCachePath.empty())
+		openSurfaceCache();
+}
+
+// Render the map of the nodes from (x, z) up to (x + width * scale - 1, z + height * scale - 1)
+// into buffer, as rows of 8-bit RGBA pixels, <stride> bytes apart. The first row is the
+// northernmost row. x and z must be multiples of the scale factor.
+//
+// Returns false if the region contains no map blocks. The map is then filled with the
+// background color.
+bool TileGenerator::renderRegion(int x, int z, int width, int height, int scale, uint8_t *buffer, size_t stride)
+{
+	if (!m_worldDatabase)
+		throw std::runtime_error("No world was opened");
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8 && scale != 16)
+		throw std::runtime_error("Invalid scale factor (must be 1, 2, 4, 8 or 16)");
+	if (width <= 0 || height <= 0 || x % scale || z % scale
+			|| x < MAPBLOCK_MIN * 16 || (long long) x + (long long) width * scale > (MAPBLOCK_MAX + 1) * 16
+			|| z < MAPBLOCK_MIN * 16 || (long long) z + (long long) height * scale > (MAPBLOCK_MAX + 1) * 16)
+		throw std::runtime_error("Invalid region");
+	if (stride < size_t(width) * 4)
+		throw std::runtime_error("The rows of the buffer are too small");
+
+	// The blocks are read again if the world changed
+	m_db->getDataVersion();
+	m_statistics.maps++;
+	if (!prepareRegion(m_worldParameters, m_worldInput, m_worldInputPath, scale, x, z, width * scale, height * scale)) {
+		std::vector<int> row(width, m_bgColor.to_libgd());
+		RawImageWriter writer(buffer, stride, ImageWriter::FormatRgba, width, height);
+		for (int y = 0; y < height; y++)
+			writer.writeRows(&row[0], 0, 1);
+		writer.finish();
+		m_statistics.emptyMaps++;
+		return false;
+	}
+	if (m_pictWidth != width || m_pictHeight != height) {
+		ostringstream oss;
+		oss << "Internal error: map of region is " << m_pictWidth << "x" << m_pictHeight << " instead of " << width << "x" << height;
+		throw std::runtime_error(oss.str());
+	}
+	m_imageBuffer = buffer;
+	m_imageBufferStride = stride;
+	try {
+		createImage("");
+		if (m_surfaceCache)
+			prepareSurfaceCache();
+		renderMap();
+		writeImage();
+	}
+	catch (...) {
+		// Columns that were not stored remain invalid: the cache can still be used
+		m_imageBuffer = 0;
+		closeImage();
+		throw;
+	}
+	m_imageBuffer = 0;
+	m_statistics.blocksRead = m_db->getBlocksReadCount();
+	m_statistics.blocksRendered += m_blocksRendered;
+	for (UnknownNodeMap::const_iterator node = m_unknownNodes.begin(); node != m_unknownNodes.end(); ++node)
+		m_statistics.unknownNodes += node->second.count;
+	return true;
+}
+
+void TileGenerator::saveRenderParameters(RenderParameters &parameters) const
+{
+	parameters.mapXStartNodeOffset = m_mapXStartNodeOffset;
+	parameters.mapYStartNodeOffset = m_mapYStartNodeOffset;
+	parameters.mapXEndNodeOffset = m_mapXEndNodeOffset;
+	parameters.mapYEndNodeOffset = m_mapYEndNodeOffset;
+	parameters.tileXOrigin = m_tileXOrigin;
+	parameters.tileZOrigin = m_tileZOrigin;
+	parameters.tileWidth = m_tileWidth;
+	parameters.tileHeight = m_tileHeight;
+	parameters.drawObjects = m_drawObjects;
+}
+
+// Restore the parameters, and reset everything that was computed from the world
+void TileGenerator::restoreRenderParameters(const RenderParameters &parameters)
+{
+	m_mapXStartNodeOffset = parameters.mapXStartNodeOffset;
+	m_mapYStartNodeOffset = parameters.mapYStartNodeOffset;
+	m_mapXEndNodeOffset = parameters.mapXEndNodeOffset;
+	m_mapYEndNodeOffset = parameters.mapYEndNodeOffset;
+	m_tileXOrigin = parameters.tileXOrigin;
+	m_tileZOrigin = parameters.tileZOrigin;
+	m_tileWidth = parameters.tileWidth;
+	m_tileHeight = parameters.tileHeight;
+	m_drawObjects = parameters.drawObjects;
+	m_xMin = INT_MAX/16-1;
+	m_xMax = INT_MIN/16+1;
+	m_zMin = INT_MAX/16-1;
+	m_zMax = INT_MIN/16+1;
+	m_yMin = INT_MAX/16-1;
+	m_yMax = INT_MIN/16+1;
+	m_surfaceHeight = INT_MIN;
+	m_surfaceDepth = INT_MAX;
+	m_contextMargin = 0;
+	m_blockIndex.clear();
+	m_blockFingerprints.clear();
+	m_unknownNodes.clear();
+}
+
+void TileGenerator::renderWorld(const std::string &input, const std::string &inputPath, const std::string &output)
+{
+	loadBlocks();
+	computeMapParameters(input);
 	if (m_drawPlayers) {
-		renderPlayers(input_path);
+		loadPlayers(inputPath);
 	}
 	if (!m_drawObjects.empty()) {
-		renderDrawObjects();
+		convertDrawObjects();
+	}
+	createImage(output);
+	if (m_incremental)
+		prepareIncrementalRender(output);
+	if (!m_surfaceCachePath.empty())
+		prepareSurfaceCache();
+	renderMap();
+	if (m_surfaceCache) {
+		m_surfaceCache->close();
+		delete m_surfaceCache;
+		m_surfaceCache = 0;
 	}
 	if (progressIndicator)
 	    cout << "Writing image...\r" << std::flush;
-	writeImage(output);
+	writeImage();
 	if (progressIndicator)
 	    cout << std::setw(20) << " " <<  "\r" << std::flush;
 	printUnknown();
@@ -538,6 +1181,7 @@ void TileGenerator::parseDataStream(std::istream &in, const std::string &filenam
 	int linenr = 0;
 	for (std::getline(in,line); in.good(); std::getline(in,line)) {
 		linenr++;
+		m_dataChecksum = crc32(m_dataChecksum, reinterpret_cast<const Bytef *>(line.c_str()), line.length());
 		size_t comment = line.find_first_of('#');
 		if (comment != string::npos)
 			line.erase(comment);
@@ -702,7 +1346,7 @@ void TileGenerator::parseHeightMapNodesLine(const std::string &line, std::string
 	}
 }
 
-std::string TileGenerator::getWorldDatabaseBackend(const std::string &input)
+std::string TileGenerator::getWorldDatabaseBackend(const std::string &input) const
 {
 	string backend;
 
@@ -783,6 +1427,13 @@ int TileGenerator::getMapChunkSize(const std::string &input)
 
 void TileGenerator::openDb(const std::string &input)
 {
+	m_db = createDb(input);
+}
+
+// A new connection to the database of the world
+DB *TileGenerator::createDb(const std::string &input) const
+{
+	DB *newDb = 0;
 	string backend = m_backend;
 	bool unsupported = false;
 	if (m_backend == "auto")
@@ -791,7 +1442,7 @@ void TileGenerator::openDb(const std::string &input)
 	if(backend == "sqlite3") {
 #if USE_SQLITE3
 		DBSQLite3 *db;
-		m_db = db = new DBSQLite3(input);
+		newDb = db = new DBSQLite3(input);
 		db->cacheWorldRow = m_sqliteCacheWorldRow;
 #else
 		unsupported = true;
@@ -799,14 +1450,23 @@ void TileGenerator::openDb(const std::string &input)
 	}
 	else if (backend == "leveldb") {
 #if USE_LEVELDB
-		m_db = new DBLevelDB(input);
+		newDb = new DBLevelDB(input);
 #else
 		unsupported = true;
 #endif
 	}
 	else if (backend == "redis") {
 #if USE_REDIS
-		m_db = new DBRedis(input);
+		newDb = new DBRedis(input);
+#else
+		unsupported = true;
+#endif
+	}
+	else if (backend == "postgresql") {
+#if USE_POSTGRESQL
+		DBPostgreSQL *db;
+		newDb = db = new DBPostgreSQL(input);
+		db->setBlockLimits(m_reqXMin, m_reqXMax, m_reqYMin, m_reqYMax);
 #else
 		unsupported = true;
 #endif
@@ -818,6 +1478,17 @@ void TileGenerator::openDb(const std::string &input)
 
 	if (unsupported)
 		throw std::runtime_error(((std::string) "World uses backend '") + backend + ", which was not enabled at compile-time.");
+	return newDb;
+}
+
+// Open the database, shared (see DBShared), so that the lists of its blocks are only read
+// once for all maps, until the database changes
+void TileGenerator::openSharedDb(const std::string &input)
+{
+	openDb(input);
+	m_worldDatabase = new DBShared::Database(m_db);
+	m_db = new DBShared(*m_worldDatabase);
+	m_db->getDataVersion();
 }
 
 void TileGenerator::loadBlocks()
@@ -971,7 +1642,7 @@ void TileGenerator::loadBlocks()
 		if (pos.z > m_zMax) {
 			m_zMax = pos.z;
 		}
-		m_positions.push_back(pos);
+		m_blockIndex.add(pos);
 	}
 	if (verboseCoordinates >= 1) {
 		cout
@@ -1071,77 +1742,175 @@ void TileGenerator::loadBlocks()
 			<< ")    blocks: "
 			<< std::setw(10) << map_blocks << "\n";
 	}
-	m_positions.sort();
+	m_blockIndex.finalize();
 	#undef MESSAGE_WIDTH
 }
 
-void TileGenerator::scalePixelRows(PixelAttributes &pixelAttributes, PixelAttributes &pixelAttributesScaled, int zPosLimit) {
-	int y;
-	for (y = pixelAttributes.getNextY(); y <= pixelAttributes.getLastY() && y < worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset; y++) {
-		for (int x = m_mapXStartNodeOffset; x < worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset; x++) {
-			#define pixel pixelAttributes.attribute(y, x)
-			//PixelAttribute &pixel = pixelAttributes.attribute(y, x);
-			if (pixel.nextEmpty) {
-				pixelAttributesScaled.attribute(y / m_scaleFactor, x/m_scaleFactor).nextEmpty = true;
-				x += 15;
-				continue;
-			}
+// Return an image row for writing. Image rows must be requested in order:
+// all bands before the row are finished and written.
+inline int *TileGenerator::imageRow(int y)
+{
 #ifdef DEBUG
-			int mapX = x - m_mapXStartNodeOffset;
-			int mapY = y - m_mapYStartNodeOffset;
-			{ int ix = mapX2ImageX(mapX / m_scaleFactor); assert(ix - borderLeft() >= 0 && ix - borderLeft() - borderRight() < m_pictWidth); }
-			{ int iy = mapY2ImageY(mapY / m_scaleFactor); assert(iy - borderTop() >= 0 && iy - borderTop() - borderBottom() < m_pictHeight); }
+	assert(y >= m_imageBandBegin && y < m_image->sy);
 #endif
-			if (pixel.is_valid() || pixel.color().to_uint())
-				pixelAttributesScaled.attribute(y / m_scaleFactor, x / m_scaleFactor).add(pixel);
-			#undef pixel
+	while (y >= m_imageBandEnd)
+		flushImageBand();
+	return m_image->tpixels[y];
+}
+
+// Return the heights of an image row for writing, or NULL if the image writer doesn't
+// use heights. The row must be part of the current band (i.e. call imageRow() first).
+inline float *TileGenerator::imageHeightRow(int y)
+{
+	std::vector<float> &heights = m_imageHeightBands[m_imageBandIndex];
+	if (heights.empty())
+		return 0;
+	return &heights[size_t(y - m_imageBandBegin) * m_image->sx];
+}
+
+// Scale, shade, and convert the pixel rows that are complete, and store them in the image.
+// This is done one line at a time, while the line is still in the cache.
+void TileGenerator::pushPixelRows(int zPosLimit) {
+	// Before the nodes are shaded
+	if (!m_pyramidLevelPixels.empty())
+		pushPyramidRows(zPosLimit);
+	bool scaled = m_scaleFactor > 1;
+	PixelAttributes &pixelAttributes = scaled ? m_blockPixelAttributesScaled : m_blockPixelAttributes;
+	int sourceXBegin = m_mapXStartNodeOffset;
+	int sourceXEnd = worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset;
+	int sourceYEnd = worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset;
+	int xBegin = sourceXBegin / m_scaleFactor;
+	int xEnd = sourceXEnd / m_scaleFactor;
+	int yEnd = sourceYEnd / m_scaleFactor;
+	double emphasis = m_scaleFactor < 3 ? 1 : 1 / sqrt(m_scaleFactor);
+	int sourceY = m_blockPixelAttributes.getNextY();
+	for (int y = pixelAttributes.getNextY(); y <= pixelAttributes.getLastY(); y++) {
+		if (scaled) {
+			for (; sourceY <= m_blockPixelAttributes.getLastY() && sourceY < sourceYEnd && sourceY / m_scaleFactor <= y; sourceY++)
+				m_blockPixelAttributes.scaleLine(pixelAttributes, sourceY, sourceXBegin, sourceXEnd, m_scaleFactor);
+			pixelAttributes.normalizeLine(y, xBegin, xEnd);
 		}
-	}
-	for (y = pixelAttributesScaled.getNextY(); y <= pixelAttributesScaled.getLastY(); y++) {
-		for (int x = m_mapXStartNodeOffset / m_scaleFactor; x < (worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset) / m_scaleFactor; x++) {
-			#define pixel pixelAttributesScaled.attribute(y, x)
-			if (pixel.nextEmpty) {
-				x += 16 / m_scaleFactor - 1;
-				continue;
+		if (m_shading)
+			pixelAttributes.renderShading(y, emphasis, m_drawAlpha);
+		int mapY = y - m_mapYStartNodeOffset / m_scaleFactor;
+		if (y >= yEnd || mapY < m_contextMargin)
+			continue;
+#ifdef DEBUG
+		{ int ix = mapX2ImageX(m_contextMargin); assert(ix - borderLeft() >= 0); }
+		{ int ix = mapX2ImageX(xEnd - 1 - xBegin); assert(ix - borderLeft() - borderRight() < m_pictWidth); }
+		{ int iy = mapY2ImageY(mapY); assert(iy - borderTop() >= 0 && iy - borderTop() - borderBottom() < m_pictHeight); }
+#endif
+		int imageY = mapY2ImageY(mapY);
+		int *row = imageRow(imageY);
+		float *heightRow = imageHeightRow(imageY);
+		// Tile borders interrupt the image row, so convert the pixels one tile at a time
+		int tileWidth = m_tileWidth && m_tileBorderSize ? m_tileWidth / m_scaleFactor : 0;
+		for (int x = xBegin + m_contextMargin; x < xEnd; ) {
+			int mapX = x - xBegin;
+			int segmentEnd = xEnd;
+			if (tileWidth) {
+				segmentEnd = x + tileWidth - (mapX - m_tileMapXOffset / m_scaleFactor + tileWidth) % tileWidth;
+				if (segmentEnd > xEnd)
+					segmentEnd = xEnd;
 			}
-			if (pixel.is_valid() || pixel.color().to_uint())
-				pixel.normalize();
-			#undef pixel
+			int imageX = mapX2ImageX(mapX);
+			if (heightRow)
+				pixelAttributes.convertLineHeights(y, x, segmentEnd, heightRow + imageX);
+			x = pixelAttributes.convertLine(y, x, segmentEnd, row + imageX);
 		}
 	}
-	int yLimit = worldBlockZ2StoredY(zPosLimit);
-	if (y <= yLimit) {
-		pixelAttributes.scroll(yLimit);
-	}
-}
-
-void TileGenerator::pushPixelRows(PixelAttributes &pixelAttributes, int zPosLimit) {
-	if (m_shading)
-		pixelAttributes.renderShading(m_scaleFactor < 3 ? 1 : 1 / sqrt(m_scaleFactor), m_drawAlpha);
-	int y;
-	for (y = pixelAttributes.getNextY(); y <= pixelAttributes.getLastY() && y < (worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset) / m_scaleFactor; y++) {
-		for (int x = m_mapXStartNodeOffset / m_scaleFactor; x < (worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset) / m_scaleFactor; x++) {
-			int mapX = x - m_mapXStartNodeOffset / m_scaleFactor;
-			int mapY = y - m_mapYStartNodeOffset / m_scaleFactor;
-			#define pixel pixelAttributes.attribute(y, x)
-			//PixelAttribute &pixel = pixelAttributes.attribute(y, x);
-			//if (x < 2 && y < 2)
-			if (pixel.nextEmpty) {
-				x += 16 / m_scaleFactor - 1;
+	if (scaled)
+		m_blockPixelAttributes.scroll(worldBlockZ2StoredY(zPosLimit));
+	pixelAttributes.scroll(worldBlockZ2StoredY(zPosLimit) / m_scaleFactor);
+}
+
+// Set up the less detailed levels of the pyramid that can be scaled from the nodes (i.e. up
+// to a scale factor of 16, like the tile server renders them). The pyramid writer computes
+// the levels after them from the previous level.
+void TileGenerator::preparePyramidLevels(void)
+{
+	int sourceXBegin = m_mapXStartNodeOffset;
+	int sourceXEnd = worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset;
+	int sourceYEnd = worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset;
+	for (int i = 1; i < m_pyramidWriter->levels() && (m_scaleFactor << i) <= 16; i++) {
+		PyramidLevel *level = new PyramidLevel;
+		m_pyramidLevelPixels.push_back(level);
+		int scale = m_scaleFactor << i;
+		level->level = i;
+		level->scale = scale;
+		// Pixels that are only partly covered by the map are part of it
+		level->xBegin = sourceXBegin / scale;
+		level->xEnd = (sourceXEnd + scale - 1) / scale;
+		level->yEnd = (sourceYEnd + scale - 1) / scale;
+		level->nextY = m_mapYStartNodeOffset / scale;
+		// The stored pixels start at a block boundary
+		level->gridX = m_xMin * 16 / scale;
+		level->gridY = -(m_zMax * 16 + 16) / scale;
+		level->pixelAttributes.setParameters(m_storedWidth / scale, 16 / scale, level->nextY, scale, false);
+		level->pixels.assign(level->xEnd - level->xBegin, m_bgColor.to_libgd());
+		level->heights.assign(level->pixels.size(), float(NAN));
+	}
+	m_pyramidWriter->setSuppliedLevels(int(m_pyramidLevelPixels.size()));
+}
+
+// Scale, shade, and convert the pixel rows of the pyramid levels that are complete, and
+// have them written. Like pushPixelRows(), but every level is scaled from the nodes.
+void TileGenerator::pushPyramidRows(int zPosLimit)
+{
+	int sourceXBegin = m_mapXStartNodeOffset;
+	int sourceXEnd = worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset;
+	int sourceYEnd = worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset;
+	for (size_t i = 0; i < m_pyramidLevelPixels.size(); i++) {
+		PyramidLevel &level = *m_pyramidLevelPixels[i];
+		PixelAttributes &pixelAttributes = level.pixelAttributes;
+		double emphasis = level.scale < 3 ? 1 : 1 / sqrt(level.scale);
+		int sourceY = m_blockPixelAttributes.getNextY();
+		for (int y = pixelAttributes.getNextY(); y <= pixelAttributes.getLastY(); y++) {
+			for (; sourceY <= m_blockPixelAttributes.getLastY() && sourceY < sourceYEnd && sourceY / level.scale <= y; sourceY++)
+				m_blockPixelAttributes.scaleLine(pixelAttributes, sourceY, sourceXBegin, sourceXEnd, level.scale);
+			pixelAttributes.normalizeLine(y, level.xBegin, level.xEnd);
+			if (m_shading)
+				pixelAttributes.renderShading(y, emphasis, m_drawAlpha);
+			if (y >= level.yEnd)
 				continue;
+			writePyramidRows(level, y);
+			pixelAttributes.convertLineHeights(y, level.xBegin, level.xEnd, &level.heights[0]);
+			pixelAttributes.convertLine(y, level.xBegin, level.xEnd, &level.pixels[0]);
+			writePyramidRows(level, y + 1);
+		}
+		pixelAttributes.scroll(worldBlockZ2StoredY(zPosLimit) / level.scale);
+	}
+}
+
+// Have the rows of a pyramid level before row yLimit written. Only the current row can
+// have been rendered: the rows before it are empty, or did not change (see updateMapState()).
+void TileGenerator::writePyramidRows(PyramidLevel &level, int yLimit)
+{
+	int width = level.xEnd - level.xBegin;
+	int columnCount = m_xMax - m_xMin + 1;
+	for (; level.nextY < yLimit; level.nextY++) {
+		if (level.mapState && m_havePreviousMapState) {
+			level.mapState->readRows(&level.previousPixels[0], &level.previousHeights[0], 1);
+			int rowBlock = level.nextY * level.scale / 16;
+			bool firstRow = level.nextY * level.scale % 16 == 0;
+			for (int x = 0; x < width; x++) {
+				int columnBlock = (level.xBegin + x) * level.scale / 16;
+				bool firstColumn = (level.xBegin + x) * level.scale % 16 == 0;
+				size_t block = size_t(rowBlock) * columnCount + columnBlock;
+				if (m_changedColumns[block]
+						|| (firstColumn && columnBlock > 0 && m_changedColumns[block - 1])
+						|| (firstRow && rowBlock > 0 && m_changedColumns[block - columnCount]))
+					continue;
+				level.pixels[x] = level.previousPixels[x];
+				level.heights[x] = level.previousHeights[x];
 			}
-#ifdef DEBUG
-			{ int ix = mapX2ImageX(mapX); assert(ix - borderLeft() >= 0 && ix - borderLeft() - borderRight() < m_pictWidth); }
-			{ int iy = mapY2ImageY(mapY); assert(iy - borderTop() >= 0 && iy - borderTop() - borderBottom() < m_pictHeight); }
-#endif
-			if (pixel.is_valid() || pixel.color().to_uint())
-				m_image->tpixels[mapY2ImageY(mapY)][mapX2ImageX(mapX)] = pixel.color().to_libgd();
-			#undef pixel
 		}
-	}
-	int yLimit = worldBlockZ2StoredY(zPosLimit) / m_scaleFactor;
-	if (y <= yLimit) {
-		pixelAttributes.scroll(yLimit);
+		if (level.mapState)
+			level.mapState->writeRows(&level.pixels[0], &level.heights[0], 1);
+		m_pyramidWriter->writeLevelRow(level.level, level.gridY + level.nextY, level.gridX + level.xBegin, width,
+			&level.pixels[0], &level.heights[0]);
+		std::fill(level.pixels.begin(), level.pixels.end(), m_bgColor.to_libgd());
+		std::fill(level.heights.begin(), level.heights.end(), float(NAN));
 	}
 }
 
@@ -1317,38 +2086,88 @@ void TileGenerator::computeMapParameters(const std::string &input)
 	m_pictWidth += m_tileBorderXCount * m_tileBorderSize;
 	m_pictHeight /= m_scaleFactor;
 	m_pictHeight += m_tileBorderYCount * m_tileBorderSize;
-
-	// Print some useful messages in cases where it may not be possible to generate the image...
-	long long pixels = static_cast<long long>(m_pictWidth + borderLeft() + borderRight()) * (m_pictHeight + borderTop() + borderBottom());
-	// Study the libgd code to known why the maximum is the following:
-	long long max_pixels = INT_MAX - INT_MAX % m_pictHeight;
-	if (pixels > max_pixels) {
-		cerr << "WARNING: Image will have " << pixels << " pixels; the PNG graphics library will refuse to handle more than approximately " << INT_MAX << std::endl;
-		cerr << "         (If map generation fails, consider using --scalefactor to reduce the image size by a factor 2)" << std::endl;
-	}
-	// Estimated approximate maximum was determined by trial and error...
-	// (24100x24100 succeeded; 24200x24200 failed)
-	#define ESTIMATED_MAX_PIXELS_32BIT (24100*24100L)
-	else if (sizeof(void *) == 4 && pixels > ESTIMATED_MAX_PIXELS_32BIT) {
-		cerr << "WARNING: Image will have " << pixels << " pixels; The maximum achievable on a 32-bit system is approximately " << ESTIMATED_MAX_PIXELS_32BIT << std::endl;
-		cerr << "         (If map generation fails, consider using --scalefactor to reduce the image size by a factor 2 or 4)" << std::endl;
-	}
-	#undef ESTIMATED_MAX_PIXELS_32BIT
+	m_pictWidth -= m_contextMargin;
+	m_pictHeight -= m_contextMargin;
 }
 
 
-void TileGenerator::createImage()
+void TileGenerator::createImage(const std::string &output)
 {
 	int totalPictHeight = m_pictHeight + borderTop() + borderBottom();
 	int totalPictWidth = m_pictWidth + borderLeft() + borderRight();
-	m_image = gdImageCreateTrueColor(totalPictWidth, totalPictHeight);
+	int pngThreads = m_pngThreads;
+	if (!pngThreads)
+		pngThreads = std::thread::hardware_concurrency();
+	if (m_imageBuffer) {
+		m_imageWriter = new RawImageWriter(m_imageBuffer, m_imageBufferStride, ImageWriter::FormatRgba, totalPictWidth, totalPictHeight);
+	}
+	else if (m_outputFormat == ImageWriter::FormatPyramid) {
+		// Pixel coordinates of the top left corner of the map, in the tile grid of the world
+		int originX = (m_xMin * 16 + m_mapXStartNodeOffset) / m_scaleFactor;
+		int originY = -((m_zMax * 16 + 15 - m_mapYStartNodeOffset) + 1) / m_scaleFactor;
+		PyramidWriter *pyramid = new PyramidWriter(output, totalPictWidth, totalPictHeight, originX, originY,
+			m_pyramidLevels, m_bgColor.to_libgd(), m_pngCompression, m_pngFilter, pngThreads);
+		if (m_incremental)
+			pyramid->setTileStateFile(stateFilePath(output, ".tilestate"));
+		m_imageWriter = new ThreadedImageWriter(pyramid);
+		m_pyramidWriter = pyramid;
+		preparePyramidLevels();
+	}
+	else {
+		m_imageFile = fopen(output.c_str(), "wb");
+		if (!m_imageFile) {
+			std::ostringstream oss;
+			oss << "Error opening '" << output.c_str() << "': " << std::strerror(errno);
+			throw std::runtime_error(oss.str());
+		}
+		if (m_outputFormat == ImageWriter::FormatPng)
+			m_imageWriter = new ThreadedImageWriter(new PngWriter(m_imageFile, totalPictWidth, totalPictHeight, m_pngCompression, m_pngFilter, pngThreads));
+		else
+			m_imageWriter = new ThreadedImageWriter(new RawImageWriter(m_imageFile, m_outputFormat, totalPictWidth, totalPictHeight));
+	}
+
+	// libgd only allocates a single row, which serves as the dummy row.
+	m_image = gdImageCreateTrueColor(totalPictWidth, 1);
 	if (!m_image) {
 		ostringstream oss;
 		oss << "Failed to allocate " << totalPictWidth << "x" << totalPictHeight << " image";
 		throw std::runtime_error(oss.str());
 	}
+	m_imageRows = m_image->tpixels;
+	m_imageRowPointers.assign(totalPictHeight, m_imageRows[0]);
+	m_image->tpixels = &m_imageRowPointers[0];
+	m_image->sy = totalPictHeight;
+	gdImageSetClip(m_image, 0, 0, totalPictWidth - 1, totalPictHeight - 1);
+	int bandLines = totalPictHeight < IMAGE_BAND_LINES ? totalPictHeight : IMAGE_BAND_LINES;
+	for (int i = 0; i < 2; i++) {
+		m_imageBands[i].resize(size_t(totalPictWidth) * bandLines);
+		if (m_imageWriter->usesHeights())
+			m_imageHeightBands[i].resize(size_t(totalPictWidth) * bandLines);
+	}
+	m_imageBandIndex = 0;
+	m_imageBandBegin = 0;
+	m_imageBandEnd = 0;
+	startImageBand(0);
+}
+
+// Fill the rows of a rectangle that are part of the current image band
+static inline void fillBandRectangle(gdImagePtr image, int x1, int y1, int x2, int y2, int bandBegin, int bandEnd, int color)
+{
+	if (y1 < bandBegin)
+		y1 = bandBegin;
+	if (y2 > bandEnd - 1)
+		y2 = bandEnd - 1;
+	if (y1 <= y2)
+		gdImageFilledRectangle(image, x1, y1, x2, y2, color);
+}
+
+// Draw the background and the tile borders of the current image band
+void TileGenerator::drawImageBackground(void)
+{
+	int totalPictHeight = m_pictHeight + borderTop() + borderBottom();
+	int totalPictWidth = m_pictWidth + borderLeft() + borderRight();
 	// Background
-	gdImageFilledRectangle(m_image, 0, 0, totalPictWidth - 1, totalPictHeight -1, m_bgColor.to_libgd());
+	fillBandRectangle(m_image, 0, 0, totalPictWidth - 1, totalPictHeight -1, m_imageBandBegin, m_imageBandEnd, m_bgColor.to_libgd());
 
 	// Draw tile borders
 	if (m_tileWidth && m_tileBorderSize) {
@@ -1359,7 +2178,7 @@ void TileGenerator::createImage()
 			int xPos2 = mapX2ImageX(m_tileMapXOffset / m_scaleFactor + i * m_tileWidth / m_scaleFactor) - borderLeft() - m_tileBorderSize;
 			assert(xPos == xPos2);
 #endif
-			gdImageFilledRectangle(m_image, xPos + borderLeft(), borderTop(), xPos + (m_tileBorderSize-1) + borderLeft(), m_pictHeight + borderTop() - 1, borderColor);
+			fillBandRectangle(m_image, xPos + borderLeft(), borderTop(), xPos + (m_tileBorderSize-1) + borderLeft(), m_pictHeight + borderTop() - 1, m_imageBandBegin, m_imageBandEnd, borderColor);
 		}
 	}
 	if (m_tileHeight && m_tileBorderSize) {
@@ -1370,9 +2189,326 @@ void TileGenerator::createImage()
 			int yPos2 = mapY2ImageY(m_tileMapYOffset / m_scaleFactor + i * m_tileHeight / m_scaleFactor) - borderTop() - m_tileBorderSize;
 			assert(yPos == yPos2);
 #endif
-			gdImageFilledRectangle(m_image, borderLeft(), yPos + borderTop(), m_pictWidth + borderLeft() - 1, yPos + (m_tileBorderSize-1) + borderTop(), borderColor);
+			fillBandRectangle(m_image, borderLeft(), yPos + borderTop(), m_pictWidth + borderLeft() - 1, yPos + (m_tileBorderSize-1) + borderTop(), m_imageBandBegin, m_imageBandEnd, borderColor);
+		}
+	}
+}
+
+// Make the rows starting at y the current image band
+void TileGenerator::startImageBand(int y)
+{
+	int width = m_image->sx;
+	for (int i = m_imageBandBegin; i < m_imageBandEnd; i++)
+		m_imageRowPointers[i] = m_imageRows[0];
+	m_imageBandBegin = y;
+	m_imageBandEnd = y + IMAGE_BAND_LINES;
+	if (m_imageBandEnd > m_image->sy)
+		m_imageBandEnd = m_image->sy;
+	if (m_imageBandBegin >= m_imageBandEnd)
+		return;
+	int *pixels = &m_imageBands[m_imageBandIndex][0];
+	// Like a new libgd image, the band starts out black
+	memset(pixels, 0, sizeof(int) * width * (m_imageBandEnd - m_imageBandBegin));
+	for (int i = m_imageBandBegin; i < m_imageBandEnd; i++)
+		m_imageRowPointers[i] = pixels + size_t(i - m_imageBandBegin) * width;
+	std::vector<float> &heights = m_imageHeightBands[m_imageBandIndex];
+	if (!heights.empty())
+		std::fill(heights.begin(), heights.begin() + size_t(width) * (m_imageBandEnd - m_imageBandBegin), float(NAN));
+	drawImageBackground();
+}
+
+// Draw the overlays on the current image band, have it written, and start the next band.
+// The writer uses the band's memory until the next band is written, so the bands alternate
+// between two buffers.
+void TileGenerator::flushImageBand(void)
+{
+	if (m_mapState)
+		updateMapState();
+	renderOverlays();
+	std::vector<float> &heights = m_imageHeightBands[m_imageBandIndex];
+	m_imageWriter->writeRows(&m_imageBands[m_imageBandIndex][0], heights.empty() ? 0 : &heights[0], m_imageBandEnd - m_imageBandBegin);
+	m_imageBandIndex ^= 1;
+	startImageBand(m_imageBandEnd);
+}
+
+void TileGenerator::closeImage(void)
+{
+	delete m_imageWriter;
+	m_imageWriter = 0;
+	m_pyramidWriter = 0;
+	for (size_t i = 0; i < m_pyramidLevelPixels.size(); i++)
+		delete m_pyramidLevelPixels[i];
+	m_pyramidLevelPixels.clear();
+	delete m_mapState;
+	m_mapState = 0;
+	if (m_imageFile)
+		fclose(m_imageFile);
+	m_imageFile = 0;
+	if (m_image) {
+		// Give libgd its own row pointers back
+		m_image->tpixels = m_imageRows;
+		m_image->sy = 1;
+		gdImageDestroy(m_image);
+		m_image = 0;
+	}
+}
+
+// Block position key of a map state: ordered by x, z, then y
+static inline uint64_t mapStateBlockKey(const BlockPos &pos)
+{
+	return (uint64_t(uint16_t(pos.x + 0x8000)) << 32) | (uint64_t(uint16_t(pos.z + 0x8000)) << 16) | uint16_t(pos.y + 0x8000);
+}
+
+static inline int mapStateBlockKeyX(uint64_t key) { return int((key >> 32) & 0xffff) - 0x8000; }
+static inline int mapStateBlockKeyZ(uint64_t key) { return int((key >> 16) & 0xffff) - 0x8000; }
+
+// The name of a state file, next to the output file (or directory)
+std::string TileGenerator::stateFilePath(const std::string &output, const char *extension) const
+{
+	std::string path = output;
+	if (!path.empty() && path[path.length() - 1] == PATH_SEPARATOR)
+		path.erase(path.length() - 1);
+	return path + extension;
+}
+
+// The fingerprints of the blocks of the map, ordered by mapStateBlockKey()
+const MapStateFile::BlockList &TileGenerator::mapBlockFingerprints(void)
+{
+	if (!m_blockFingerprints.empty())
+		return m_blockFingerprints;
+	DB::BlockFingerprintList fingerprints;
+	m_db->getBlockFingerprints(fingerprints);
+	for (DB::BlockFingerprintList::const_iterator block = fingerprints.begin(); block != fingerprints.end(); ++block) {
+		const BlockPos &pos = block->first;
+		if (pos.x < m_xMin || pos.x > m_xMax || pos.y < m_reqYMin || pos.y > m_reqYMax || pos.z < m_zMin || pos.z > m_zMax)
+			continue;
+		MapStateFile::Block entry = { mapStateBlockKey(pos), block->second };
+		m_blockFingerprints.push_back(entry);
+	}
+	std::sort(m_blockFingerprints.begin(), m_blockFingerprints.end());
+	return m_blockFingerprints;
+}
+
+// Compare the blocks of the map with the blocks of the previous map state, and only render
+// the block columns that are needed to compute the pixels that changed. The other pixels
+// are copied from the previous state (see updateMapState()).
+void TileGenerator::prepareIncrementalRender(const std::string &output)
+{
+	const MapStateFile::BlockList &blocks = mapBlockFingerprints();
+
+	// Anything else that determines the pixels of the map (before the overlays are drawn).
+	// Other options (e.g. --verbose, or the order of the options) don't matter.
+	std::ostringstream signature;
+	surfaceSignature(signature);
+	signature << '\n'
+		<< m_xMin << ' ' << m_xMax << ' ' << m_yMin << ' ' << m_yMax << ' ' << m_zMin << ' ' << m_zMax << ' '
+		<< m_mapXStartNodeOffset << ' ' << m_mapXEndNodeOffset << ' ' << m_mapYStartNodeOffset << ' ' << m_mapYEndNodeOffset << ' '
+		<< m_scaleFactor << ' ' << m_shading << ' ' << m_bgColor.to_uint() << ' ' << borderLeft() << ' ' << borderTop() << ' '
+		<< m_tileWidth << ' ' << m_tileHeight << ' ' << m_tileBorderSize << ' ' << m_tileBorderColor.to_uint() << ' '
+		<< m_tileMapXOffset << ' ' << m_tileMapYOffset;
+	bool hasHeights = !m_imageHeightBands[0].empty();
+	m_mapState = new MapStateFile(stateFilePath(output, ".mapstate"));
+	m_havePreviousMapState = m_mapState->load(signature.str(), m_image->sx, m_image->sy, hasHeights);
+	m_mapState->create(signature.str(), m_image->sx, m_image->sy, hasHeights, blocks);
+	// The pixels of the pyramid levels that are scaled from the nodes are needed as well
+	for (size_t i = 0; i < m_pyramidLevelPixels.size(); i++) {
+		PyramidLevel &level = *m_pyramidLevelPixels[i];
+		int width = level.xEnd - level.xBegin;
+		int height = level.yEnd - level.nextY;
+		std::ostringstream extension;
+		extension << ".mapstate" << level.level;
+		level.mapState.reset(new MapStateFile(stateFilePath(output, extension.str().c_str())));
+		if (!level.mapState->load(signature.str(), width, height, true))
+			m_havePreviousMapState = false;
+		level.mapState->create(signature.str(), width, height, true, MapStateFile::BlockList());
+		level.previousPixels.resize(width);
+		level.previousHeights.resize(width);
+	}
+	if (!m_havePreviousMapState) {
+		if (verboseStatistics)
+			cout << "Incremental:  no usable map state - rendering the entire map" << std::endl;
+		return;
+	}
+
+	int columnCount = m_xMax - m_xMin + 1;
+	int rowCount = m_zMax - m_zMin + 1;
+	m_changedColumns.assign(size_t(columnCount) * rowCount, false);
+	const MapStateFile::BlockList &previousBlocks = m_mapState->previousBlocks();
+	MapStateFile::BlockList::const_iterator block = blocks.begin();
+	MapStateFile::BlockList::const_iterator previous = previousBlocks.begin();
+	while (block != blocks.end() || previous != previousBlocks.end()) {
+		uint64_t key;
+		if (previous == previousBlocks.end() || (block != blocks.end() && block->key < previous->key))
+			key = (block++)->key;
+		else if (block == blocks.end() || previous->key < block->key)
+			key = (previous++)->key;
+		else if (block->fingerprint == previous->fingerprint) {
+			++block;
+			++previous;
+			continue;
+		}
+		else {
+			key = block->key;
+			++block;
+			++previous;
+		}
+		m_changedColumns[size_t(m_zMax - mapStateBlockKeyZ(key)) * columnCount + mapStateBlockKeyX(key) - m_xMin] = true;
+	}
+
+	// The shading of a pixel depends on the pixels to the left of it and above it, so the
+	// first pixel column of the block east of a changed block, and the first pixel row of
+	// the block south of it change as well. Computing those pixels requires their neighbours
+	// to the west and north, so all blocks around a changed block are rendered.
+	std::vector<bool> render(m_changedColumns.size(), false);
+	int changedCount = 0;
+	for (int r = 0; r < rowCount; r++) {
+		for (int c = 0; c < columnCount; c++) {
+			if (!m_changedColumns[size_t(r) * columnCount + c])
+				continue;
+			changedCount++;
+			for (int dr = r - 1; dr <= r + 1; dr++)
+				for (int dc = c - 1; dc <= c + 1; dc++)
+					if (dr >= 0 && dr < rowCount && dc >= 0 && dc < columnCount)
+						render[size_t(dr) * columnCount + dc] = true;
+		}
+	}
+	const BlockColumnIndex::ColumnList &columns = m_blockIndex.columns();
+	size_t totalColumns = columns.size();
+	std::vector<bool> retain(columns.size());
+	for (size_t i = 0; i < columns.size(); i++)
+		retain[i] = render[size_t(m_zMax - columns[i].z) * columnCount + columns[i].x - m_xMin];
+	m_blockIndex.retainColumns(retain);
+
+	// The range of the height scale is not known without rendering the entire map,
+	// so it can only grow.
+	m_surfaceHeight = m_mapState->previousSurfaceHeight();
+	m_surfaceDepth = m_mapState->previousSurfaceDepth();
+
+	MapStateLine none = { -1, false };
+	m_mapStateColumns.assign(m_image->sx, none);
+	int xBegin = m_mapXStartNodeOffset / m_scaleFactor;
+	int xEnd = (worldBlockX2StoredX(m_xMax + 1) + m_mapXEndNodeOffset) / m_scaleFactor;
+	for (int x = xBegin; x < xEnd; x++) {
+		MapStateLine column = { x * m_scaleFactor / 16, x * m_scaleFactor % 16 == 0 };
+		m_mapStateColumns[mapX2ImageX(x - xBegin)] = column;
+	}
+	m_mapStateRows.assign(m_image->sy, none);
+	int yBegin = m_mapYStartNodeOffset / m_scaleFactor;
+	int yEnd = (worldBlockZ2StoredY(m_zMin - 1) + m_mapYEndNodeOffset) / m_scaleFactor;
+	for (int y = yBegin; y < yEnd; y++) {
+		MapStateLine row = { y * m_scaleFactor / 16, y * m_scaleFactor % 16 == 0 };
+		m_mapStateRows[mapY2ImageY(y - yBegin)] = row;
+	}
+
+	if (verboseStatistics)
+		cout << "Incremental:  block columns changed: " << changedCount
+		     << ";  block columns rendered: " << m_blockIndex.columns().size() << "/" << totalColumns << std::endl;
+}
+
+// Replace the pixels of the current image band that did not change by the pixels of the
+// previous map state, and save the band in the new map state. The overlays are not saved.
+void TileGenerator::updateMapState(void)
+{
+	int width = m_image->sx;
+	int rows = m_imageBandEnd - m_imageBandBegin;
+	int *pixels = &m_imageBands[m_imageBandIndex][0];
+	std::vector<float> &heightBand = m_imageHeightBands[m_imageBandIndex];
+	float *heights = heightBand.empty() ? 0 : &heightBand[0];
+	if (m_havePreviousMapState) {
+		int columnCount = m_xMax - m_xMin + 1;
+		m_previousImageBand.resize(size_t(width) * rows);
+		if (heights)
+			m_previousImageHeightBand.resize(size_t(width) * rows);
+		m_mapState->readRows(&m_previousImageBand[0], heights ? &m_previousImageHeightBand[0] : 0, rows);
+		for (int y = 0; y < rows; y++) {
+			const MapStateLine &row = m_mapStateRows[m_imageBandBegin + y];
+			size_t offset = size_t(y) * width;
+			for (int x = 0; x < width; x++) {
+				const MapStateLine &column = m_mapStateColumns[x];
+				if (row.block >= 0 && column.block >= 0) {
+					size_t block = size_t(row.block) * columnCount + column.block;
+					if (m_changedColumns[block]
+							|| (column.first && column.block > 0 && m_changedColumns[block - 1])
+							|| (row.first && row.block > 0 && m_changedColumns[block - columnCount]))
+						continue;
+				}
+				pixels[offset + x] = m_previousImageBand[offset + x];
+				if (heights)
+					heights[offset + x] = m_previousImageHeightBand[offset + x];
+			}
 		}
 	}
+	m_mapState->writeRows(pixels, heights, rows);
+}
+
+// Write the settings that determine the surface of a block column (apart from its blocks):
+// the colors, and which nodes are drawn, and how
+void TileGenerator::surfaceSignature(std::ostream &signature) const
+{
+	signature << std::hex << m_dataChecksum << std::dec << ' '
+		<< m_heightMap << ' ' << m_drawAlpha << ' ' << m_mixMode << ' ' << m_drawAir << ' '
+		<< m_blockDefaultColor.to_uint() << ' '
+		<< m_reqYMin << ' ' << m_reqYMinNode << ' ' << m_reqYMax << ' ' << m_reqYMaxNode;
+	if (m_heightMap) {
+		signature << ' ' << m_seaLevel << ' ' << std::setprecision(9) << m_heightMapYScale;
+		for (HeightMapColorList::const_iterator i = m_heightMapColors.begin(); i != m_heightMapColors.end(); ++i)
+			signature << ' ' << i->height[0] << ' ' << i->color[0].to_uint() << ' ' << i->height[1] << ' ' << i->color[1].to_uint();
+	}
+}
+
+// Open the surface cache, unless it is open already. It stays locked until it is closed.
+void TileGenerator::openSurfaceCache(void)
+{
+	if (m_surfaceCache)
+		return;
+	// Scaling, shading and the geometry of the map are applied later, so they don't matter
+	std::ostringstream signature;
+	surfaceSignature(signature);
+	SurfaceCacheFile *cache = new SurfaceCacheFile(m_surfaceCachePath, 16 * PixelAttributes::pixelDataSize(16));
+	try {
+		cache->open(signature.str());
+	}
+	catch (...) {
+		delete cache;
+		throw;
+	}
+	m_surfaceCache = cache;
+}
+
+// Look up the block columns of the map in the surface cache. A column is cached as long
+// as its blocks do not change; the columns that are not cached are rendered as usual,
+// and then stored in the cache (see renderMapRowCached()).
+void TileGenerator::prepareSurfaceCache(void)
+{
+	openSurfaceCache();
+
+	// The fingerprint of a column is computed from the positions and fingerprints of its
+	// blocks (FNV-1a)
+	std::map<uint64_t, uint64_t> columnFingerprints;
+	const MapStateFile::BlockList &blocks = mapBlockFingerprints();
+	for (MapStateFile::BlockList::const_iterator block = blocks.begin(); block != blocks.end(); ++block) {
+		uint64_t &fingerprint = columnFingerprints.insert(std::make_pair(block->key >> 16, 0xcbf29ce484222325ULL)).first->second;
+		const unsigned char *data = reinterpret_cast<const unsigned char *>(&*block);
+		for (size_t i = 0; i < sizeof(*block); i++)
+			fingerprint = (fingerprint ^ data[i]) * 0x100000001b3ULL;
+	}
+
+	const BlockColumnIndex::ColumnList &columns = m_blockIndex.columns();
+	m_surfaceCacheSlots.resize(columns.size());
+	m_surfaceCacheHits.resize(columns.size());
+	size_t cachedCount = 0;
+	for (size_t i = 0; i < columns.size(); i++) {
+		uint64_t key = mapStateBlockKey(BlockPos(columns[i].x, 0, columns[i].z)) >> 16;
+		bool cached;
+		m_surfaceCacheSlots[i] = m_surfaceCache->findColumn(columns[i].x, columns[i].z, columnFingerprints[key], cached);
+		m_surfaceCacheHits[i] = cached;
+		if (cached)
+			cachedCount++;
+	}
+	m_surfaceCache->allocate();
+
+	if (verboseStatistics)
+		cout << "Surface cache:  block columns cached: " << cachedCount << "/" << columns.size() << std::endl;
 }
 
 void TileGenerator::processMapBlock(const DB::Block &block)
@@ -1429,38 +2565,18 @@ void TileGenerator::processMapBlock(const DB::Block &block)
 
 	// Read mapping
 	if (version >= 22) {
+		size_t mappingBegin = dataOffset;
 		dataOffset++; // mapping version
 		uint16_t numMappings = readU16(data, dataOffset, length);
 		dataOffset += 2;
 		for (int i = 0; i < numMappings; ++i) {
-			uint16_t nodeId = readU16(data, dataOffset, length);
-			dataOffset += 2;
+			dataOffset += 2; // node id
 			uint16_t nameLen = readU16(data, dataOffset, length);
 			dataOffset += 2;
-			string name;
-			readString(name, data, dataOffset, nameLen, length);
-			size_t end = name.find_first_of('\0');
-			if (end != std::string::npos)
-				name.erase(end);
-			// In case of a height map, it stores just dummy colors...
-			NodeColorMap::const_iterator color = m_nodeColors.find(name);
-			if (name == "air" && !(m_drawAir && color != m_nodeColors.end())) {
-				m_nodeIDColor[nodeId] = NodeColorNotDrawn;
-			}
-			else if (name == "ignore") {
-				m_nodeIDColor[nodeId] = NodeColorNotDrawn;
-			}
-			else {
-				if (color != m_nodeColors.end()) {
-					m_nodeIDColor[nodeId] = &color->second;
-				}
-				else {
-					m_nameMap[nodeId] = name;
-					m_nodeIDColor[nodeId] = NULL;
-				}
-			}
+			checkDataLimit("string", dataOffset, nameLen, length);
 			dataOffset += nameLen;
 		}
+		m_nodeIDMapping = getNodeIDMapping(data, mappingBegin, dataOffset, numMappings);
 	}
 
 	// Node timers
@@ -1474,101 +2590,317 @@ void TileGenerator::processMapBlock(const DB::Block &block)
 	renderMapBlock(mapData, pos, version);
 }
 
-void TileGenerator::renderMap()
+// Return the node id -> color table for the mapping data of a block.
+// Mapping data has already been checked to be complete.
+const TileGenerator::NodeIDMapping *TileGenerator::getNodeIDMapping(const unsigned char *data, size_t mappingBegin, size_t mappingEnd, int numMappings)
 {
-	int unpackErrors = 0;
-	int blocks_rendered = 0;
-	int area_rendered = 0;
-	BlockPos currentPos;
-	currentPos.x = INT_MIN;
-	currentPos.y = 0;
-	currentPos.z = INT_MIN;
-	bool allReaded = false;
-	for (std::list<BlockPos>::const_iterator position = m_positions.begin(); position != m_positions.end(); ++position) {
-		const BlockPos &pos = *position;
-		if (currentPos.x != pos.x || currentPos.z != pos.z) {
-			area_rendered++;
-			if (currentPos.z != pos.z) {
-				if (m_scaleFactor > 1) {
-					scalePixelRows(m_blockPixelAttributes, m_blockPixelAttributesScaled, pos.z);
-					pushPixelRows(m_blockPixelAttributesScaled, pos.z);
-					m_blockPixelAttributesScaled.setLastY(((m_zMax - pos.z) * 16 + 15) / m_scaleFactor);
-				}
-				else {
-					pushPixelRows(m_blockPixelAttributes, pos.z);
-				}
-				m_blockPixelAttributes.setLastY((m_zMax - pos.z) * 16 + 15);
-				if (progressIndicator)
-				    cout << "Processing Z-coordinate: " << std::setw(6) << pos.z*16
-					<< "  (" << std::fixed << std::setprecision(0) << 100.0 * (m_zMax - pos.z) / (m_zMax - m_zMin)
-					<< "%)          \r" << std::flush;
+	const unsigned char *raw = data + mappingBegin;
+	size_t rawLength = mappingEnd - mappingBegin;
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < rawLength; i++) {
+		hash ^= raw[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	NodeIDMappingCache::iterator cached = m_nodeIDMappingCache.find(hash);
+	if (cached != m_nodeIDMappingCache.end()) {
+		if (cached->second.raw.length() == rawLength && !memcmp(cached->second.raw.c_str(), raw, rawLength))
+			return &cached->second;
+		// Hash collision. Keep the cached table.
+		buildNodeIDMapping(m_nodeIDMappingUncached, data, mappingBegin, mappingEnd, numMappings);
+		return &m_nodeIDMappingUncached;
+	}
+
+	if (m_nodeIDMappingCache.size() >= NODEIDMAPPING_CACHE_SIZE) {
+		m_nodeIDMapping = &m_nodeIDMappingEmpty;
+		m_nodeIDMappingCache.clear();
+	}
+	NodeIDMapping &mapping = m_nodeIDMappingCache[hash];
+	buildNodeIDMapping(mapping, data, mappingBegin, mappingEnd, numMappings);
+	mapping.raw.assign(raw, rawLength);
+	return &mapping;
+}
+
+void TileGenerator::buildNodeIDMapping(NodeIDMapping &mapping, const unsigned char *data, size_t mappingBegin, size_t mappingEnd, int numMappings)
+{
+	mapping.raw.clear();
+	mapping.color.clear();
+	mapping.unknownName.clear();
+	mapping.nodeClass.clear();
+	size_t dataOffset = mappingBegin + 3; // Skip mapping version and count
+	for (int i = 0; i < numMappings; ++i) {
+		uint16_t nodeId = readU16(data, dataOffset, mappingEnd);
+		dataOffset += 2;
+		uint16_t nameLen = readU16(data, dataOffset, mappingEnd);
+		dataOffset += 2;
+		string name;
+		readString(name, data, dataOffset, nameLen, mappingEnd);
+		size_t end = name.find_first_of('\0');
+		if (end != std::string::npos)
+			name.erase(end);
+		dataOffset += nameLen;
+
+		if (nodeId >= mapping.color.size()) {
+			mapping.color.resize(nodeId + 1, NULL);
+			mapping.unknownName.resize(nodeId + 1, NULL);
+		}
+		mapping.unknownName[nodeId] = NULL;
+		// In case of a height map, it stores just dummy colors...
+		NodeColorMap::const_iterator color = m_nodeColors.find(name);
+		if (name == "air" && !(m_drawAir && color != m_nodeColors.end())) {
+			mapping.color[nodeId] = NodeColorNotDrawn;
+		}
+		else if (name == "ignore") {
+			mapping.color[nodeId] = NodeColorNotDrawn;
+		}
+		else {
+			if (color != m_nodeColors.end()) {
+				mapping.color[nodeId] = &color->second;
 			}
-			for (int i = 0; i < 16; ++i) {
-				m_readedPixels[i] = 0;
+			else {
+				mapping.color[nodeId] = NULL;
+				mapping.unknownName[nodeId] = &*m_nodeNames.insert(name).first;
 			}
-			allReaded = false;
-			currentPos = pos;
 		}
-		else if (allReaded) {
-			continue;
-		}
-		DB::Block block = m_db->getBlockOnPos(pos);
-		if (!block.second.empty()) {
-			try {
-				processMapBlock(block);
+	}
 
-				blocks_rendered++;
+	// Class of each node id. The entry after the last id is used for
+	// all ids that are not in the mapping.
+	mapping.nodeClass.resize(mapping.color.size() + 1 + NODECLASS_PADDING, m_heightMap ? NodeClassSkip : NodeClassUnknown);
+	for (size_t id = 0; id < mapping.color.size(); id++) {
+		const ColorEntry *color = mapping.color[id];
+		if (color == NodeColorNotDrawn)
+			mapping.nodeClass[id] = NodeClassSkip;
+		else if (!color)
+			mapping.nodeClass[id] = m_heightMap ? NodeClassSkip : NodeClassUnknown;
+		else if (m_heightMap)
+			mapping.nodeClass[id] = color->a != 0 ? NodeClassOpaque : NodeClassSkip;
+		else if ((m_drawAlpha && color->a == 0xff) || (!m_drawAlpha && color->a != 0))
+			mapping.nodeClass[id] = NodeClassOpaque;
+		else
+			mapping.nodeClass[id] = NodeClassTransparent;
+	}
+}
 
-				allReaded = true;
-				for (int i = 0; i < 16; ++i) {
-					if (m_readedPixels[i] != 0xffff) {
-						allReaded = false;
-					}
+// Render a block of the current column. Returns true if all pixels
+// of the column are known afterwards (i.e. no more blocks are needed).
+bool TileGenerator::renderBlock(const DB::Block &block)
+{
+	const BlockPos &pos = block.first;
+	bool allReaded = false;
+	if (!block.second.empty()) {
+		try {
+			processMapBlock(block);
+
+			m_blocksRendered++;
+
+			allReaded = true;
+			for (int i = 0; i < 16; ++i) {
+				if (m_readedPixels[i] != 0xffff) {
+					allReaded = false;
 				}
 			}
-			catch (UnpackError &e) {
-				std::cerr << "Failed to unpack map block " << pos.x << "," << pos.y << "," << pos.z
-					<< " (id: " << pos.databasePosStr(BlockPos::I64) << "). Block corrupt ?"
-					<< std::endl
-					<< "\tCoordinates: " << pos.x*16 << "," << pos.y*16 << "," << pos.z*16 << "+16+16+16"
-					<< ";  Data: " << e.type << " at: " << e.offset << "(+" << e.length <<  ")/" << e.dataLength
-					<< std::endl;
-				unpackErrors++;
-			}
-			catch (ZlibDecompressor::DecompressError &e) {
-				std::cerr << "Failed to decompress data in map block " << pos.x << "," << pos.y << "," << pos.z
-					<< " (id: " << pos.databasePosStr(BlockPos::I64) << "). Block corrupt ?"
-					<< std::endl
-					<< "\tCoordinates: " << pos.x*16 << "," << pos.y*16 << "," << pos.z*16 << "+16+16+16"
-					<< ";  Cause: " << e.message
-					<< std::endl;
-				unpackErrors++;
+		}
+		catch (UnpackError &e) {
+			std::cerr << "Failed to unpack map block " << pos.x << "," << pos.y << "," << pos.z
+				<< " (id: " << pos.databasePosStr(BlockPos::I64) << "). Block corrupt ?"
+				<< std::endl
+				<< "\tCoordinates: " << pos.x*16 << "," << pos.y*16 << "," << pos.z*16 << "+16+16+16"
+				<< ";  Data: " << e.type << " at: " << e.offset << "(+" << e.length <<  ")/" << e.dataLength
+				<< std::endl;
+			m_unpackErrors++;
+		}
+		catch (ZlibDecompressor::DecompressError &e) {
+			std::cerr << "Failed to decompress data in map block " << pos.x << "," << pos.y << "," << pos.z
+				<< " (id: " << pos.databasePosStr(BlockPos::I64) << "). Block corrupt ?"
+				<< std::endl
+				<< "\tCoordinates: " << pos.x*16 << "," << pos.y*16 << "," << pos.z*16 << "+16+16+16"
+				<< ";  Cause: " << e.message
+				<< std::endl;
+			m_unpackErrors++;
+		}
+	}
+	if (m_unpackErrors >= 100) {
+		throw(std::runtime_error("Too many block unpacking errors - bailing out"));
+	}
+	return allReaded;
+}
+
+void TileGenerator::renderMapColumn(const BlockColumnIndex::Column &column)
+{
+	for (int i = 0; i < 16; ++i) {
+		m_readedPixels[i] = 0;
+	}
+	// Render the blocks of the column from the top down, until all pixels are known
+	for (size_t index = column.yBegin; index < column.yEnd; index++) {
+		m_blocksRequested++;
+		if (renderBlock(m_db->getBlockOnPos(m_blockIndex.blockPos(column, index))))
+			break;
+	}
+}
+
+// Render a map row, by first reading the topmost block of every column in the row,
+// and then reading the next lower block of every column that is still incomplete,
+// and so on. As in most worlds, the topmost block or blocks of a column determine
+// all of its pixels, this avoids most database lookups of blocks that are not needed.
+void TileGenerator::renderMapRowSurfaceFirst(BlockColumnIndex::ColumnList::const_iterator rowBegin, BlockColumnIndex::ColumnList::const_iterator rowEnd)
+{
+	size_t columnCount = rowEnd - rowBegin;
+	std::vector<uint16_t> readedPixels(columnCount * 16, 0);
+	std::vector<size_t> nextBlock(columnCount);
+	for (size_t i = 0; i < columnCount; i++)
+		nextBlock[i] = rowBegin[i].yBegin;
+
+	DB::BlockPosList positions;
+	DB::BlockList blocks;
+	std::vector<size_t> columnNumbers;
+	while (true) {
+		positions.clear();
+		columnNumbers.clear();
+		for (size_t i = 0; i < columnCount; i++) {
+			if (nextBlock[i] < rowBegin[i].yEnd) {
+				positions.push_back(m_blockIndex.blockPos(rowBegin[i], nextBlock[i]++));
+				columnNumbers.push_back(i);
 			}
 		}
-		if (unpackErrors >= 100) {
-			throw(std::runtime_error("Too many block unpacking errors - bailing out"));
+		if (positions.empty())
+			break;
+		m_blocksRequested += positions.size();
+		m_db->getBlocksOnPos(blocks, positions);
+		for (size_t j = 0; j < blocks.size(); j++) {
+			size_t i = columnNumbers[j];
+			memcpy(m_readedPixels, &readedPixels[i * 16], sizeof(m_readedPixels));
+			if (renderBlock(blocks[j]))
+				nextBlock[i] = rowBegin[i].yEnd;
+			memcpy(&readedPixels[i * 16], m_readedPixels, sizeof(m_readedPixels));
 		}
 	}
-	if (currentPos.z != INT_MIN) {
-		if (m_scaleFactor > 1) {
-			scalePixelRows(m_blockPixelAttributes, m_blockPixelAttributesScaled, currentPos.z - 1);
-			pushPixelRows(m_blockPixelAttributesScaled, currentPos.z - 1);
+}
+
+// Render a map row using the surface cache: the cached columns are copied from the cache,
+// and the other columns are rendered, and then stored in the cache.
+void TileGenerator::renderMapRowCached(BlockColumnIndex::ColumnList::const_iterator rowBegin, BlockColumnIndex::ColumnList::const_iterator rowEnd)
+{
+	const BlockColumnIndex::ColumnList &columns = m_blockIndex.columns();
+	BlockColumnIndex::ColumnList uncached;
+	std::vector<size_t> uncachedSlots;
+	for (BlockColumnIndex::ColumnList::const_iterator column = rowBegin; column != rowEnd; ++column) {
+		size_t index = column - columns.begin();
+		if (m_surfaceCacheHits[index]) {
+			loadCachedColumn(*column, m_surfaceCacheSlots[index]);
+		}
+		else {
+			uncached.push_back(*column);
+			uncachedSlots.push_back(m_surfaceCacheSlots[index]);
+		}
+	}
+	int unpackErrors = m_unpackErrors;
+	if (m_fetchSurfaceFirst) {
+		renderMapRowSurfaceFirst(uncached.begin(), uncached.end());
+	}
+	else {
+		for (size_t i = 0; i < uncached.size(); i++)
+			renderMapColumn(uncached[i]);
+	}
+	// Columns with corrupt blocks are not cached, so that the errors are reported again
+	if (m_unpackErrors != unpackErrors)
+		return;
+	for (size_t i = 0; i < uncached.size(); i++)
+		saveCachedColumn(uncached[i], uncachedSlots[i]);
+}
+
+void TileGenerator::loadCachedColumn(const BlockColumnIndex::Column &column, size_t slot)
+{
+	const char *data = m_surfaceCache->columnData(slot);
+	int xBegin = worldBlockX2StoredX(column.x);
+	int yBegin = worldBlockZ2StoredY(column.z);
+	size_t rowSize = PixelAttributes::pixelDataSize(16);
+	for (int y = 0; y < 16; y++)
+		m_blockPixelAttributes.loadPixels(yBegin + y, xBegin, 16, data + y * rowSize);
+	if (m_heightMap) {
+		// The range of heights, as renderMapBlock() would have computed it
+		for (int y = 0; y < 16; y++) {
+			for (int x = 0; x < 16; x++) {
+				PixelAttribute pixel = m_blockPixelAttributes.attribute(yBegin + y, xBegin + x);
+				if (!pixel.is_valid())
+					continue;
+				int height = int(pixel.h());
+				if (height > m_surfaceHeight) m_surfaceHeight = height;
+				if (height < m_surfaceDepth) m_surfaceDepth = height;
+			}
+		}
+	}
+}
+
+void TileGenerator::saveCachedColumn(const BlockColumnIndex::Column &column, size_t slot)
+{
+	char *data = m_surfaceCache->columnData(slot);
+	int xBegin = worldBlockX2StoredX(column.x);
+	int yBegin = worldBlockZ2StoredY(column.z);
+	size_t rowSize = PixelAttributes::pixelDataSize(16);
+	for (int y = 0; y < 16; y++)
+		m_blockPixelAttributes.savePixels(yBegin + y, xBegin, 16, data + y * rowSize);
+	m_surfaceCache->setStored(slot);
+}
+
+void TileGenerator::renderMap()
+{
+	buildNodeIDMapping(m_nodeIDMappingEmpty, NULL, 0, 0, 0);
+	m_nodeIDMapping = &m_nodeIDMappingEmpty;
+	selectRenderMapBlockFunctions();
+	if (m_heightMap)
+		buildHeightMapColorTable(m_yMin * 16, m_yMax * 16 + 15);
+	m_blocksRendered = 0;
+	m_blocksRequested = 0;
+	m_unpackErrors = 0;
+	int area_rendered = 0;
+	int currentZ = INT_MIN;
+	const BlockColumnIndex::ColumnList &columns = m_blockIndex.columns();
+	BlockColumnIndex::ColumnList::const_iterator rowEnd;
+	for (BlockColumnIndex::ColumnList::const_iterator column = columns.begin(); column != columns.end(); column = rowEnd) {
+		for (rowEnd = column; rowEnd != columns.end() && rowEnd->z == column->z; ++rowEnd)
+			;
+		area_rendered += rowEnd - column;
+		pushPixelRows(column->z);
+		if (m_scaleFactor > 1)
+			m_blockPixelAttributesScaled.setLastY(((m_zMax - column->z) * 16 + 15) / m_scaleFactor);
+		for (size_t i = 0; i < m_pyramidLevelPixels.size(); i++)
+			m_pyramidLevelPixels[i]->pixelAttributes.setLastY(((m_zMax - column->z) * 16 + 15) / m_pyramidLevelPixels[i]->scale);
+		m_blockPixelAttributes.setLastY((m_zMax - column->z) * 16 + 15);
+		if (progressIndicator)
+		    cout << "Processing Z-coordinate: " << std::setw(6) << column->z*16
+			<< "  (" << std::fixed << std::setprecision(0) << 100.0 * (m_zMax - column->z) / (m_zMax - m_zMin)
+			<< "%)          \r" << std::flush;
+		currentZ = column->z;
+
+		if (m_surfaceCache) {
+			renderMapRowCached(column, rowEnd);
+		}
+		else if (m_fetchSurfaceFirst) {
+			renderMapRowSurfaceFirst(column, rowEnd);
 		}
 		else {
-			pushPixelRows(m_blockPixelAttributes, currentPos.z - 1);
+			for (; column != rowEnd; ++column)
+				renderMapColumn(*column);
 		}
 	}
+	if (currentZ != INT_MIN)
+		pushPixelRows(currentZ - 1);
+	// Keep nothing (e.g. a database transaction) until the next map is rendered
+	m_db->clearBlockCache();
 	if (verboseStatistics) {
 		cout << "Statistics"
 		     << ":  blocks read: " << m_db->getBlocksReadCount()
 		     << "  (" << m_db->getBlocksCachedCount() << " cached + "
 			       << m_db->getBlocksUnCachedCount() << " uncached)"
-		     << ";  blocks rendered: " << blocks_rendered
+		     << ";  blocks rendered: " << m_blocksRendered
+		     << ";  blocks skipped: " << m_blockIndex.blockCount() - m_blocksRequested
 		     << ";  area rendered: " << area_rendered
 		     << "/" << (m_xMax-m_xMin+1) * (m_zMax-m_zMin+1)
 		     << "  (" << (long long)area_rendered*16*16 << " nodes)";
-		if (unpackErrors)
-			cout << "  (" << unpackErrors << " errors)";
+		if (m_unpackErrors)
+			cout << "  (" << m_unpackErrors << " errors)";
 		 cout << std::endl;
 	}
 	else if (progressIndicator)
@@ -1598,14 +2930,110 @@ Color TileGenerator::computeMapHeightColor(int height)
 	return Color(int(r / n + 0.5), int(g / n + 0.5), int(b / n + 0.5));
 }
 
+// Precompute the heightmap colors of all heights that can occur in the map
+void TileGenerator::buildHeightMapColorTable(int minHeight, int maxHeight)
+{
+	m_heightMapColorTable.clear();
+	m_heightMapColorTableMin = minHeight;
+	if (maxHeight < minHeight)
+		return;
+	m_heightMapColorTable.reserve(maxHeight - minHeight + 1);
+	for (int height = minHeight; height <= maxHeight; height++)
+		m_heightMapColorTable.push_back(computeMapHeightColor(height));
+}
+
+inline Color TileGenerator::heightMapColor(int height)
+{
+	unsigned index = height - m_heightMapColorTableMin;
+	if (index < m_heightMapColorTable.size())
+		return m_heightMapColorTable[index];
+	else
+		return computeMapHeightColor(height);
+}
+
+// Select the block rendering functions for the current render mode, so
+// that the mode does not have to be checked for every node.
+void TileGenerator::selectRenderMapBlockFunctions(void)
+{
+	bool blockDefaultColor = m_blockDefaultColor.to_uint() != 0;
+	if (m_heightMap) {
+		if (blockDefaultColor) {
+			m_renderMapBlockLayers = &TileGenerator::renderMapBlockLayers<true, true>;
+			m_renderMapBlockNodes = &TileGenerator::renderMapBlockNodes<20, true, false, true>;
+		}
+		else {
+			m_renderMapBlockLayers = &TileGenerator::renderMapBlockLayers<true, false>;
+			m_renderMapBlockNodes = &TileGenerator::renderMapBlockNodes<20, true, false, false>;
+		}
+	}
+	else {
+		if (blockDefaultColor) {
+			m_renderMapBlockLayers = &TileGenerator::renderMapBlockLayers<false, true>;
+			if (m_drawAlpha)
+				m_renderMapBlockNodes = &TileGenerator::renderMapBlockNodes<20, false, true, true>;
+			else
+				m_renderMapBlockNodes = &TileGenerator::renderMapBlockNodes<20, false, false, true>;
+		}
+		else {
+			m_renderMapBlockLayers = &TileGenerator::renderMapBlockLayers<false, false>;
+			if (m_drawAlpha)
+				m_renderMapBlockNodes = &TileGenerator::renderMapBlockNodes<20, false, true, false>;
+			else
+				m_renderMapBlockNodes = &TileGenerator::renderMapBlockNodes<20, false, false, false>;
+		}
+	}
+}
+
 inline void TileGenerator::renderMapBlock(const ustring &mapBlock, const BlockPos &pos, int version)
 {
 	checkBlockNodeDataLimit(version, mapBlock.length());
-	int xBegin = worldBlockX2StoredX(pos.x);
-	int zBegin = worldBlockZ2StoredY(pos.z);
 	const unsigned char *mapData = mapBlock.c_str();
 	int minY = (pos.y < m_reqYMin) ? 16 : (pos.y > m_reqYMin) ?  0 : m_reqYMinNode;
 	int maxY = (pos.y > m_reqYMax) ? -1 : (pos.y < m_reqYMax) ? 15 : m_reqYMaxNode;
+	if (version >= 24)
+		(this->*m_renderMapBlockLayers)(mapData, pos, minY, maxY);
+	else
+		(this->*m_renderMapBlockNodes)(mapData, pos, minY, maxY);
+	if (!m_blockUnknownIDs.empty())
+		recordUnknownNodes(pos);
+}
+
+// Count an unknown node of the current block. The names are looked up
+// once per block, by recordUnknownNodes().
+inline void TileGenerator::addUnknownNode(unsigned content, int x, int y, int z)
+{
+	if (content >= m_blockUnknownCount.size())
+		m_blockUnknownCount.resize(content + 1, 0);
+	if (!m_blockUnknownCount[content]++) {
+		m_blockUnknownIDs.push_back(content);
+		m_blockUnknownSample.push_back((y << 8) | (z << 4) | x);
+	}
+}
+
+void TileGenerator::recordUnknownNodes(const BlockPos &pos)
+{
+	for (size_t i = 0; i < m_blockUnknownIDs.size(); i++) {
+		uint16_t id = m_blockUnknownIDs[i];
+		UnknownNode &node = m_unknownNodes[m_nodeIDMapping->unknownName[id]];
+		if (!node.count) {
+			uint16_t sample = m_blockUnknownSample[i];
+			node.sample = BlockPos(pos.x * 16 + (sample & 0xf), pos.y * 16 + (sample >> 8), pos.z * 16 + ((sample >> 4) & 0xf));
+		}
+		node.count += m_blockUnknownCount[id];
+		m_blockUnknownCount[id] = 0;
+	}
+	m_blockUnknownIDs.clear();
+	m_blockUnknownSample.clear();
+}
+
+// Render a map block one node at a time
+template<int versionClass, bool heightMap, bool drawAlpha, bool blockDefaultColor>
+void TileGenerator::renderMapBlockNodes(const unsigned char *mapData, const BlockPos &pos, int minY, int maxY)
+{
+	int xBegin = worldBlockX2StoredX(pos.x);
+	int zBegin = worldBlockZ2StoredY(pos.z);
+	const ColorEntry * const *nodeIDColor = m_nodeIDMapping->color.empty() ? NULL : &m_nodeIDMapping->color[0];
+	unsigned nodeIDCount = m_nodeIDMapping->color.size();
 	for (int z = 0; z < 16; ++z) {
 		bool rowIsEmpty = true;
 		for (int x = 0; x < 16; ++x) {
@@ -1614,57 +3042,140 @@ inline void TileGenerator::renderMapBlock(const ustring &mapBlock, const BlockPo
 			}
 			// The #define of pixel performs *significantly* *better* than the definition of PixelAttribute &pixel ...
 			#define pixel m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin + x)
-			//PixelAttribute &pixel = m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin + x);
-			if (m_blockDefaultColor.to_uint() && !pixel.color().to_uint()) {
+			//PixelAttributeRef pixel = m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin + x);
+			if (blockDefaultColor && !pixel.color().to_uint()) {
 				rowIsEmpty = false;
 				pixel = PixelAttribute(m_blockDefaultColor, NAN);
 			}
 			for (int y = maxY; y >= minY; --y) {
 				int position = x + (y << 4) + (z << 8);
-				int content = readBlockContent(mapData, version, position);
-				#define nodeColor (*m_nodeIDColor[content])
-				//const ColorEntry &nodeColor = *m_nodeIDColor[content];
-				if (m_nodeIDColor[content] == NodeColorNotDrawn) {
+				unsigned content = readBlockContent<versionClass>(mapData, position);
+				const ColorEntry *contentColor = content < nodeIDCount ? nodeIDColor[content] : NULL;
+				#define nodeColor (*contentColor)
+				//const ColorEntry &nodeColor = *contentColor;
+				if (contentColor == NodeColorNotDrawn) {
 					continue;
 				}
 				int height = pos.y * 16 + y;
-				if (m_heightMap) {
-					if (m_nodeIDColor[content] && nodeColor.a != 0) {
+				if (heightMap) {
+					if (contentColor && nodeColor.a != 0) {
 						if (!(m_readedPixels[z] & (1 << x))) {
 							if (height > m_surfaceHeight) m_surfaceHeight = height;
 							if (height < m_surfaceDepth) m_surfaceDepth = height;
 						}
 						rowIsEmpty = false;
-						pixel = PixelAttribute(computeMapHeightColor(height), height);
+						pixel = PixelAttribute(heightMapColor(height), height);
 						m_readedPixels[z] |= (1 << x);
 						break;
 					}
 				}
-				else if (m_nodeIDColor[content]) {
+				else if (contentColor) {
 					rowIsEmpty = false;
-					pixel.mixUnder(PixelAttribute(nodeColor, height));
-					if ((m_drawAlpha && nodeColor.a == 0xff) || (!m_drawAlpha && nodeColor.a != 0)) {
+					pixel.mixUnder(PixelAttribute(nodeColor, height), m_mixMode);
+					if ((drawAlpha && nodeColor.a == 0xff) || (!drawAlpha && nodeColor.a != 0)) {
 						m_readedPixels[z] |= (1 << x);
 						break;
 					}
 				} else {
-					NodeID2NameMap::iterator blockName = m_nameMap.find(content);
-					if (blockName != m_nameMap.end())
-						m_unknownNodes.insert(blockName->second);
+					if (content < nodeIDCount && m_nodeIDMapping->unknownName[content])
+						addUnknownNode(content, x, y, z);
 				}
 				#undef nodeColor
 			}
 			#undef pixel
 		}
 		if (!rowIsEmpty)
-			m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin).nextEmpty = false;
+			m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin).setNextEmpty(false);
+	}
+}
+
+// Render a map block (version >= 24) one y-layer at a time: all nodes of
+// a layer are classified at once, and only the nodes that are drawn are
+// looked at individually.
+template<bool heightMap, bool blockDefaultColor>
+void TileGenerator::renderMapBlockLayers(const unsigned char *mapData, const BlockPos &pos, int minY, int maxY)
+{
+	int xBegin = worldBlockX2StoredX(pos.x);
+	int zBegin = worldBlockZ2StoredY(pos.z);
+	const ColorEntry * const *nodeIDColor = m_nodeIDMapping->color.empty() ? NULL : &m_nodeIDMapping->color[0];
+	unsigned nodeIDCount = m_nodeIDMapping->color.size();
+	const uint8_t *nodeClass = &m_nodeIDMapping->nodeClass[0];
+	for (int z = 0; z < 16; ++z) {
+		bool rowIsEmpty = true;
+		unsigned pending = ~m_readedPixels[z] & 0xffff;
+		#define pixel m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin + x)
+		if (blockDefaultColor) {
+			for (int x = 0; x < 16; ++x) {
+				if ((pending & (1 << x)) && !pixel.color().to_uint()) {
+					rowIsEmpty = false;
+					pixel = PixelAttribute(m_blockDefaultColor, NAN);
+				}
+			}
+		}
+		for (int y = maxY; pending && y >= minY; --y) {
+			const unsigned char *row = mapData + (((y << 4) + (z << 8)) << 1);
+			unsigned drawMask;
+			unsigned opaqueMask;
+			classifyNodeRow(row, nodeClass, nodeIDCount, pending, drawMask, opaqueMask);
+			drawMask &= pending;
+			if (!drawMask)
+				continue;
+			int height = pos.y * 16 + y;
+			for (unsigned draw = drawMask; draw; draw &= draw - 1) {
+				int x = lowestBit(draw);
+				unsigned content = (row[x << 1] << 8) | row[(x << 1) + 1];
+				const ColorEntry *contentColor = content < nodeIDCount ? nodeIDColor[content] : NULL;
+				if (heightMap) {
+					// Only opaque nodes are drawn
+					if (height > m_surfaceHeight) m_surfaceHeight = height;
+					if (height < m_surfaceDepth) m_surfaceDepth = height;
+					rowIsEmpty = false;
+					pixel = PixelAttribute(heightMapColor(height), height);
+				}
+				else if (contentColor) {
+					rowIsEmpty = false;
+					pixel.mixUnder(PixelAttribute(*contentColor, height), m_mixMode);
+				}
+				else {
+					if (content < nodeIDCount && m_nodeIDMapping->unknownName[content])
+						addUnknownNode(content, x, y, z);
+				}
+			}
+			pending &= ~(drawMask & opaqueMask);
+		}
+		#undef pixel
+		m_readedPixels[z] = ~pending & 0xffff;
+		if (!rowIsEmpty)
+			m_blockPixelAttributes.attribute(zBegin + 15 - z,xBegin).setNextEmpty(false);
+	}
+}
+
+// Draw the overlays on the current image band.
+// Only objects that touch the rows of the band need to be drawn.
+void TileGenerator::renderOverlays(void)
+{
+	if ((m_drawScale & DRAWSCALE_MASK)) {
+		renderScale();
+	}
+	if (m_heightMap && (m_drawScale & DRAWHEIGHTSCALE_MASK)) {
+		renderHeightScale();
+	}
+	if (m_drawOrigin) {
+		renderOrigin();
+	}
+	if (m_drawPlayers) {
+		renderPlayers();
+	}
+	if (!m_drawObjects.empty()) {
+		renderDrawObjects();
 	}
 }
 
 void TileGenerator::renderScale()
 {
 	int color = m_scaleColor.to_libgd();
-	if ((m_drawScale & DRAWSCALE_LEFT) && (m_drawScale & DRAWSCALE_TOP)) {
+	bool topVisible = imageRowsVisible(0, borderTop() - 1);
+	if ((m_drawScale & DRAWSCALE_LEFT) && (m_drawScale & DRAWSCALE_TOP) && topVisible) {
 		gdImageString(m_image, gdFontGetMediumBold(), borderLeft() - 26, 0, reinterpret_cast<unsigned char *>(const_cast<char *>("X")), color);
 		gdImageString(m_image, gdFontGetMediumBold(), 2, borderTop() - 26, reinterpret_cast<unsigned char *>(const_cast<char *>("Z")), color);
 	}
@@ -1673,7 +3184,7 @@ void TileGenerator::renderScale()
 
 	string scaleText;
 
-	if ((m_drawScale & DRAWSCALE_TOP)) {
+	if ((m_drawScale & DRAWSCALE_TOP) && topVisible) {
 		int start;
 		int extra_left = borderLeft() ? 0 : major;
 		int extra_right = borderRight() ? 0 : major;
@@ -1717,9 +3228,11 @@ void TileGenerator::renderScale()
 		else
 			start = ((m_zMax + 1) * 16 - m_mapYStartNodeOffset - major + 1 + extra_top) / major * major;
 		for (int i = start; i >= m_zMin * 16 - m_mapYEndNodeOffset - 1 - extra_bottom; i -= major) {
+			int yPos = worldZ2ImageY(i);
+			if (!imageRowsVisible(yPos - 10, yPos + gdFontGetMediumBold()->h - 1))
+				continue;
 			stringstream buf;
 			buf << i;
-			int yPos = worldZ2ImageY(i);
 
 			scaleText = buf.str();
 			gdImageString(m_image, gdFontGetMediumBold(), 2, yPos, reinterpret_cast<unsigned char *>(const_cast<char *>(scaleText.c_str())), color);
@@ -1738,7 +3251,8 @@ void TileGenerator::renderScale()
 				start = ((m_zMax + 1) * 16 - m_mapYStartNodeOffset - minor + 1) / minor * minor;
 			for (int i = start; i >= m_zMin * 16 - m_mapYEndNodeOffset - 1; i -= minor) {
 				int yPos = worldZ2ImageY(i);
-				gdImageLine(m_image, borderLeft() - 5, yPos, borderLeft() - 1, yPos, color);
+				if (imageRowsVisible(yPos, yPos))
+					gdImageLine(m_image, borderLeft() - 5, yPos, borderLeft() - 1, yPos, color);
 			}
 		}
 	}
@@ -1754,6 +3268,8 @@ void TileGenerator::renderHeightScale()
 	int height_limit = m_surfaceHeight + 16;
 	int xBorderOffset = borderLeft();
 	int yBorderOffset = borderTop() + m_pictHeight;
+	if (!imageRowsVisible(yBorderOffset, yBorderOffset + borderBottom() - 1))
+		return;
 	double height_step = (double)(height_limit - height_min) / m_pictWidth;
 	if (height_step < 1.0 / 16) {
 		height_step = 1.0 / 16;
@@ -1805,24 +3321,33 @@ void TileGenerator::renderOrigin()
 {
 	int imageX = worldX2ImageX(0);
 	int imageY = worldZ2ImageY(0);
-	gdImageArc(m_image, imageX, imageY, 12, 12, 0, 360, m_originColor.to_libgd());
+	if (imageRowsVisible(imageY - 7, imageY + 7))
+		gdImageArc(m_image, imageX, imageY, 12, 12, 0, 360, m_originColor.to_libgd());
+}
+
+void TileGenerator::loadPlayers(const std::string &inputPath)
+{
+	PlayerAttributes players(inputPath);
+	m_players.assign(players.begin(), players.end());
 }
 
-void TileGenerator::renderPlayers(const std::string &inputPath)
+void TileGenerator::renderPlayers()
 {
 	int color = m_playerColor.to_libgd();
 
-	PlayerAttributes players(inputPath);
-	for (PlayerAttributes::Players::iterator player = players.begin(); player != players.end(); ++player) {
+	for (PlayerAttributes::Players::iterator player = m_players.begin(); player != m_players.end(); ++player) {
 		int imageX = worldX2ImageX(player->x / 10);
 		int imageY = worldZ2ImageY(player->z / 10);
+		if (!imageRowsVisible(imageY - 3, imageY + 2 + gdFontGetMediumBold()->h - 1))
+			continue;
 
 		gdImageArc(m_image, imageX, imageY, 5, 5, 0, 360, color);
 		gdImageString(m_image, gdFontGetMediumBold(), imageX + 2, imageY + 2, reinterpret_cast<unsigned char *>(const_cast<char *>(player->name.c_str())), color);
 	}
 }
 
-void TileGenerator::renderDrawObjects(void)
+// Convert the coordinates of the draw objects to image coordinates
+void TileGenerator::convertDrawObjects(void)
 {
 	for (std::vector<DrawObject>::iterator o = m_drawObjects.begin(); o != m_drawObjects.end(); o++) {
 		// Hack to adjust the center of an ellipse with even dimensions to align it correctly
@@ -1940,6 +3465,28 @@ void TileGenerator::renderDrawObjects(void)
 				assert(o->type == DrawObject::Point || o->type == DrawObject::Text);
 #endif
 		}
+	}
+}
+
+void TileGenerator::renderDrawObjects(void)
+{
+	for (std::vector<DrawObject>::iterator o = m_drawObjects.begin(); o != m_drawObjects.end(); o++) {
+		// Rows covered by the object
+		int yMin = o->center.y;
+		int yMax = o->center.y;
+		if (o->type == DrawObject::Line || o->type == DrawObject::Rectangle) {
+			yMin = o->corner1.y < o->corner2.y ? o->corner1.y : o->corner2.y;
+			yMax = o->corner1.y < o->corner2.y ? o->corner2.y : o->corner1.y;
+		}
+		else if (o->type == DrawObject::Ellipse) {
+			yMin -= o->dimensions.y / 2 + 1;
+			yMax += o->dimensions.y / 2 + 1;
+		}
+		else if (o->type == DrawObject::Text) {
+			yMax += gdFontGetMediumBold()->h - 1;
+		}
+		if (!imageRowsVisible(yMin, yMax))
+			continue;
 		switch(o->type) {
 		case DrawObject::Point:
 			gdImageSetPixel(m_image, o->center.x, o->center.y, o->color.to_libgd());
@@ -1968,35 +3515,47 @@ void TileGenerator::renderDrawObjects(void)
 inline std::list<int> TileGenerator::getZValueList() const
 {
 	std::list<int> zlist;
-	for (std::list<BlockPos>::const_iterator position = m_positions.begin(); position != m_positions.end(); ++position) {
-		zlist.push_back(position->z);
+	const BlockColumnIndex::ColumnList &columns = m_blockIndex.columns();
+	for (BlockColumnIndex::ColumnList::const_iterator column = columns.begin(); column != columns.end(); ++column) {
+		if (zlist.empty() || zlist.back() != column->z)
+			zlist.push_back(column->z);
 	}
-	zlist.sort();
-	zlist.unique();
-	zlist.reverse();
 	return zlist;
 }
 
-void TileGenerator::writeImage(const std::string &output)
+// Finish and write the remaining image bands
+void TileGenerator::writeImage()
 {
-	FILE *out;
-	out = fopen(output.c_str(), "wb");
-	if (!out) {
-		std::ostringstream oss;
-		oss << "Error opening '" << output.c_str() << "': " << std::strerror(errno);
-		throw std::runtime_error(oss.str());
-	}
-	gdImagePng(m_image, out);
-	fclose(out);
-	gdImageDestroy(m_image);
+	while (m_imageBandBegin < m_image->sy)
+		flushImageBand();
+	for (size_t i = 0; i < m_pyramidLevelPixels.size(); i++)
+		writePyramidRows(*m_pyramidLevelPixels[i], m_pyramidLevelPixels[i]->yEnd);
+	m_imageWriter->finish();
+	// The states of the pyramid levels must not be older than the map state: commit them first
+	for (size_t i = 0; i < m_pyramidLevelPixels.size(); i++)
+		if (m_pyramidLevelPixels[i]->mapState)
+			m_pyramidLevelPixels[i]->mapState->commit(m_surfaceHeight, m_surfaceDepth);
+	if (m_mapState)
+		m_mapState->commit(m_surfaceHeight, m_surfaceDepth);
+	closeImage();
 }
 
 void TileGenerator::printUnknown()
 {
 	if (m_unknownNodes.size() > 0) {
 		std::cerr << "Unknown nodes:" << std::endl;
-		for (std::set<std::string>::iterator node = m_unknownNodes.begin(); node != m_unknownNodes.end(); ++node) {
-			std::cerr << *node << std::endl;
+		// m_nodeNames is sorted, and contains the names of all unknown nodes
+		for (NodeNameSet::const_iterator name = m_nodeNames.begin(); name != m_nodeNames.end(); ++name) {
+			UnknownNodeMap::const_iterator node = m_unknownNodes.find(&*name);
+			if (node == m_unknownNodes.end())
+				continue;
+			if (verboseUnknownNodes)
+				std::cerr << std::left << std::setw(40) << *name << std::right
+					<< "  count: " << std::setw(10) << node->second.count
+					<< "  at: " << node->second.sample.x << "," << node->second.sample.y << "," << node->second.sample.z
+					<< std::endl;
+			else
+				std::cerr << *name << std::endl;
 		}
 	}
 }
@@ -2006,7 +3565,7 @@ inline int TileGenerator::mapX2ImageX(int val) const
 {
 	if (m_tileWidth && m_tileBorderSize)
 		val += ((val - m_tileMapXOffset / m_scaleFactor + m_tileWidth / m_scaleFactor) / (m_tileWidth / m_scaleFactor)) * m_tileBorderSize;
-	return val + borderLeft();
+	return val - m_contextMargin + borderLeft();
 }
 
 // Adjust map coordinate for tiles and border
@@ -2014,7 +3573,7 @@ inline int TileGenerator::mapY2ImageY(int val) const
 {
 	if (m_tileHeight / m_scaleFactor && m_tileBorderSize)
 		val += ((val - m_tileMapYOffset / m_scaleFactor + m_tileHeight / m_scaleFactor) / (m_tileHeight / m_scaleFactor)) * m_tileBorderSize;
-	return val + borderTop();
+	return val - m_contextMargin + borderTop();
 }
 
 // Convert world coordinate to image coordinate
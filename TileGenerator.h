@@ -12,24 +12,34 @@
 
 #include <gd.h>
 #include <climits>
+#include <cstdio>
 #include <iosfwd>
 #include <list>
 #if __cplusplus >= 201103L
 #include <unordered_map>
 #else
 #include <map>
+#include <memory>
 #endif
 #include <set>
 #include <list>
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <sstream>
 #include "types.h"
 #include "PixelAttributes.h"
 #include "BlockPos.h"
+#include "BlockColumnIndex.h"
 #include "Color.h"
+#include "ImageWriter.h"
+#include "MapStateFile.h"
+#include "PngWriter.h"
+#include "PlayerAttributes.h"
+#include "SurfaceCacheFile.h"
 #include "db.h"
+#include "db-shared.h"
 
 #define TILESIZE_CHUNK			(INT_MIN)
 #define TILECENTER_AT_WORLDCENTER	(INT_MAX)
@@ -54,15 +64,18 @@
 #define SCALESIZE_VERT			50
 #define HEIGHTSCALESIZE			60
 
-class TileGenerator
+class PyramidWriter;
+
+// The settings of a TileGenerator: the options, the requested geometry and the colors.
+// They are copied as a whole to the generators that render tiles on other threads (see
+// TileGenerator::createTileRenderer()), so every option must be a member of this class.
+class TileGeneratorSettings
 {
-private:
+protected:
 #if __cplusplus >= 201103L
 	typedef std::unordered_map<std::string, ColorEntry> NodeColorMap;
-	typedef std::unordered_map<int, std::string> NodeID2NameMap;
 #else
 	typedef std::map<std::string, ColorEntry> NodeColorMap;
-	typedef std::map<int, std::string> NodeID2NameMap;
 #endif
 public:
 	struct HeightMapColor
@@ -97,6 +110,139 @@ public:
 		std::string text;
 	};
 
+	int verboseCoordinates;
+	int verboseReadColors;
+	bool verboseStatistics;
+	bool verboseUnknownNodes;
+	bool progressIndicator;
+
+protected:
+	TileGeneratorSettings();
+
+	bool m_heightMap;
+	float m_heightMapYScale;
+	int m_seaLevel;
+	Color m_bgColor;
+	Color m_blockDefaultColor;
+	Color m_scaleColor;
+	Color m_originColor;
+	Color m_playerColor;
+	Color m_tileBorderColor;
+	bool m_drawOrigin;
+	bool m_drawPlayers;
+	int m_drawScale;
+	bool m_drawAlpha;
+	PixelAttribute::AlphaMixingMode m_mixMode;
+	bool m_drawAir;
+	bool m_shading;
+	std::string m_backend;
+	bool m_shrinkGeometry;
+	bool m_blockGeometry;
+	int m_scaleFactor;
+	bool m_sqliteCacheWorldRow;
+	bool m_fetchSurfaceFirst;
+	int m_chunkSize;
+	int m_sideScaleMajor;
+	int m_sideScaleMinor;
+	int m_heightScaleMajor;
+	int m_heightScaleMinor;
+	int m_pngCompression;
+	PngWriter::Filter m_pngFilter;
+	int m_pngThreads;
+	ImageWriter::Format m_outputFormat;
+	int m_pyramidLevels;
+	bool m_incremental;
+	std::string m_surfaceCachePath;
+	int m_serverThreads;
+	int m_serverMemoryTiles;
+	int m_serverDiskTiles;
+	uLong m_dataChecksum;		// Of the colors and other data files
+	int m_reqXMin;
+	int m_reqXMax;
+	int m_reqYMin;
+	int m_reqYMax;
+	int m_reqZMin;
+	int m_reqZMax;
+	int m_reqYMinNode;		// Node offset within a map block
+	int m_reqYMaxNode;		// Node offset within a map block
+	int m_mapXStartNodeOffset;
+	int m_mapYStartNodeOffset;
+	int m_mapXEndNodeOffset;
+	int m_mapYEndNodeOffset;
+	int m_mapXStartNodeOffsetOrig;
+	int m_mapYStartNodeOffsetOrig;
+	int m_mapXEndNodeOffsetOrig;
+	int m_mapYEndNodeOffsetOrig;
+	int m_tileXOrigin;
+	int m_tileZOrigin;
+	int m_tileXCentered;
+	int m_tileYCentered;
+	int m_tileWidth;
+	int m_tileHeight;
+	int m_tileBorderSize;
+	NodeColorMap m_nodeColors;
+	HeightMapColorList m_heightMapColors;
+	std::vector<DrawObject> m_drawObjects;
+};
+
+class TileGenerator : public TileGeneratorSettings
+{
+private:
+	// Node id -> color table of a map block, built from the block's
+	// name-id mapping. Blocks with identical mappings share one table.
+	struct NodeIDMapping
+	{
+		ustring raw;					// Mapping data the table was built from
+		std::vector<const ColorEntry *> color;
+		std::vector<const std::string *> unknownName;	// Name, if the node has no color
+		std::vector<uint8_t> nodeClass;			// How the node is rendered (padded; see renderMapBlock)
+	};
+#if __cplusplus >= 201103L
+	typedef std::unordered_map<uint64_t, NodeIDMapping> NodeIDMappingCache;
+#else
+	typedef std::map<uint64_t, NodeIDMapping> NodeIDMappingCache;
+#endif
+	typedef std::set<std::string> NodeNameSet;
+	// Number of unknown nodes with a name, and the location of one of them
+	struct UnknownNode
+	{
+		UnknownNode(void) : count(0) {}
+		long long count;
+		BlockPos sample;		// Node coordinates
+	};
+#if __cplusplus >= 201103L
+	typedef std::unordered_map<const std::string *, UnknownNode> UnknownNodeMap;
+#else
+	typedef std::map<const std::string *, UnknownNode> UnknownNodeMap;
+#endif
+	// The block column (or row) of the map that an image column (or row) is part of
+	struct MapStateLine
+	{
+		int block;			// Index from m_xMin (or m_zMax); -1: not part of the map
+		bool first;			// First pixel column (or row) of the block
+	};
+	// A less detailed level of a tile pyramid, which is scaled from the nodes like a
+	// map with its scale factor (see pushPyramidRows()). Its pixel coordinates are
+	// those of the pixel attributes.
+	struct PyramidLevel
+	{
+		int level;			// Level of the pyramid writer
+		int scale;
+		int xBegin;			// The pixels of the map
+		int xEnd;
+		int yEnd;
+		int nextY;			// Next row to be written
+		int gridX;			// Tile grid coordinates of pixel (0, 0)
+		int gridY;
+		PixelAttributes pixelAttributes;
+		std::vector<int> pixels;	// Row being written
+		std::vector<float> heights;
+		std::unique_ptr<MapStateFile> mapState;	// Incremental rendering
+		std::vector<int> previousPixels;
+		std::vector<float> previousHeights;
+	};
+	typedef void (TileGenerator::*RenderMapBlockFunction)(const unsigned char *mapData, const BlockPos &pos, int minY, int maxY);
+public:
 	struct UnpackError
 	{
 		BlockPos pos;
@@ -107,7 +253,29 @@ public:
 		UnpackError(const char *t, size_t o, size_t l, size_t dl) : type(t), offset(o), length(l), dataLength(dl) {}
 	};
 
+	// Of the maps rendered by renderRegion()
+	struct Statistics
+	{
+		Statistics(void) : maps(0), emptyMaps(0), blocksRead(0), blocksRendered(0), unknownNodes(0) {}
+		long long maps;
+		long long emptyMaps;		// Maps that contain no map blocks
+		long long blocksRead;		// From the database
+		long long blocksRendered;
+		long long unknownNodes;		// Nodes that have no color
+	};
+
+	// A map rendered by generateJobs()
+	struct Job
+	{
+		std::string output;
+		NodeCoord corner1;
+		NodeCoord corner2;
+		int scaleFactor;		// 0: as set by setScaleFactor()
+	};
+
 	TileGenerator();
+	TileGenerator(const TileGenerator &) = delete;
+	TileGenerator &operator=(const TileGenerator &) = delete;
 	~TileGenerator();
 	void setHeightMap(bool enable);
 	void setHeightMapYScale(float scale);
@@ -126,6 +294,7 @@ public:
 	void setSideScaleInterval(int major, int minor);
 	void setHeightScaleInterval(int major, int minor);
 	void setDrawAlpha(bool drawAlpha);
+	void setAlphaMixMode(PixelAttribute::AlphaMixingMode mode);
 	void setDrawAir(bool drawAir);
 	void drawObject(const DrawObject &object) { m_drawObjects.push_back(object); }
 	void setShading(bool shading);
@@ -135,6 +304,7 @@ public:
 	void setShrinkGeometry(bool shrink);
 	void setBlockGeometry(bool block);
 	void setSqliteCacheWorldRow(bool cacheWorldRow);
+	void setFetchSurfaceFirst(bool surfaceFirst);
 	void setTileBorderColor(const Color &tileBorderColor);
 	void setTileBorderSize(int size);
 	void setTileSize(int width, int heigth);
@@ -147,16 +317,73 @@ public:
 	void parseHeightMapColorsFile(const std::string &fileName);
 	void setBackend(std::string backend);
 	void setChunkSize(int size);
+	void setPngCompression(int level);
+	void setPngFilter(PngWriter::Filter filter);
+	void setPngThreads(int threads);
+	void setOutputFormat(ImageWriter::Format format);
+	void setPyramidLevels(int levels);
+	void setIncremental(bool incremental);
+	void setSurfaceCache(const std::string &path);
+	void setServerThreads(int threads);
+	void setServerCacheSize(int memoryTiles, int diskTiles);
 	void generate(const std::string &input, const std::string &output);
+	void watch(const std::string &input, const std::string &output, int interval);
+	void serve(const std::string &input, const std::string &output, const std::string &address, int port);
+	void generateJobs(const std::string &input, const std::vector<Job> &jobs);
+	void openWorld(const std::string &input);
+	bool renderRegion(int x, int z, int width, int height, int scale, uint8_t *buffer, size_t stride);
+	const Statistics &statistics(void) const { return m_statistics; }
 	Color computeMapHeightColor(int height);
+	void buildHeightMapColorTable(int minHeight, int maxHeight);
+	Color heightMapColor(int height);
 
 private:
-	std::string getWorldDatabaseBackend(const std::string &input);
+	// The parameters that rendering a map (or sanitizeParameters()) adjusts, and that
+	// watch() and generateJobs() restore before the next map is rendered
+	struct RenderParameters
+	{
+		int mapXStartNodeOffset;
+		int mapYStartNodeOffset;
+		int mapXEndNodeOffset;
+		int mapYEndNodeOffset;
+		int tileXOrigin;
+		int tileZOrigin;
+		int tileWidth;
+		int tileHeight;
+		std::vector<DrawObject> drawObjects;
+	};
+
+	std::string getWorldDatabaseBackend(const std::string &input) const;
 	int getMapChunkSize(const std::string &input);
 	void openDb(const std::string &input);
+	DB *createDb(const std::string &input) const;
+	void openSharedDb(const std::string &input);
 	void sanitizeParameters(void);
+	void saveRenderParameters(RenderParameters &parameters) const;
+	void restoreRenderParameters(const RenderParameters &parameters);
+	void renderWorld(const std::string &input, const std::string &inputPath, const std::string &output);
+	TileGenerator *createTileRenderer(DB *db) const;
+	bool prepareRegion(const RenderParameters &parameters, const std::string &input, const std::string &inputPath,
+		int scale, int xMin, int zMin, int xSize, int zSize);
+	bool haveBlocksInside(int xMin, int zMax) const;
+	bool renderTile(const RenderParameters &parameters, const std::string &input, const std::string &inputPath,
+		int scale, int x, int y, const std::string &path);
 	void loadBlocks();
-	void createImage();
+	void createImage(const std::string &output);
+	void drawImageBackground(void);
+	void startImageBand(int y);
+	void flushImageBand(void);
+	int *imageRow(int y);
+	float *imageHeightRow(int y);
+	bool imageRowsVisible(int y1, int y2) const { return y2 >= m_imageBandBegin && y1 < m_imageBandEnd; }
+	void closeImage(void);
+	std::string stateFilePath(const std::string &output, const char *extension) const;
+	const MapStateFile::BlockList &mapBlockFingerprints(void);
+	void prepareIncrementalRender(const std::string &output);
+	void updateMapState(void);
+	void openSurfaceCache(void);
+	void prepareSurfaceCache(void);
+	void surfaceSignature(std::ostream &signature) const;
 	void computeMapParameters(const std::string &input);
 	void computeTileParameters(
 		// Input parameters
@@ -173,17 +400,37 @@ private:
 		// Behavior selection
 		bool ascending);
 	void renderMap();
+	void renderMapColumn(const BlockColumnIndex::Column &column);
+	void renderMapRowSurfaceFirst(BlockColumnIndex::ColumnList::const_iterator rowBegin, BlockColumnIndex::ColumnList::const_iterator rowEnd);
+	void renderMapRowCached(BlockColumnIndex::ColumnList::const_iterator rowBegin, BlockColumnIndex::ColumnList::const_iterator rowEnd);
+	void loadCachedColumn(const BlockColumnIndex::Column &column, size_t slot);
+	void saveCachedColumn(const BlockColumnIndex::Column &column, size_t slot);
+	bool renderBlock(const DB::Block &block);
 	std::list<int> getZValueList() const;
-	void pushPixelRows(PixelAttributes &pixelAttributes, int zPosLimit);
-	void scalePixelRows(PixelAttributes &pixelAttributes, PixelAttributes &pixelAttributesScaled, int zPosLimit);
+	void pushPixelRows(int zPosLimit);
+	void preparePyramidLevels(void);
+	void pushPyramidRows(int zPosLimit);
+	void writePyramidRows(PyramidLevel &level, int yLimit);
 	void processMapBlock(const DB::Block &block);
+	const NodeIDMapping *getNodeIDMapping(const unsigned char *data, size_t mappingBegin, size_t mappingEnd, int numMappings);
+	void buildNodeIDMapping(NodeIDMapping &mapping, const unsigned char *data, size_t mappingBegin, size_t mappingEnd, int numMappings);
 	void renderMapBlock(const ustring &mapBlock, const BlockPos &pos, int version);
+	void selectRenderMapBlockFunctions(void);
+	template<int versionClass, bool heightMap, bool drawAlpha, bool blockDefaultColor>
+	void renderMapBlockNodes(const unsigned char *mapData, const BlockPos &pos, int minY, int maxY);
+	template<bool heightMap, bool blockDefaultColor>
+	void renderMapBlockLayers(const unsigned char *mapData, const BlockPos &pos, int minY, int maxY);
+	void loadPlayers(const std::string &inputPath);
+	void convertDrawObjects(void);
+	void renderOverlays(void);
 	void renderScale();
 	void renderHeightScale();
 	void renderOrigin();
-	void renderPlayers(const std::string &inputPath);
+	void renderPlayers();
 	void renderDrawObjects();
-	void writeImage(const std::string &output);
+	void writeImage();
+	void addUnknownNode(unsigned content, int x, int y, int z);
+	void recordUnknownNodes(const BlockPos &pos);
 	void printUnknown();
 	int mapX2ImageX(int val) const;
 	int mapY2ImageY(int val) const;
@@ -209,41 +456,48 @@ private:
 	void parseHeightMapColorsLine(const std::string &line, std::string name, std::istringstream &iline,
 		int linenr, const std::string &filename);
 
-public:
-	int verboseCoordinates;
-	int verboseReadColors;
-	bool verboseStatistics;
-	bool progressIndicator;
-
 private:
-	bool m_heightMap;
-	float m_heightMapYScale;
-	int m_seaLevel;
-	Color m_bgColor;
-	Color m_blockDefaultColor;
-	Color m_scaleColor;
-	Color m_originColor;
-	Color m_playerColor;
-	Color m_tileBorderColor;
-	bool m_drawOrigin;
-	bool m_drawPlayers;
-	int m_drawScale;
-	bool m_drawAlpha;
-	bool m_drawAir;
-	bool m_shading;
-	std::string m_backend;
-	bool m_shrinkGeometry;
-	bool m_blockGeometry;
-	int m_scaleFactor;
-	bool m_sqliteCacheWorldRow;
-	int m_chunkSize;
-	int m_sideScaleMajor;
-	int m_sideScaleMinor;
-	int m_heightScaleMajor;
-	int m_heightScaleMinor;
-
 	DB *m_db;
+	// The world opened by openWorld(). m_db passes the calls on to m_worldDatabase.
+	DBShared::Database *m_worldDatabase;
+	std::string m_worldInput;
+	std::string m_worldInputPath;
+	RenderParameters m_worldParameters;
+	Statistics m_statistics;
+	// The image is written in bands of rows, as soon as they are complete. m_image
+	// spans the entire image, so that it can be drawn on as usual, but only the rows
+	// of the current band (m_imageBandBegin up to m_imageBandEnd) are stored: all
+	// other rows refer to a dummy row.
 	gdImagePtr m_image;
+	int **m_imageRows;		// The row pointers allocated by libgd
+	std::vector<int *> m_imageRowPointers;
+	std::vector<int> m_imageBands[2];
+	std::vector<float> m_imageHeightBands[2];	// Only if the image writer uses heights
+	int m_imageBandIndex;
+	int m_imageBandBegin;
+	int m_imageBandEnd;
+	FILE *m_imageFile;
+	uint8_t *m_imageBuffer;		// Instead of the file: RGBA pixels (see renderRegion())
+	size_t m_imageBufferStride;
+	ImageWriter *m_imageWriter;
+	PyramidWriter *m_pyramidWriter;		// Owned by m_imageWriter
+	std::vector<PyramidLevel *> m_pyramidLevelPixels;
+	// Incremental rendering: the state of the map is saved, and used to render only the
+	// parts of the map that changed the next time. m_changedColumns has an entry for every
+	// block column of the map, and is only used if there is a previous state.
+	MapStateFile *m_mapState;
+	bool m_havePreviousMapState;
+	std::vector<bool> m_changedColumns;
+	std::vector<MapStateLine> m_mapStateColumns;	// For every image column
+	std::vector<MapStateLine> m_mapStateRows;	// For every image row
+	std::vector<int> m_previousImageBand;
+	std::vector<float> m_previousImageHeightBand;
+	MapStateFile::BlockList m_blockFingerprints;	// Of the blocks of the map; see mapBlockFingerprints()
+	// Surface cache: the slot of every block column of the map (index as in m_blockIndex),
+	// and whether it holds the column.
+	SurfaceCacheFile *m_surfaceCache;
+	std::vector<size_t> m_surfaceCacheSlots;
+	std::vector<bool> m_surfaceCacheHits;
 	PixelAttributes m_blockPixelAttributes;
 	PixelAttributes m_blockPixelAttributesScaled;
 	int m_xMin;
@@ -252,48 +506,38 @@ private:
 	int m_zMax;
 	int m_yMin;
 	int m_yMax;
-	int m_reqXMin;
-	int m_reqXMax;
-	int m_reqYMin;
-	int m_reqYMax;
-	int m_reqZMin;
-	int m_reqZMax;
-	int m_reqYMinNode;		// Node offset within a map block
-	int m_reqYMaxNode;		// Node offset within a map block
 	int m_storedWidth;
 	int m_storedHeight;
-	int m_mapXStartNodeOffset;
-	int m_mapYStartNodeOffset;
-	int m_mapXEndNodeOffset;
-	int m_mapYEndNodeOffset;
-	int m_mapXStartNodeOffsetOrig;
-	int m_mapYStartNodeOffsetOrig;
-	int m_mapXEndNodeOffsetOrig;
-	int m_mapYEndNodeOffsetOrig;
-	int m_tileXOrigin;
-	int m_tileZOrigin;
-	int m_tileXCentered;
-	int m_tileYCentered;
-	int m_tileWidth;
-	int m_tileHeight;
-	int m_tileBorderSize;
 	int m_tileMapXOffset;
 	int m_tileMapYOffset;
 	int m_tileBorderXCount;
 	int m_tileBorderYCount;
 	int m_pictWidth;
 	int m_pictHeight;
+	int m_contextMargin;		// Pixels west and north of the image, only rendered for its shading
 	int m_surfaceHeight;
 	int m_surfaceDepth;
-	std::list<BlockPos> m_positions;
-	NodeID2NameMap m_nameMap;
+	BlockColumnIndex m_blockIndex;
 	static const ColorEntry *NodeColorNotDrawn;
-	const ColorEntry *m_nodeIDColor[MAPBLOCK_MAXCOLORS];
-	NodeColorMap m_nodeColors;
-	HeightMapColorList m_heightMapColors;
+	const NodeIDMapping *m_nodeIDMapping;
+	NodeIDMapping m_nodeIDMappingEmpty;
+	NodeIDMapping m_nodeIDMappingUncached;
+	NodeIDMappingCache m_nodeIDMappingCache;
+	NodeNameSet m_nodeNames;
+	RenderMapBlockFunction m_renderMapBlockLayers;
+	RenderMapBlockFunction m_renderMapBlockNodes;
+	std::vector<Color> m_heightMapColorTable;	// Colors of the heights m_heightMapColorTableMin and up
+	int m_heightMapColorTableMin;
 	uint16_t m_readedPixels[16];
-	std::set<std::string> m_unknownNodes;
-	std::vector<DrawObject> m_drawObjects;
+	int m_blocksRendered;
+	int m_blocksRequested;
+	int m_unpackErrors;
+	UnknownNodeMap m_unknownNodes;
+	// Unknown nodes of the current block: count per node id, and the ids and first location found
+	std::vector<uint16_t> m_blockUnknownCount;
+	std::vector<uint16_t> m_blockUnknownIDs;
+	std::vector<uint16_t> m_blockUnknownSample;
+	PlayerAttributes::Players m_players;
 }; /* -----  end of class TileGenerator  ----- */
 
 #endif /* end of include guard: TILEGENERATOR_H_JJNUCARH */
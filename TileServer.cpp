@@ -0,0 +1,508 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <gd.h>
+#include "config.h"
+#include "PyramidWriter.h"
+#include "TileServer.h"
+#if MSDOS || __OS2__ || __NT__ || _WIN32
+#include <direct.h>
+#else
+#include <csignal>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+// Larger scale factors are not supported by the renderer
+#define TILESERVER_MAX_RENDER_SCALE	16
+#define TILESERVER_MAX_REQUEST_SIZE	8192
+#define TILESERVER_TIMEOUT		30		// Seconds
+
+static void makeDirectory(const std::string &path)
+{
+#if MSDOS || __OS2__ || __NT__ || _WIN32
+	int result = _mkdir(path.c_str());
+#else
+	int result = mkdir(path.c_str(), 0777);
+#endif
+	if (result && errno != EEXIST) {
+		std::ostringstream oss;
+		oss << "Error creating directory '" << path << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+}
+
+// Returns false if the file can't be read
+static bool readFile(const std::string &path, std::string &data)
+{
+	FILE *file = fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+	data.clear();
+	char buffer[16384];
+	size_t size;
+	while ((size = fread(buffer, 1, sizeof(buffer), file)))
+		data.append(buffer, size);
+	bool ok = !ferror(file);
+	fclose(file);
+	return ok;
+}
+
+// Path of a request: /<zoom>/<x>/<y>.png
+static bool parseTilePath(const std::string &path, int &zoom, int &x, int &y)
+{
+	std::istringstream iss(path);
+	char slash[3];
+	std::string suffix;
+	iss >> slash[0] >> zoom >> slash[1] >> x >> slash[2] >> y;
+	std::getline(iss, suffix);
+	return !iss.fail() && slash[0] == '/' && slash[1] == '/' && slash[2] == '/' && suffix == ".png";
+}
+
+TileServer::TileServer(const std::string &directory, int levels, int scaleFactor, int background, int pngLevel, PngWriter::Filter pngFilter) :
+	m_directory(directory),
+	m_levels(levels),
+	m_scaleFactor(scaleFactor),
+	m_background(background),
+	m_pngLevel(pngLevel),
+	m_pngFilter(pngFilter),
+	m_memoryTiles(TILESERVER_MEMORY_TILES_DEFAULT),
+	m_diskTiles(TILESERVER_DISK_TILES_DEFAULT),
+	m_generation(0),
+	m_version(0),
+	m_tempFileCount(0),
+	m_stop(false)
+{
+	if (!m_directory.empty() && m_directory[m_directory.length() - 1] == PATH_SEPARATOR)
+		m_directory.erase(m_directory.length() - 1);
+	makeDirectory(m_directory);
+}
+
+TileServer::~TileServer()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_connectionAvailable.notify_all();
+	for (std::vector<std::thread>::iterator worker = m_workers.begin(); worker != m_workers.end(); ++worker)
+		worker->join();
+}
+
+void TileServer::setCacheSize(size_t memoryTiles, size_t diskTiles)
+{
+	m_memoryTiles = memoryTiles;
+	m_diskTiles = diskTiles;
+}
+
+void TileServer::addWorker(const RenderFunction &render)
+{
+	m_renderFunctions.push_back(render);
+}
+
+#if MSDOS || __OS2__ || __NT__ || _WIN32
+
+void TileServer::run(const std::string &address, int port)
+{
+	throw std::runtime_error("Serving tiles is not supported on this platform");
+}
+
+#else
+
+void TileServer::run(const std::string &address, int port)
+{
+	// Writing to a connection that the client closed must not end the process
+	signal(SIGPIPE, SIG_IGN);
+
+	std::ostringstream service;
+	service << port;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addresses;
+	int result = getaddrinfo(address.empty() ? 0 : address.c_str(), service.str().c_str(), &hints, &addresses);
+	if (result) {
+		std::ostringstream oss;
+		oss << "Invalid server address '" << address << "': " << gai_strerror(result);
+		throw std::runtime_error(oss.str());
+	}
+	int listener = -1;
+	int error = 0;
+	for (struct addrinfo *a = addresses; a && listener < 0; a = a->ai_next) {
+		listener = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (listener < 0) {
+			error = errno;
+			continue;
+		}
+		int reuse = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (bind(listener, a->ai_addr, a->ai_addrlen) || listen(listener, SOMAXCONN)) {
+			error = errno;
+			::close(listener);
+			listener = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+	if (listener < 0) {
+		std::ostringstream oss;
+		oss << "Error listening on port " << port << ": " << std::strerror(error);
+		throw std::runtime_error(oss.str());
+	}
+
+	if (m_dataVersion)
+		m_version = m_dataVersion();
+	m_versionChecked = std::chrono::steady_clock::now();
+	for (std::vector<RenderFunction>::const_iterator render = m_renderFunctions.begin(); render != m_renderFunctions.end(); ++render)
+		m_workers.push_back(std::thread(&TileServer::runWorker, this, *render));
+
+	while (true) {
+		int connection = accept(listener, 0, 0);
+		if (connection < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				// Wait until connections have been closed
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				continue;
+			}
+			std::ostringstream oss;
+			oss << "Error accepting connections: " << std::strerror(errno);
+			::close(listener);
+			throw std::runtime_error(oss.str());
+		}
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_connections.push_back(connection);
+		m_connectionAvailable.notify_one();
+	}
+}
+
+void TileServer::runWorker(const RenderFunction &render)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		while (m_connections.empty() && !m_stop)
+			m_connectionAvailable.wait(lock);
+		if (m_stop)
+			return;
+		int connection = m_connections.front();
+		m_connections.pop_front();
+		lock.unlock();
+		handleConnection(connection, render);
+		::close(connection);
+		lock.lock();
+	}
+}
+
+// Handle one request, and close the connection
+void TileServer::handleConnection(int connection, const RenderFunction &render)
+{
+	struct timeval timeout = { TILESERVER_TIMEOUT, 0 };
+	setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	std::string request;
+	while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos) {
+		if (request.length() > TILESERVER_MAX_REQUEST_SIZE)
+			return;
+		char buffer[1024];
+		ssize_t size = recv(connection, buffer, sizeof(buffer), 0);
+		if (size <= 0)
+			return;
+		request.append(buffer, size);
+	}
+	std::istringstream requestLine(request.substr(0, request.find_first_of("\r\n")));
+	std::string method;
+	std::string target;
+	requestLine >> method >> target;
+	size_t query = target.find('?');
+	if (query != std::string::npos)
+		target.erase(query);
+
+	const char *status = "200 OK";
+	std::string body;
+	TileData data;
+	TileKey key;
+	if (method != "GET" && method != "HEAD") {
+		status = "405 Method Not Allowed";
+		body = "Only GET and HEAD requests are supported\n";
+	}
+	else if (!parseTilePath(target, key.zoom, key.x, key.y)) {
+		status = "404 Not Found";
+		body = "Tiles are available as /<zoom>/<x>/<y>.png\n";
+	}
+	else {
+		try {
+			data = getTile(key, render);
+			if (!data) {
+				status = "404 Not Found";
+				body = "The tile contains no part of the world\n";
+			}
+		}
+		catch (std::exception &e) {
+			std::cerr << "Error rendering tile " << target << ": " << e.what() << std::endl;
+			status = "500 Internal Server Error";
+			body = std::string(e.what()) + "\n";
+		}
+	}
+	const std::string &content = data ? *data : body;
+
+	std::ostringstream header;
+	header << "HTTP/1.1 " << status << "\r\n"
+		<< "Content-Type: " << (data ? "image/png" : "text/plain") << "\r\n"
+		<< "Content-Length: " << content.length() << "\r\n"
+		<< "Cache-Control: no-cache\r\n"
+		<< "Access-Control-Allow-Origin: *\r\n"
+		<< "Connection: close\r\n"
+		<< "\r\n";
+	std::string response = header.str();
+	if (method != "HEAD")
+		response += content;
+	for (size_t sent = 0; sent < response.length(); ) {
+		ssize_t size = send(connection, response.data() + sent, response.length() - sent, 0);
+		if (size <= 0)
+			return;
+		sent += size;
+	}
+}
+
+#endif
+
+// Get a tile from the cache, or render it. Returns NULL if the tile is empty.
+TileServer::TileData TileServer::getTile(const TileKey &key, const RenderFunction &render)
+{
+	if (key.zoom < 0 || key.zoom >= m_levels)
+		return TileData();
+	// Tiles that are outside the world are empty
+	int64_t size = int64_t(PYRAMID_TILE_SIZE) * (int64_t(m_scaleFactor) << (m_levels - 1 - key.zoom));
+	int64_t worldBegin = MAPBLOCK_MIN * 16;
+	int64_t worldEnd = (MAPBLOCK_MAX + 1) * 16;
+	if (key.x * size >= worldEnd || (key.x + 1) * size <= worldBegin
+			|| -(key.y + 1) * size >= worldEnd || -key.y * size <= worldBegin)
+		return TileData();
+
+	std::shared_ptr<PendingTile> pending;
+	bool onDisk;
+	unsigned generation;
+	std::ostringstream tempPath;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		checkDataVersion();
+		std::map<TileKey, MemoryTile>::iterator memoryTile = m_memoryCache.find(key);
+		if (memoryTile != m_memoryCache.end()) {
+			m_memoryLRU.splice(m_memoryLRU.begin(), m_memoryLRU, memoryTile->second.lru);
+			return memoryTile->second.data;
+		}
+		std::map<TileKey, std::shared_ptr<PendingTile> >::iterator pendingTile = m_pendingTiles.find(key);
+		if (pendingTile != m_pendingTiles.end()) {
+			pending = pendingTile->second;
+			while (!pending->done)
+				m_tileDone.wait(lock);
+			if (!pending->error.empty())
+				throw std::runtime_error(pending->error);
+			return pending->data;
+		}
+		std::map<TileKey, TileList::iterator>::iterator diskTile = m_diskCache.find(key);
+		onDisk = diskTile != m_diskCache.end();
+		if (onDisk)
+			m_diskLRU.splice(m_diskLRU.begin(), m_diskLRU, diskTile->second);
+		pending = std::make_shared<PendingTile>();
+		m_pendingTiles[key] = pending;
+		generation = m_generation;
+		tempPath << m_directory << PATH_SEPARATOR << "tile-" << m_tempFileCount++ << ".tmp";
+	}
+
+	std::string path;
+	bool rendered = false;
+	TileData data;
+	std::string error;
+	try {
+		path = tilePath(key, true);
+		std::string png;
+		if (onDisk && readFile(path, png)) {
+			data = std::make_shared<const std::string>(png);
+		}
+		else if (produceTile(key, render, tempPath.str())) {
+			rendered = true;
+			if (!readFile(tempPath.str(), png)) {
+				std::ostringstream oss;
+				oss << "Error reading '" << tempPath.str() << "': " << std::strerror(errno);
+				throw std::runtime_error(oss.str());
+			}
+			data = std::make_shared<const std::string>(png);
+		}
+	}
+	catch (std::exception &e) {
+		error = e.what();
+		if (error.empty())
+			error = "Unknown error";
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	// A tile of an outdated world is only passed to the threads that waited for it
+	bool store = error.empty() && generation == m_generation;
+	if (rendered) {
+		if (store && m_diskTiles && !rename(tempPath.str().c_str(), path.c_str())) {
+			storeTile(key, data, true);
+			store = false;
+		}
+		else {
+			remove(tempPath.str().c_str());
+		}
+	}
+	if (store)
+		storeTile(key, data, false);
+	pending->done = true;
+	pending->data = data;
+	pending->error = error;
+	std::map<TileKey, std::shared_ptr<PendingTile> >::iterator pendingTile = m_pendingTiles.find(key);
+	if (pendingTile != m_pendingTiles.end() && pendingTile->second == pending)
+		m_pendingTiles.erase(pendingTile);
+	m_tileDone.notify_all();
+	if (!error.empty())
+		throw std::runtime_error(error);
+	return data;
+}
+
+// Render or compose a tile as a png file. Returns false if the tile is empty.
+bool TileServer::produceTile(const TileKey &key, const RenderFunction &render, const std::string &path)
+{
+	int scale = m_scaleFactor << (m_levels - 1 - key.zoom);
+	if (scale <= TILESERVER_MAX_RENDER_SCALE)
+		return render(scale, key.x, key.y, path);
+	return composeTile(key, render, path);
+}
+
+// Compute a tile from the 4 tiles of the next zoom level, by averaging 2x2 pixels
+// (as PyramidWriter does).
+bool TileServer::composeTile(const TileKey &key, const RenderFunction &render, const std::string &path)
+{
+	const int half = PYRAMID_TILE_SIZE / 2;
+	std::vector<int> pixels(PYRAMID_TILE_SIZE * PYRAMID_TILE_SIZE, m_background);
+	bool empty = true;
+	for (int i = 0; i < 4; i++) {
+		TileKey child = { key.zoom + 1, 2 * key.x + (i & 1), 2 * key.y + (i >> 1) };
+		TileData data = getTile(child, render);
+		if (!data)
+			continue;
+		empty = false;
+		gdImagePtr image = gdImageCreateFromPngPtr(data->length(), const_cast<char *>(data->data()));
+		if (!image)
+			throw std::runtime_error("Error decoding a tile");
+		for (int y = 0; y < half; y++) {
+			int *row = &pixels[(y + (i >> 1) * half) * PYRAMID_TILE_SIZE + (i & 1) * half];
+			for (int x = 0; x < half; x++) {
+				int p[4] = {
+					gdImageGetTrueColorPixel(image, 2 * x, 2 * y), gdImageGetTrueColorPixel(image, 2 * x + 1, 2 * y),
+					gdImageGetTrueColorPixel(image, 2 * x, 2 * y + 1), gdImageGetTrueColorPixel(image, 2 * x + 1, 2 * y + 1)
+				};
+				int r = 2, g = 2, b = 2;
+				for (int j = 0; j < 4; j++) {
+					r += (p[j] >> 16) & 0xff;
+					g += (p[j] >> 8) & 0xff;
+					b += p[j] & 0xff;
+				}
+				row[x] = ((r >> 2) << 16) | ((g >> 2) << 8) | (b >> 2);
+			}
+		}
+		gdImageDestroy(image);
+	}
+	if (empty)
+		return false;
+
+	FILE *file = fopen(path.c_str(), "wb");
+	if (!file) {
+		std::ostringstream oss;
+		oss << "Error opening '" << path << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	try {
+		PngWriter png(file, PYRAMID_TILE_SIZE, PYRAMID_TILE_SIZE, m_pngLevel, m_pngFilter, 1);
+		png.writeRows(&pixels[0], 0, PYRAMID_TILE_SIZE);
+		png.finish();
+	}
+	catch (...) {
+		fclose(file);
+		throw;
+	}
+	if (fclose(file)) {
+		std::ostringstream oss;
+		oss << "Error writing '" << path << "': " << std::strerror(errno);
+		throw std::runtime_error(oss.str());
+	}
+	return true;
+}
+
+// Add a tile to the memory cache, and to the disk cache if it was written there.
+// The least recently used tiles are dropped.
+void TileServer::storeTile(const TileKey &key, const TileData &data, bool onDisk)
+{
+	if (m_memoryTiles) {
+		std::map<TileKey, MemoryTile>::iterator memoryTile = m_memoryCache.find(key);
+		if (memoryTile == m_memoryCache.end()) {
+			m_memoryLRU.push_front(key);
+			MemoryTile &tile = m_memoryCache[key];
+			tile.data = data;
+			tile.lru = m_memoryLRU.begin();
+		}
+		while (m_memoryCache.size() > m_memoryTiles) {
+			m_memoryCache.erase(m_memoryLRU.back());
+			m_memoryLRU.pop_back();
+		}
+	}
+	if (onDisk) {
+		if (m_diskCache.find(key) == m_diskCache.end()) {
+			m_diskLRU.push_front(key);
+			m_diskCache[key] = m_diskLRU.begin();
+		}
+		while (m_diskCache.size() > m_diskTiles) {
+			remove(tilePath(m_diskLRU.back(), false).c_str());
+			m_diskCache.erase(m_diskLRU.back());
+			m_diskLRU.pop_back();
+		}
+	}
+}
+
+// If the world changed, drop all tiles. Tiles that are being rendered are not
+// stored when done. Checked at most once per second.
+void TileServer::checkDataVersion(void)
+{
+	if (!m_dataVersion)
+		return;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (now - m_versionChecked < std::chrono::seconds(1))
+		return;
+	m_versionChecked = now;
+	uint64_t version = m_dataVersion();
+	if (version == m_version)
+		return;
+	m_version = version;
+	m_generation++;
+	m_memoryCache.clear();
+	m_memoryLRU.clear();
+	for (TileList::const_iterator tile = m_diskLRU.begin(); tile != m_diskLRU.end(); ++tile)
+		remove(tilePath(*tile, false).c_str());
+	m_diskCache.clear();
+	m_diskLRU.clear();
+	m_pendingTiles.clear();
+}
+
+std::string TileServer::tilePath(const TileKey &key, bool create) const
+{
+	std::ostringstream path;
+	path << m_directory << PATH_SEPARATOR << key.zoom;
+	if (create)
+		makeDirectory(path.str());
+	path << PATH_SEPARATOR << key.x;
+	if (create)
+		makeDirectory(path.str());
+	path << PATH_SEPARATOR << key.y << ".png";
+	return path.str();
+}
@@ -0,0 +1,118 @@
+
+#ifndef TILESERVER_H
+#define TILESERVER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "PngWriter.h"
+
+#define TILESERVER_MEMORY_TILES_DEFAULT	1024
+#define TILESERVER_DISK_TILES_DEFAULT	65536
+
+// Serves the tiles of a slippy (web) map over HTTP: GET /<zoom>/<x>/<y>.png
+//
+// Tiles are numbered as in a tile pyramid (see PyramidWriter): zoom levels run from 0
+// (least detailed) up to the number of levels minus 1, which has the given scale
+// factor, and every less detailed level has twice the scale factor. Tiles are
+// rendered when they are first requested. Tiles of levels with scale factors that
+// can't be rendered are computed from the 4 tiles of the next level.
+//
+// Tiles are cached in memory, and on disk, as <directory>/<zoom>/<x>/<y>.png. Both
+// caches drop the least recently used tiles when they are full. The disk cache is
+// only used while the server runs: tiles that are in the directory when it starts
+// may be outdated, and are not served.
+//
+// Every worker thread handles one connection at a time, and renders the tiles using
+// its own render function. A tile that is requested while it is being rendered is
+// rendered only once.
+class TileServer
+{
+public:
+	// Renders tile (x, y) of the tile grid with the given scale factor as a png file.
+	// Returns false if the tile contains no part of the world.
+	typedef std::function<bool(int scale, int x, int y, const std::string &path)> RenderFunction;
+	// Returns a number that changes whenever the world changes (see DB::getDataVersion())
+	typedef std::function<uint64_t(void)> DataVersionFunction;
+
+	TileServer(const std::string &directory, int levels, int scaleFactor, int background, int pngLevel, PngWriter::Filter pngFilter);
+	~TileServer();
+	void setCacheSize(size_t memoryTiles, size_t diskTiles);
+	// Without this, the tiles are never rendered again
+	void setDataVersionFunction(const DataVersionFunction &dataVersion) { m_dataVersion = dataVersion; }
+	// Add a worker thread
+	void addWorker(const RenderFunction &render);
+	// Serve requests until the process is stopped. address may be empty (localhost).
+	void run(const std::string &address, int port);
+
+private:
+	struct TileKey {
+		int zoom;
+		int x;
+		int y;
+		bool operator<(const TileKey &other) const { return zoom < other.zoom || (zoom == other.zoom && (x < other.x || (x == other.x && y < other.y))); }
+	};
+	typedef std::shared_ptr<const std::string> TileData;	// The png file. NULL: the tile is empty.
+	typedef std::list<TileKey> TileList;			// Most recently used first
+
+	struct MemoryTile {
+		TileData data;
+		TileList::iterator lru;
+	};
+
+	// A tile that is being rendered, and the result, for all threads that requested it
+	struct PendingTile {
+		PendingTile(void) : done(false) {}
+		bool done;
+		TileData data;
+		std::string error;
+	};
+
+	void runWorker(const RenderFunction &render);
+	void handleConnection(int connection, const RenderFunction &render);
+	TileData getTile(const TileKey &key, const RenderFunction &render);
+	bool produceTile(const TileKey &key, const RenderFunction &render, const std::string &path);
+	bool composeTile(const TileKey &key, const RenderFunction &render, const std::string &path);
+	void storeTile(const TileKey &key, const TileData &data, bool onDisk);
+	void checkDataVersion(void);
+	std::string tilePath(const TileKey &key, bool create) const;
+
+	std::string m_directory;
+	int m_levels;
+	int m_scaleFactor;
+	int m_background;
+	int m_pngLevel;
+	PngWriter::Filter m_pngFilter;
+	size_t m_memoryTiles;
+	size_t m_diskTiles;
+	DataVersionFunction m_dataVersion;
+	std::vector<RenderFunction> m_renderFunctions;
+
+	std::mutex m_mutex;
+	unsigned m_generation;			// Incremented when the world changes
+	uint64_t m_version;
+	std::chrono::steady_clock::time_point m_versionChecked;
+	unsigned m_tempFileCount;
+	std::map<TileKey, MemoryTile> m_memoryCache;
+	TileList m_memoryLRU;
+	std::map<TileKey, TileList::iterator> m_diskCache;
+	TileList m_diskLRU;
+	std::map<TileKey, std::shared_ptr<PendingTile> > m_pendingTiles;
+	std::condition_variable m_tileDone;
+
+	std::list<int> m_connections;		// Waiting to be handled
+	std::condition_variable m_connectionAvailable;
+	bool m_stop;
+	std::vector<std::thread> m_workers;
+};
+
+#endif // TILESERVER_H
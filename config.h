@@ -21,12 +21,16 @@
 // Max number of node name -> color mappings stored in a mapblock
 #define MAPBLOCK_MAXCOLORS	65536
 
+// Max number of different node id -> color tables cached while rendering
+#define NODEIDMAPPING_CACHE_SIZE	4096
+
 #ifdef USE_CMAKE_CONFIG_H
 #include "cmake_config.h"
 #else
 #define USE_SQLITE3 1
 #define USE_LEVELDB 0
 #define USE_REDIS 0
+#define USE_POSTGRESQL 0
 #endif
 
 // List of possible database names (for usage message)
@@ -48,19 +52,27 @@
 #define USAGE_NAME_REDIS
 #endif
 
-#define USAGE_DATABASES "auto" USAGE_NAME_SQLITE USAGE_NAME_LEVELDB USAGE_NAME_REDIS
+#if USE_POSTGRESQL
+#define USAGE_NAME_POSTGRESQL "/postgresql"
+#else
+#define USAGE_NAME_POSTGRESQL
+#endif
+
+#define USAGE_DATABASES "auto" USAGE_NAME_SQLITE USAGE_NAME_LEVELDB USAGE_NAME_REDIS USAGE_NAME_POSTGRESQL
 
-#if !USE_SQLITE3 && !USE_LEVELDB && !USE_REDIS
+#if !USE_SQLITE3 && !USE_LEVELDB && !USE_REDIS && !USE_POSTGRESQL
 #error No database backends configured !
 #endif
 
 // default database to use
-#if USE_SQLITE3 && !USE_LEVELDB && !USE_REDIS
+#if USE_SQLITE3 && !USE_LEVELDB && !USE_REDIS && !USE_POSTGRESQL
 #define DEFAULT_BACKEND "sqlite3"
-#elif !USE_SQLITE3 && USE_LEVELDB && !USE_REDIS
+#elif !USE_SQLITE3 && USE_LEVELDB && !USE_REDIS && !USE_POSTGRESQL
 #define DEFAULT_BACKEND "leveldb"
-#elif !USE_SQLITE3 && !USE_LEVELDB && USE_REDIS
+#elif !USE_SQLITE3 && !USE_LEVELDB && USE_REDIS && !USE_POSTGRESQL
 #define DEFAULT_BACKEND "redis"
+#elif !USE_SQLITE3 && !USE_LEVELDB && !USE_REDIS && USE_POSTGRESQL
+#define DEFAULT_BACKEND "postgresql"
 #else
 #define DEFAULT_BACKEND "auto"
 #endif
@@ -1,6 +1,7 @@
 #include "db-leveldb.h"
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
 #include "types.h"
 
 inline int64_t stoi64(const std::string &s) {
@@ -50,7 +51,7 @@ const DB::BlockPosList &DBLevelDB::getBlockPos() {
 	m_blockPosList.clear();
 	leveldb::Iterator* it = m_db->NewIterator(leveldb::ReadOptions());
 	for (it->SeekToFirst(); it->Valid(); it->Next()) {
-		m_blockPosList.push_back(BlockPos(it->key().ToString()));
+		m_blockPosList.push_back(BlockPos(it->key().data(), it->key().size()));
 	}
 	delete it;
 	return m_blockPosList;
@@ -60,10 +61,11 @@ DB::Block DBLevelDB::getBlockOnPos(const BlockPos &pos)
 {
 	std::string datastr;
 	leveldb::Status status;
+	char key[BlockPos::StrBufferSize];
 
 	m_blocksReadCount++;
 
-	status = m_db->Get(leveldb::ReadOptions(), pos.databasePosStr(), &datastr);
+	status = m_db->Get(leveldb::ReadOptions(), leveldb::Slice(key, pos.databasePosStr(key)), &datastr);
 	if(status.ok()) {
 		m_blocksUnCachedCount++;
 		return Block(pos, ustring(reinterpret_cast<const unsigned char *>(datastr.c_str()), datastr.size()));
@@ -74,3 +76,35 @@ DB::Block DBLevelDB::getBlockOnPos(const BlockPos &pos)
 
 }
 
+void DBLevelDB::getBlocksOnPos(BlockList &blocks, const BlockPosList &positions)
+{
+	// LevelDB keeps its keys sorted (bytewise). Looking up the blocks in that
+	// order allows a single iterator to walk forward through the database,
+	// instead of starting every lookup from scratch.
+	m_blockOrder.clear();
+	m_blockOrder.reserve(positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		m_blockOrder.push_back(std::make_pair(positions[i].databasePosStr(), i));
+	std::sort(m_blockOrder.begin(), m_blockOrder.end());
+
+	blocks.resize(positions.size());
+	leveldb::Iterator *it = m_db->NewIterator(leveldb::ReadOptions());
+	for (std::vector<std::pair<std::string, size_t> >::const_iterator block = m_blockOrder.begin(); block != m_blockOrder.end(); ++block) {
+		const BlockPos &pos = positions[block->second];
+		m_blocksReadCount++;
+		it->Seek(block->first);
+		if (it->Valid() && it->key() == leveldb::Slice(block->first)) {
+			m_blocksUnCachedCount++;
+			blocks[block->second] = Block(pos, ustring(reinterpret_cast<const unsigned char *>(it->value().data()), it->value().size()));
+		}
+		else {
+			blocks[block->second] = Block(pos, ustring(reinterpret_cast<const unsigned char *>("")));
+		}
+	}
+	if (!it->status().ok()) {
+		std::string err = it->status().ToString();
+		delete it;
+		throw std::runtime_error(std::string("Failed to read blocks from database: ") + err);
+	}
+	delete it;
+}
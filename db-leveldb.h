@@ -4,6 +4,9 @@
 #include "db.h"
 #include <leveldb/db.h>
 #include <set>
+#include <string>
+#include <vector>
+#include <utility>
 
 class DBLevelDB : public DB {
 public:
@@ -13,12 +16,14 @@ public:
 	virtual int getBlocksReadCount(void);
 	virtual const BlockPosList &getBlockPos();
 	virtual Block getBlockOnPos(const BlockPos &pos);
+	virtual void getBlocksOnPos(BlockList &blocks, const BlockPosList &positions);
 	~DBLevelDB();
 private:
 	int m_blocksReadCount;
 	int m_blocksUnCachedCount;
 	leveldb::DB *m_db;
 	BlockPosList m_blockPosList;
+	std::vector<std::pair<std::string, size_t> > m_blockOrder;
 };
 
 #endif // _DB_LEVELDB_H
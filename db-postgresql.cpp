@@ -0,0 +1,414 @@
+#include "db-postgresql.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <fstream>
+#include <arpa/inet.h> // for ntohl / ntohs
+#include "types.h"
+
+// Number of rows to transfer per round-trip when streaming a z-row
+#define ROW_FETCH_SIZE		256
+
+// Signature at the start of binary COPY output
+static const char copySignature[] = "PGCOPY\n\377\r\n";
+#define COPY_SIGNATURE_LENGTH	11
+
+static inline int32_t readInt32(const char *data)
+{
+	uint32_t value;
+	memcpy(&value, data, 4);
+	return static_cast<int32_t>(ntohl(value));
+}
+
+static inline int16_t readInt16(const char *data)
+{
+	uint16_t value;
+	memcpy(&value, data, 2);
+	return static_cast<int16_t>(ntohs(value));
+}
+
+static std::string getWorldSetting(const std::string &name, std::istream &is)
+{
+	std::string line;
+	while (std::getline(is, line)) {
+		size_t start = line.find_first_not_of(" \t\r");
+		if (start == std::string::npos || line[start] == '#')
+			continue;
+		size_t assign = line.find('=', start);
+		if (assign == std::string::npos)
+			continue;
+		size_t end = line.find_last_not_of(" \t", assign - 1);
+		if (end == std::string::npos || end < start || line.substr(start, end - start + 1) != name)
+			continue;
+		size_t valueStart = line.find_first_not_of(" \t", assign + 1);
+		size_t valueEnd = line.find_last_not_of(" \t\r");
+		if (valueStart == std::string::npos || valueEnd < valueStart)
+			return "";
+		return line.substr(valueStart, valueEnd - valueStart + 1);
+	}
+	throw std::runtime_error("setting not found");
+}
+
+DBPostgreSQL::DBPostgreSQL(const std::string &mapdir) :
+	m_blocksReadCount(0),
+	m_blocksCachedCount(0),
+	m_blocksUnCachedCount(0),
+	m_conn(NULL),
+	m_xMin(INT_MIN),
+	m_xMax(INT_MAX),
+	m_yMin(INT_MIN),
+	m_yMax(INT_MAX),
+	m_rowScanActive(false),
+	m_rowCursorOpen(false),
+	m_rowCursorExhausted(false),
+	m_rowZ(0),
+	m_rowResult(NULL),
+	m_rowResultIndex(0),
+	m_rowLastX(0),
+	m_rowLastY(0),
+	m_blockOnPosPrepared(false)
+{
+	std::ifstream ifs((mapdir + "/world.mt").c_str());
+	if(!ifs.good())
+		throw std::runtime_error("Failed to read world.mt");
+	std::string connectString;
+	try {
+		connectString = getWorldSetting("pgsql_connection", ifs);
+	} catch(std::runtime_error &e) {
+		throw std::runtime_error("Set pgsql_connection in world.mt to use the postgresql backend");
+	}
+	m_conn = PQconnectdb(connectString.c_str());
+	if (PQstatus(m_conn) != CONNECTION_OK) {
+		std::string err = std::string("Failed to connect to PostgreSQL database: ") + PQerrorMessage(m_conn);
+		PQfinish(m_conn);
+		throw std::runtime_error(err);
+	}
+}
+
+DBPostgreSQL::~DBPostgreSQL()
+{
+	try {
+		closeRowCursor();
+	}
+	catch (std::runtime_error &e) {
+		// Nothing useful can be done about it now...
+	}
+	PQfinish(m_conn);
+}
+
+int DBPostgreSQL::getBlocksReadCount(void)
+{
+	return m_blocksReadCount;
+}
+
+int DBPostgreSQL::getBlocksCachedCount(void)
+{
+	return m_blocksCachedCount;
+}
+
+int DBPostgreSQL::getBlocksUnCachedCount(void)
+{
+	return m_blocksUnCachedCount;
+}
+
+// Close the row cursor, and its transaction: the next blocks are read from a new
+// snapshot of the database
+void DBPostgreSQL::clearBlockCache(void)
+{
+	closeRowCursor();
+}
+
+void DBPostgreSQL::setBlockLimits(int xMin, int xMax, int yMin, int yMax)
+{
+	m_xMin = xMin;
+	m_xMax = xMax;
+	m_yMin = yMin;
+	m_yMax = yMax;
+}
+
+void DBPostgreSQL::checkResult(PGresult *result, ExecStatusType expected, const char *what)
+{
+	if (PQresultStatus(result) != expected) {
+		std::string err = std::string("PostgreSQL: failed to ") + what + ": " + PQerrorMessage(m_conn);
+		PQclear(result);
+		throw std::runtime_error(err);
+	}
+}
+
+void DBPostgreSQL::exec(const char *sql, const char *what)
+{
+	PGresult *result = PQexec(m_conn, sql);
+	checkResult(result, PGRES_COMMAND_OK, what);
+	PQclear(result);
+}
+
+// Parse all complete tuples from binary COPY output in buffer, and
+// remove them from the buffer.
+void DBPostgreSQL::parseCopyTuples(std::string &buffer, bool &headerDone)
+{
+	size_t offset = 0;
+	if (!headerDone) {
+		if (buffer.size() < COPY_SIGNATURE_LENGTH + 8)
+			return;
+		if (memcmp(buffer.data(), copySignature, COPY_SIGNATURE_LENGTH))
+			throw std::runtime_error("PostgreSQL: unrecognised binary COPY data received");
+		size_t headerLength = COPY_SIGNATURE_LENGTH + 8 + readInt32(buffer.data() + COPY_SIGNATURE_LENGTH + 4);
+		if (buffer.size() < headerLength)
+			return;
+		offset = headerLength;
+		headerDone = true;
+	}
+	// Each tuple: field count (-1: end of data), followed by 3 fields of 4 bytes (length + int4 value)
+	while (buffer.size() - offset >= 2) {
+		int16_t fields = readInt16(buffer.data() + offset);
+		if (fields == -1) {
+			offset = buffer.size();
+			break;
+		}
+		if (fields != 3)
+			throw std::runtime_error("PostgreSQL: unexpected number of columns in block position list");
+		if (buffer.size() - offset < 2 + 3 * 8)
+			break;
+		const char *tuple = buffer.data() + offset + 2;
+		for (int i = 0; i < 3; i++)
+			if (readInt32(tuple + i * 8) != 4)
+				throw std::runtime_error("PostgreSQL: unexpected data in block position list");
+		m_blockPosList.push_back(BlockPos(readInt32(tuple + 4), readInt32(tuple + 12), readInt32(tuple + 20)));
+		offset += 2 + 3 * 8;
+	}
+	buffer.erase(0, offset);
+}
+
+const DB::BlockPosList &DBPostgreSQL::getBlockPos()
+{
+	m_blockPosList.clear();
+
+	// Binary COPY is by far the fastest way to transfer a large number of rows
+	PGresult *result = PQexec(m_conn, "COPY (SELECT posX, posY, posZ FROM blocks) TO STDOUT (FORMAT binary)");
+	checkResult(result, PGRES_COPY_OUT, "get list of MapBlocks");
+	PQclear(result);
+
+	std::string buffer;
+	bool headerDone = false;
+	char *data;
+	int length;
+	while ((length = PQgetCopyData(m_conn, &data, 0)) > 0) {
+		buffer.append(data, length);
+		PQfreemem(data);
+		parseCopyTuples(buffer, headerDone);
+	}
+	if (length == -2)
+		throw std::runtime_error(std::string("PostgreSQL: failed to get list of MapBlocks: ") + PQerrorMessage(m_conn));
+
+	result = PQgetResult(m_conn);
+	checkResult(result, PGRES_COMMAND_OK, "get list of MapBlocks");
+	PQclear(result);
+	while ((result = PQgetResult(m_conn)))
+		PQclear(result);
+
+	return m_blockPosList;
+}
+
+void DBPostgreSQL::openRowCursor(int zPos)
+{
+	closeRowCursor();
+	// Cursors only exist within a transaction.
+	exec("BEGIN TRANSACTION ISOLATION LEVEL REPEATABLE READ READ ONLY", "start transaction");
+	m_rowCursorOpen = true;
+
+	// Rows are returned in the order in which the blocks are needed
+	// for rendering: x ascending, then y descending.
+	char params[5][16];
+	snprintf(params[0], sizeof(params[0]), "%d", zPos);
+	snprintf(params[1], sizeof(params[1]), "%d", m_xMin);
+	snprintf(params[2], sizeof(params[2]), "%d", m_xMax);
+	snprintf(params[3], sizeof(params[3]), "%d", m_yMin);
+	snprintf(params[4], sizeof(params[4]), "%d", m_yMax);
+	const char *values[5] = { params[0], params[1], params[2], params[3], params[4] };
+	PGresult *result = PQexecParams(m_conn,
+		"DECLARE mapper_row NO SCROLL CURSOR FOR SELECT posX, posY, data FROM blocks"
+		" WHERE posZ = $1::int AND posX BETWEEN $2::int AND $3::int AND posY BETWEEN $4::int AND $5::int"
+		" ORDER BY posX ASC, posY DESC",
+		5, NULL, values, NULL, NULL, 0);
+	checkResult(result, PGRES_COMMAND_OK, "open cursor on map row");
+	PQclear(result);
+
+	m_rowScanActive = true;
+	m_rowCursorExhausted = false;
+	m_rowZ = zPos;
+}
+
+void DBPostgreSQL::closeRowCursor(void)
+{
+	if (m_rowResult) {
+		PQclear(m_rowResult);
+		m_rowResult = NULL;
+	}
+	m_rowResultIndex = 0;
+	m_rowScanActive = false;
+	endRowTransaction();
+}
+
+// The rows that were fetched remain available
+void DBPostgreSQL::endRowTransaction(void)
+{
+	if (m_rowCursorOpen) {
+		m_rowCursorOpen = false;
+		// Closes the cursor as well
+		exec("COMMIT", "end transaction");
+	}
+}
+
+bool DBPostgreSQL::fetchRowCursor(void)
+{
+	if (m_rowResult) {
+		PQclear(m_rowResult);
+		m_rowResult = NULL;
+	}
+	m_rowResultIndex = 0;
+	if (m_rowCursorExhausted)
+		return false;
+
+	char sql[64];
+	snprintf(sql, sizeof(sql), "FETCH %d FROM mapper_row", ROW_FETCH_SIZE);
+	// Request binary results: this avoids hex-encoding (and decoding) the block data
+	m_rowResult = PQexecParams(m_conn, sql, 0, NULL, NULL, NULL, NULL, 1);
+	checkResult(m_rowResult, PGRES_TUPLES_OK, "read blocks from map row");
+	int rows = PQntuples(m_rowResult);
+	if (rows < ROW_FETCH_SIZE) {
+		m_rowCursorExhausted = true;
+		endRowTransaction();
+	}
+	return rows > 0;
+}
+
+DB::Block DBPostgreSQL::getBlockOnPosRaw(const BlockPos &pos)
+{
+	if (!m_blockOnPosPrepared) {
+		PGresult *result = PQprepare(m_conn, "mapper_block",
+			"SELECT data FROM blocks WHERE posX = $1::int AND posY = $2::int AND posZ = $3::int", 3, NULL);
+		checkResult(result, PGRES_COMMAND_OK, "prepare SQL statement (blockOnPos)");
+		PQclear(result);
+		m_blockOnPosPrepared = true;
+	}
+
+	char params[3][16];
+	snprintf(params[0], sizeof(params[0]), "%d", pos.x);
+	snprintf(params[1], sizeof(params[1]), "%d", pos.y);
+	snprintf(params[2], sizeof(params[2]), "%d", pos.z);
+	const char *values[3] = { params[0], params[1], params[2] };
+	PGresult *result = PQexecPrepared(m_conn, "mapper_block", 3, values, NULL, NULL, 1);
+	checkResult(result, PGRES_TUPLES_OK, "read block");
+
+	Block block(pos, reinterpret_cast<const unsigned char *>(""));
+	if (PQntuples(result) > 0) {
+		block = Block(pos, ustring(reinterpret_cast<const unsigned char *>(PQgetvalue(result, 0, 0)), PQgetlength(result, 0, 0)));
+		m_blocksCachedCount++;
+	}
+	PQclear(result);
+	return block;
+}
+
+DB::Block DBPostgreSQL::getBlockOnPos(const BlockPos &pos)
+{
+	m_blocksReadCount++;
+
+	// Blocks are streamed from a cursor on the z-row, as long as they are
+	// requested in rendering order. Anything else uses a direct query.
+	if (!m_rowScanActive || pos.z != m_rowZ) {
+		openRowCursor(pos.z);
+	}
+	else if (pos.x < m_rowLastX || (pos.x == m_rowLastX && pos.y >= m_rowLastY)) {
+		return getBlockOnPosRaw(pos);
+	}
+	m_rowLastX = pos.x;
+	m_rowLastY = pos.y;
+
+	while (true) {
+		if (!m_rowResult || m_rowResultIndex >= PQntuples(m_rowResult)) {
+			if (!fetchRowCursor())
+				break;
+		}
+		int x = readInt32(PQgetvalue(m_rowResult, m_rowResultIndex, 0));
+		int y = readInt32(PQgetvalue(m_rowResult, m_rowResultIndex, 1));
+		if (x < pos.x || (x == pos.x && y > pos.y)) {
+			// Block not needed (e.g. because all nodes above it are opaque)
+			m_rowResultIndex++;
+			continue;
+		}
+		if (x == pos.x && y == pos.y) {
+			const unsigned char *data = reinterpret_cast<const unsigned char *>(PQgetvalue(m_rowResult, m_rowResultIndex, 2));
+			int size = PQgetlength(m_rowResult, m_rowResultIndex, 2);
+			m_rowResultIndex++;
+			m_blocksUnCachedCount++;
+			return Block(pos, ustring(data, size));
+		}
+		break;
+	}
+	return Block(pos, reinterpret_cast<const unsigned char *>(""));
+}
+
+void DBPostgreSQL::getBlocksOnPos(BlockList &blocks, const BlockPosList &positions)
+{
+	blocks.resize(positions.size());
+	if (positions.empty())
+		return;
+
+	// Read the entire batch using a single query. The rows are retrieved in primary
+	// key order, and sorted back into the requested order.
+	m_batch.resize(positions.size());
+	std::string xs, ys, zs;
+	char number[16];
+	for (size_t i = 0; i < positions.size(); i++) {
+		const BlockPos &pos = positions[i];
+		blocks[i] = Block(pos, reinterpret_cast<const unsigned char *>(""));
+		m_batch[i].x = pos.x;
+		m_batch[i].y = pos.y;
+		m_batch[i].z = pos.z;
+		m_batch[i].index = i;
+		const char *separator = i ? "," : "{";
+		snprintf(number, sizeof(number), "%d", pos.x);
+		xs += separator;
+		xs += number;
+		snprintf(number, sizeof(number), "%d", pos.y);
+		ys += separator;
+		ys += number;
+		snprintf(number, sizeof(number), "%d", pos.z);
+		zs += separator;
+		zs += number;
+	}
+	xs += "}";
+	ys += "}";
+	zs += "}";
+	std::sort(m_batch.begin(), m_batch.end());
+	m_blocksReadCount += positions.size();
+
+	const char *values[3] = { xs.c_str(), ys.c_str(), zs.c_str() };
+	PGresult *result = PQexecParams(m_conn,
+		"SELECT posX, posY, posZ, data FROM blocks"
+		" WHERE (posX, posY, posZ) IN (SELECT * FROM unnest($1::int[], $2::int[], $3::int[]))"
+		" ORDER BY posX, posY, posZ",
+		3, NULL, values, NULL, NULL, 1);
+	checkResult(result, PGRES_TUPLES_OK, "read batch of blocks");
+
+	int rows = PQntuples(result);
+	std::vector<BatchEntry>::const_iterator entry = m_batch.begin();
+	for (int row = 0; row < rows; row++) {
+		BatchEntry found;
+		found.x = readInt32(PQgetvalue(result, row, 0));
+		found.y = readInt32(PQgetvalue(result, row, 1));
+		found.z = readInt32(PQgetvalue(result, row, 2));
+		while (entry != m_batch.end() && *entry < found)
+			++entry;
+		if (entry == m_batch.end())
+			break;
+		if (found < *entry)
+			continue;
+		const unsigned char *data = reinterpret_cast<const unsigned char *>(PQgetvalue(result, row, 3));
+		blocks[entry->index] = Block(positions[entry->index], ustring(data, PQgetlength(result, row, 3)));
+		m_blocksUnCachedCount++;
+	}
+	PQclear(result);
+}
@@ -0,0 +1,70 @@
+#ifndef _DB_POSTGRESQL_H
+#define _DB_POSTGRESQL_H
+
+#include "db.h"
+#include <libpq-fe.h>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+class DBPostgreSQL : public DB {
+	// Position of a block in a batch, sortable in primary key order (x, y, z)
+	struct BatchEntry {
+		int x, y, z;
+		size_t index;
+		bool operator<(const BatchEntry &e) const { return x < e.x || (x == e.x && (y < e.y || (y == e.y && z < e.z))); }
+	};
+public:
+	DBPostgreSQL(const std::string &mapdir);
+	virtual int getBlocksUnCachedCount(void);
+	virtual int getBlocksCachedCount(void);
+	virtual int getBlocksReadCount(void);
+	virtual const BlockPosList &getBlockPos();
+	virtual Block getBlockOnPos(const BlockPos &pos);
+	virtual void getBlocksOnPos(BlockList &blocks, const BlockPosList &positions);
+	virtual void clearBlockCache(void);
+	// The row cursor, and its transaction, belong to the connection
+	virtual bool preferConnectionPerThread(void) const { return true; }
+	void setBlockLimits(int xMin, int xMax, int yMin, int yMax);
+	~DBPostgreSQL();
+private:
+	int m_blocksReadCount;
+	// Blocks that were streamed by the row cursor, or read in a batch, are uncached.
+	// Blocks of the current row that are read again, using a separate query, are cached.
+	int m_blocksCachedCount;
+	int m_blocksUnCachedCount;
+	PGconn *m_conn;
+	BlockPosList m_blockPosList;
+
+	// Limits of the area being rendered (used in the row query)
+	int m_xMin;
+	int m_xMax;
+	int m_yMin;
+	int m_yMax;
+
+	// State of the cursor streaming the blocks of one z-row. The cursor, and the
+	// transaction it needs, are closed as soon as all rows were fetched, so that
+	// no transaction stays open between renders.
+	bool m_rowScanActive;
+	bool m_rowCursorOpen;
+	bool m_rowCursorExhausted;
+	int m_rowZ;
+	PGresult *m_rowResult;
+	int m_rowResultIndex;
+	int m_rowLastX;
+	int m_rowLastY;
+	bool m_blockOnPosPrepared;
+	std::vector<BatchEntry> m_batch;
+
+	void checkResult(PGresult *result, ExecStatusType expected, const char *what);
+	void exec(const char *sql, const char *what);
+	void parseCopyTuples(std::string &buffer, bool &headerDone);
+	void openRowCursor(int zPos);
+	void closeRowCursor(void);
+	void endRowTransaction(void);
+	bool fetchRowCursor(void);
+	Block getBlockOnPosRaw(const BlockPos &pos);
+};
+
+#endif // _DB_POSTGRESQL_H
@@ -145,10 +145,11 @@ const DB::BlockPosList &DBRedis::getBlockPos()
 		throw std::runtime_error(std::string("redis command 'HKEYS %s' failed: ") + ctx->errstr);
 	if(reply->type != REDIS_REPLY_ARRAY)
 		throw std::runtime_error("Failed to get keys from database");
+	m_blockPosList.clear();
 	for(size_t i = 0; i < reply->elements; i++) {
 		if(reply->element[i]->type != REDIS_REPLY_STRING)
 			throw std::runtime_error("Got wrong response to 'HKEYS %s' command");
-		m_blockPosList.push_back(BlockPos(reply->element[i]->str));
+		m_blockPosList.push_back(BlockPos(reply->element[i]->str, reply->element[i]->len));
 	}
 	
 	freeReplyObject(reply);
@@ -159,12 +160,13 @@ const DB::BlockPosList &DBRedis::getBlockPos()
 DB::Block DBRedis::getBlockOnPos(const BlockPos &pos)
 {
 	redisReply *reply;
-	std::string tmp;
+	char key[BlockPos::StrBufferSize];
 	Block block(pos,reinterpret_cast<const unsigned char *>(""));
 
 	m_blocksReadCount++;
 
-	reply = (redisReply*) redisCommand(ctx, "HGET %s %s", hash.c_str(), pos.databasePosStr().c_str());
+	size_t keyLength = pos.databasePosStr(key);
+	reply = (redisReply*) redisCommand(ctx, "HGET %s %b", hash.c_str(), key, keyLength);
 	if(!reply)
 		throw std::runtime_error(std::string("redis command 'HGET %s %s' failed: ") + ctx->errstr);
 	if (reply->type == REDIS_REPLY_STRING && reply->len != 0) {
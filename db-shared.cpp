@@ -0,0 +1,108 @@
+#include "db-shared.h"
+
+DBShared::DBShared(Database &database, DB *blockDb) :
+	m_database(database),
+	m_blockDb(blockDb),
+	m_version(0)
+{
+}
+
+DBShared::~DBShared()
+{
+	delete m_blockDb;
+}
+
+int DBShared::getBlocksUnCachedCount(void)
+{
+	if (m_blockDb)
+		return m_blockDb->getBlocksUnCachedCount();
+	std::unique_lock<std::mutex> lock(m_database.mutex);
+	return m_database.db->getBlocksUnCachedCount();
+}
+
+int DBShared::getBlocksCachedCount(void)
+{
+	if (m_blockDb)
+		return m_blockDb->getBlocksCachedCount();
+	std::unique_lock<std::mutex> lock(m_database.mutex);
+	return m_database.db->getBlocksCachedCount();
+}
+
+int DBShared::getBlocksReadCount(void)
+{
+	if (m_blockDb)
+		return m_blockDb->getBlocksReadCount();
+	std::unique_lock<std::mutex> lock(m_database.mutex);
+	return m_database.db->getBlocksReadCount();
+}
+
+// The database returns a reference to its own list, which the next call replaces: the
+// list is copied, and the copy is shared.
+const DB::BlockPosList &DBShared::getBlockPos()
+{
+	std::unique_lock<std::mutex> lock(m_database.mutex);
+	if (!m_database.blockPos)
+		m_database.blockPos = std::make_shared<const BlockPosList>(m_database.db->getBlockPos());
+	m_blockPos = m_database.blockPos;
+	return *m_blockPos;
+}
+
+DB::Block DBShared::getBlockOnPos(const BlockPos &pos)
+{
+	if (m_blockDb)
+		return m_blockDb->getBlockOnPos(pos);
+	std::unique_lock<std::mutex> lock(m_database.mutex);
+	return m_database.db->getBlockOnPos(pos);
+}
+
+void DBShared::getBlocksOnPos(BlockList &blocks, const BlockPosList &positions)
+{
+	if (m_blockDb) {
+		m_blockDb->getBlocksOnPos(blocks, positions);
+		return;
+	}
+	std::unique_lock<std::mutex> lock(m_database.mutex);
+	m_database.db->getBlocksOnPos(blocks, positions);
+}
+
+void DBShared::getBlockFingerprints(BlockFingerprintList &fingerprints)
+{
+	std::shared_ptr<const BlockFingerprintList> list;
+	{
+		std::unique_lock<std::mutex> lock(m_database.mutex);
+		if (!m_database.fingerprints) {
+			std::shared_ptr<BlockFingerprintList> newList = std::make_shared<BlockFingerprintList>();
+			m_database.db->getBlockFingerprints(*newList);
+			m_database.fingerprints = newList;
+		}
+		list = m_database.fingerprints;
+	}
+	fingerprints.insert(fingerprints.end(), list->begin(), list->end());
+}
+
+uint64_t DBShared::getDataVersion(void)
+{
+	std::unique_lock<std::mutex> lock(m_database.mutex);
+	uint64_t version = m_database.db->getDataVersion();
+	if (version != m_database.version) {
+		m_database.version = version;
+		m_database.blockPos.reset();
+		m_database.fingerprints.reset();
+		m_database.db->clearBlockCache();
+	}
+	if (m_blockDb && version != m_version) {
+		m_version = version;
+		m_blockDb->clearBlockCache();
+	}
+	return version;
+}
+
+void DBShared::clearBlockCache(void)
+{
+	if (m_blockDb) {
+		m_blockDb->clearBlockCache();
+		return;
+	}
+	std::unique_lock<std::mutex> lock(m_database.mutex);
+	m_database.db->clearBlockCache();
+}
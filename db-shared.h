@@ -0,0 +1,49 @@
+#ifndef DB_SHARED_HEADER
+#define DB_SHARED_HEADER
+
+#include <memory>
+#include <mutex>
+#include "db.h"
+
+// Shares one database between threads: every thread uses its own DBShared,
+// which passes the calls on to the database, one thread at a time.
+//
+// The list of block positions, and the list of block fingerprints, are only read
+// once, and shared by all threads, until getDataVersion() finds that the database
+// changed.
+//
+// A DBShared can instead read the blocks using a connection of its own (see
+// DB::preferConnectionPerThread()), which is not locked.
+class DBShared : public DB {
+public:
+	// The state shared by the threads
+	struct Database {
+		Database(DB *d) : db(d), version(0) {}
+		DB *db;
+		std::mutex mutex;
+		uint64_t version;
+		std::shared_ptr<const BlockPosList> blockPos;
+		std::shared_ptr<const BlockFingerprintList> fingerprints;
+	};
+
+	// blockDb: the connection to read blocks with, or null to use the shared database.
+	// It is owned by the DBShared.
+	DBShared(Database &database, DB *blockDb = 0);
+	virtual ~DBShared();
+	virtual int getBlocksUnCachedCount(void);
+	virtual int getBlocksCachedCount(void);
+	virtual int getBlocksReadCount(void);
+	virtual const BlockPosList &getBlockPos();
+	virtual Block getBlockOnPos(const BlockPos &pos);
+	virtual void getBlocksOnPos(BlockList &blocks, const BlockPosList &positions);
+	virtual void getBlockFingerprints(BlockFingerprintList &fingerprints);
+	virtual uint64_t getDataVersion(void);
+	virtual void clearBlockCache(void);
+private:
+	Database &m_database;
+	DB *m_blockDb;
+	uint64_t m_version;			// Of the blocks read by m_blockDb
+	std::shared_ptr<const BlockPosList> m_blockPos;	// Kept while this thread may use it
+};
+
+#endif // DB_SHARED_HEADER
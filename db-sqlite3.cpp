@@ -1,5 +1,6 @@
 #include "db-sqlite3.h"
 #include <stdexcept>
+#include <algorithm>
 #include <unistd.h> // for usleep
 #include "types.h"
 
@@ -65,6 +66,63 @@ const DB::BlockPosList &DBSQLite3::getBlockPos() {
 	return m_BlockPosList;
 }
 
+// Read all blocks in a single pass over the table. The data is only checksummed, not stored.
+void DBSQLite3::getBlockFingerprints(BlockFingerprintList &fingerprints)
+{
+	fingerprints.clear();
+	sqlite3_stmt *statement;
+	std::string sql = "SELECT pos, data FROM blocks";
+	if (sqlite3_prepare_v2(m_db, sql.c_str(), sql.length(), &statement, 0) != SQLITE_OK)
+		throw std::runtime_error("Failed to prepare SQL statement (blockFingerprints)");
+	int result = 0;
+	while (true) {
+		result = sqlite3_step(statement);
+		if(result == SQLITE_ROW) {
+			sqlite3_int64 blocknum = sqlite3_column_int64(statement, 0);
+			const unsigned char *data = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(statement, 1));
+			int size = sqlite3_column_bytes(statement, 1);
+			fingerprints.push_back(BlockFingerprint(BlockPos(blocknum), blockFingerprint(data, size)));
+		} else if (result == SQLITE_BUSY) { // Wait some time and try again
+			usleep(10000);
+		} else {
+			break;
+		}
+	}
+	sqlite3_finalize(statement);
+	if (result != SQLITE_DONE)
+		throw std::runtime_error("Failed to read MapBlocks");
+}
+
+// Changes when another connection commits a transaction
+uint64_t DBSQLite3::getDataVersion(void)
+{
+	sqlite3_stmt *statement;
+	std::string sql = "PRAGMA data_version";
+	if (sqlite3_prepare_v2(m_db, sql.c_str(), sql.length(), &statement, 0) != SQLITE_OK)
+		throw std::runtime_error("Failed to prepare SQL statement (dataVersion)");
+	int result = 0;
+	uint64_t version = 0;
+	while (true) {
+		result = sqlite3_step(statement);
+		if (result == SQLITE_ROW) {
+			version = sqlite3_column_int64(statement, 0);
+		} else if (result == SQLITE_BUSY) { // Wait some time and try again
+			usleep(10000);
+		} else {
+			break;
+		}
+	}
+	sqlite3_finalize(statement);
+	if (result != SQLITE_DONE)
+		throw std::runtime_error("Failed to read the database version");
+	return version;
+}
+
+void DBSQLite3::clearBlockCache(void)
+{
+	m_blockCache.clear();
+}
+
 void DBSQLite3::prepareBlocksOnZStatement(void)
 {
 	//std::string sql = "SELECT pos, data FROM blocks WHERE (pos >= ? AND pos <= ?)";
@@ -173,3 +231,19 @@ DB::Block DBSQLite3::getBlockOnPos(const BlockPos &pos)
 	}
 }
 
+void DBSQLite3::getBlocksOnPos(BlockList &blocks, const BlockPosList &positions)
+{
+	// The database is ordered by pos, i.e. by z, then y, then x, whereas the
+	// blocks are needed in rendering order (z, then x, then y). Read them
+	// in database order, so that every lookup continues where the previous one
+	// ended, and mostly finds the database pages it needs already cached.
+	m_blockOrder.clear();
+	m_blockOrder.reserve(positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		m_blockOrder.push_back(std::make_pair(positions[i].databasePosI64(), i));
+	std::sort(m_blockOrder.begin(), m_blockOrder.end());
+
+	blocks.resize(positions.size());
+	for (std::vector<std::pair<int64_t, size_t> >::const_iterator block = m_blockOrder.begin(); block != m_blockOrder.end(); ++block)
+		blocks[block->second] = getBlockOnPos(positions[block->second]);
+}
@@ -10,6 +10,8 @@
 #endif
 #include <string>
 #include <sstream>
+#include <vector>
+#include <utility>
 
 #include "types.h"
 
@@ -27,6 +29,10 @@ public:
 	virtual int getBlocksReadCount(void);
 	virtual const BlockPosList &getBlockPos();
 	virtual Block getBlockOnPos(const BlockPos &pos);
+	virtual void getBlocksOnPos(BlockList &blocks, const BlockPosList &positions);
+	virtual void getBlockFingerprints(BlockFingerprintList &fingerprints);
+	virtual uint64_t getDataVersion(void);
+	virtual void clearBlockCache(void);
 	~DBSQLite3();
 private:
 	int m_blocksReadCount;
@@ -39,6 +45,7 @@ private:
 	std::ostringstream  m_getBlockSetStatementBlocks;
 	BlockCache  m_blockCache;
 	BlockPosList m_BlockPosList;
+	std::vector<std::pair<int64_t, size_t> > m_blockOrder;
 
 	void prepareBlocksOnZStatement(void);
 	void prepareBlockOnPosStatement(void);
@@ -1,10 +1,12 @@
 #ifndef _DB_H
 #define _DB_H
 
+#include <algorithm>
 #include <stdint.h>
 #include <vector>
 #include <string>
 #include <utility>
+#include <zlib.h>
 
 #include "types.h"
 #include "BlockPos.h"
@@ -14,11 +16,59 @@ class DB {
 public:
 	typedef std::pair<BlockPos, ustring> Block;
 	typedef std::vector<BlockPos>  BlockPosList;
+	typedef std::vector<Block>  BlockList;
+	typedef std::pair<BlockPos, uint64_t> BlockFingerprint;
+	typedef std::vector<BlockFingerprint> BlockFingerprintList;
+	virtual ~DB() {}
 	virtual const BlockPosList &getBlockPos()=0;
 	virtual int getBlocksUnCachedCount(void)=0;
 	virtual int getBlocksCachedCount(void)=0;
 	virtual int getBlocksReadCount(void)=0;
 	virtual Block getBlockOnPos(const BlockPos &pos)=0;
+	// Read a batch of blocks. They are returned in the same order as the positions.
+	// Backends may override this if they can do better than reading them one by one.
+	virtual void getBlocksOnPos(BlockList &blocks, const BlockPosList &positions);
+	// Compute a fingerprint of the data of every block, which changes whenever the block changes.
+	// Backends may override this if they can do better than reading the blocks one by one.
+	virtual void getBlockFingerprints(BlockFingerprintList &fingerprints);
+	static uint64_t blockFingerprint(const unsigned char *data, size_t size);
+	// A number that changes whenever the database is modified by another process,
+	// or 0 if the backend can't tell.
+	virtual uint64_t getDataVersion(void) { return 0; }
+	// Forget any blocks the backend cached (or the snapshot of the database it reads
+	// them from), as they may have changed. Called after every map is rendered as well.
+	virtual void clearBlockCache(void) {}
+	// Whether threads that share the database (see DBShared) should rather read the blocks
+	// using connections of their own, e.g. because reading keeps state in the connection.
+	virtual bool preferConnectionPerThread(void) const { return false; }
 };
 
+inline void DB::getBlocksOnPos(BlockList &blocks, const BlockPosList &positions)
+{
+	blocks.clear();
+	blocks.reserve(positions.size());
+	for (BlockPosList::const_iterator pos = positions.begin(); pos != positions.end(); ++pos)
+		blocks.push_back(getBlockOnPos(*pos));
+}
+
+inline void DB::getBlockFingerprints(BlockFingerprintList &fingerprints)
+{
+	BlockPosList positions = getBlockPos();
+	fingerprints.clear();
+	fingerprints.reserve(positions.size());
+	BlockList blocks;
+	for (size_t i = 0; i < positions.size(); i += 1024) {
+		BlockPosList batch(positions.begin() + i, positions.begin() + std::min(i + 1024, positions.size()));
+		getBlocksOnPos(blocks, batch);
+		for (BlockList::const_iterator block = blocks.begin(); block != blocks.end(); ++block)
+			fingerprints.push_back(BlockFingerprint(block->first, blockFingerprint(block->second.data(), block->second.size())));
+	}
+}
+
+// The checksum and the size of the data
+inline uint64_t DB::blockFingerprint(const unsigned char *data, size_t size)
+{
+	return (uint64_t(crc32(0, data, size)) << 32) | uint32_t(size);
+}
+
 #endif // _DB_H
@@ -0,0 +1,230 @@
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include "config.h"
+#include "TileGenerator.h"
+#include "PixelAttributes.h"
+#include "libminetestmapper.h"
+
+struct mtmapper
+{
+	mtmapper(void) : heightMap(false), opened(false) {}
+	TileGenerator generator;
+	std::string nodeColorsFile;
+	std::string heightMapNodesFile;
+	std::string heightMapColorsFile;
+	bool heightMap;
+	bool opened;
+	std::string error;
+};
+
+static int failure(mtmapper *mapper, const std::string &message)
+{
+	mapper->error = message;
+	return MTMAPPER_ERROR;
+}
+
+static int invalidValue(mtmapper *mapper, const char *name, const char *value)
+{
+	std::ostringstream oss;
+	oss << "Invalid value of option '" << name << "': '" << (value ? value : "") << "'";
+	return failure(mapper, oss.str());
+}
+
+// No value, "1" or "0"
+static bool parseFlag(const char *value, bool &flag)
+{
+	if (!value || !*value || !strcmp(value, "1"))
+		flag = true;
+	else if (!strcmp(value, "0"))
+		flag = false;
+	else
+		return false;
+	return true;
+}
+
+static bool parseInt(const char *value, int &number)
+{
+	if (!value)
+		return false;
+	std::istringstream iss(value);
+	iss >> number;
+	return !iss.fail() && iss.eof();
+}
+
+int mtmapper_api_version(void)
+{
+	return MTMAPPER_API_VERSION;
+}
+
+mtmapper *mtmapper_create(void)
+{
+	return new (std::nothrow) mtmapper;
+}
+
+void mtmapper_destroy(mtmapper *mapper)
+{
+	delete mapper;
+}
+
+const char *mtmapper_error(const mtmapper *mapper)
+{
+	return mapper->error.c_str();
+}
+
+int mtmapper_set_option(mtmapper *mapper, const char *name, const char *value)
+{
+	if (mapper->opened)
+		return failure(mapper, "Options must be set before the world is opened");
+	std::string option = name;
+	bool flag;
+	int number;
+	try {
+		if (option == "colors" || option == "heightmap-nodes" || option == "heightmap-colors"
+				|| option == "backend" || option == "surface-cache") {
+			if (!value || !*value)
+				return invalidValue(mapper, name, value);
+			if (option == "colors")
+				mapper->nodeColorsFile = value;
+			else if (option == "heightmap-nodes")
+				mapper->heightMapNodesFile = value;
+			else if (option == "heightmap-colors")
+				mapper->heightMapColorsFile = value;
+			else if (option == "backend")
+				mapper->generator.setBackend(value);
+			else
+				mapper->generator.setSurfaceCache(value);
+		}
+		else if (option == "bgcolor" || option == "blockcolor" || option == "origincolor" || option == "playercolor") {
+			if (!value || !*value)
+				return invalidValue(mapper, name, value);
+			if (option == "bgcolor")
+				mapper->generator.setBgColor(Color(value, 0));
+			else if (option == "blockcolor")
+				mapper->generator.setBlockDefaultColor(Color(value, 0));
+			else if (option == "origincolor")
+				mapper->generator.setOriginColor(Color(value, 1));
+			else
+				mapper->generator.setPlayerColor(Color(value, 1));
+		}
+		else if (option == "min-y" || option == "max-y" || option == "height-level-0") {
+			if (!parseInt(value, number))
+				return invalidValue(mapper, name, value);
+			if (option == "min-y")
+				mapper->generator.setMinY(number);
+			else if (option == "max-y")
+				mapper->generator.setMaxY(number);
+			else
+				mapper->generator.setSeaLevel(number);
+		}
+		else if (option == "heightmap-yscale") {
+			if (!value || !(isdigit(value[0]) || ((value[0] == '-' || value[0] == '+') && isdigit(value[1]))))
+				return invalidValue(mapper, name, value);
+			mapper->generator.setHeightMapYScale(atof(value));
+		}
+		else if (option == "drawalpha") {
+			// As on the command line
+			bool drawAlpha = true;
+			if (!value || !*value || !strcmp(value, "1") || !strcmp(value, "average"))
+				mapper->generator.setAlphaMixMode(PixelAttribute::AlphaMixAverage);
+			else if (!strcmp(value, "cumulative"))
+				mapper->generator.setAlphaMixMode(PixelAttribute::AlphaMixCumulative);
+			else if (!strcmp(value, "cumulative-darken"))
+				mapper->generator.setAlphaMixMode(PixelAttribute::AlphaMixCumulativeDarken);
+			else if (!strcmp(value, "none") || !strcmp(value, "0"))
+				drawAlpha = false;
+			else
+				return invalidValue(mapper, name, value);
+			mapper->generator.setDrawAlpha(drawAlpha);
+		}
+		else {
+			if (!parseFlag(value, flag))
+				return invalidValue(mapper, name, value);
+			if (option == "heightmap") {
+				mapper->generator.setHeightMap(flag);
+				mapper->heightMap = flag;
+			}
+			else if (option == "drawair")
+				mapper->generator.setDrawAir(flag);
+			else if (option == "noshading")
+				mapper->generator.setShading(!flag);
+			else if (option == "draworigin")
+				mapper->generator.setDrawOrigin(flag);
+			else if (option == "drawplayers")
+				mapper->generator.setDrawPlayers(flag);
+			else if (option == "sqlite-cacheworldrow")
+				mapper->generator.setSqliteCacheWorldRow(flag);
+			else if (option == "fetch-surface-first")
+				mapper->generator.setFetchSurfaceFirst(flag);
+			else
+				return failure(mapper, std::string("Unknown option: '") + name + "'");
+		}
+	}
+	catch (std::exception &e) {
+		return failure(mapper, e.what());
+	}
+	return MTMAPPER_OK;
+}
+
+// The file, or the default file in the world directory
+static std::string dataFile(const std::string &file, const std::string &world, const char *defaultFile)
+{
+	if (!file.empty())
+		return file;
+	return world + PATH_SEPARATOR + defaultFile;
+}
+
+int mtmapper_open(mtmapper *mapper, const char *world)
+{
+	if (mapper->opened)
+		return failure(mapper, "A world was opened already");
+	if (!world || !*world)
+		return failure(mapper, "No world specified");
+	// Also if opening fails: the colors may have been read partly
+	mapper->opened = true;
+	try {
+		if (mapper->heightMap) {
+			mapper->generator.parseHeightMapNodesFile(dataFile(mapper->heightMapNodesFile, world, "heightmap-nodes.txt"));
+			mapper->generator.parseHeightMapColorsFile(dataFile(mapper->heightMapColorsFile, world, "heightmap-colors.txt"));
+		}
+		else {
+			mapper->generator.parseNodeColorsFile(dataFile(mapper->nodeColorsFile, world, "colors.txt"));
+		}
+		mapper->generator.openWorld(world);
+	}
+	catch (std::exception &e) {
+		return failure(mapper, e.what());
+	}
+	return MTMAPPER_OK;
+}
+
+int mtmapper_render(mtmapper *mapper, int x, int z, int width, int height, int scale, uint8_t *rgba, size_t stride)
+{
+	if (!mapper->opened)
+		return failure(mapper, "No world was opened");
+	if (!rgba)
+		return failure(mapper, "No buffer");
+	try {
+		if (!mapper->generator.renderRegion(x, z, width, height, scale, rgba, stride))
+			return MTMAPPER_EMPTY;
+	}
+	catch (std::exception &e) {
+		return failure(mapper, e.what());
+	}
+	return MTMAPPER_OK;
+}
+
+int mtmapper_get_stats(const mtmapper *mapper, mtmapper_stats *stats)
+{
+	const TileGenerator::Statistics &statistics = mapper->generator.statistics();
+	stats->maps = statistics.maps;
+	stats->empty_maps = statistics.emptyMaps;
+	stats->blocks_read = statistics.blocksRead;
+	stats->blocks_rendered = statistics.blocksRendered;
+	stats->unknown_nodes = statistics.unknownNodes;
+	return MTMAPPER_OK;
+}
@@ -0,0 +1,113 @@
+
+#ifndef LIBMINETESTMAPPER_H
+#define LIBMINETESTMAPPER_H
+
+/*
+ * The C interface of libminetestmapper: render maps of a minetest world into memory.
+ *
+ * A mapper opens a world once, and then renders any number of maps of regions of it:
+ *
+ *	mtmapper *mapper = mtmapper_create();
+ *	mtmapper_set_option(mapper, "colors", "/path/to/colors.txt");
+ *	if (mtmapper_open(mapper, "/path/to/world") != MTMAPPER_OK)
+ *		fprintf(stderr, "%s\n", mtmapper_error(mapper));
+ *	uint8_t *pixels = malloc(256 * 256 * 4);
+ *	mtmapper_render(mapper, -128, -128, 256, 256, 1, pixels, 256 * 4);
+ *	...
+ *	mtmapper_destroy(mapper);
+ *
+ * The colors files, and the list of map blocks of the world, are only read once. The
+ * list of map blocks is read again if the world changes (sqlite3 worlds only).
+ *
+ * A mapper must not be used by more than one thread at a time. Different mappers can
+ * be used by different threads, but they cannot share a surface cache: a mapper keeps
+ * its cache file locked from mtmapper_open() until mtmapper_destroy(), and opening a
+ * mapper with a cache that is in use (by any process) fails.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Incremented when the interface changes incompatibly */
+#define MTMAPPER_API_VERSION	1
+
+/* Return values */
+#define MTMAPPER_OK		0
+#define MTMAPPER_EMPTY		1	/* mtmapper_render(): the region contains no map blocks */
+#define MTMAPPER_ERROR		-1	/* See mtmapper_error() */
+
+typedef struct mtmapper mtmapper;
+
+typedef struct mtmapper_stats {
+	long long maps;			/* Maps rendered */
+	long long empty_maps;		/* Maps of regions that contain no map blocks */
+	long long blocks_read;		/* Map blocks read from the database */
+	long long blocks_rendered;
+	long long unknown_nodes;	/* Nodes that have no color */
+} mtmapper_stats;
+
+int mtmapper_api_version(void);
+
+/* Returns NULL if out of memory */
+mtmapper *mtmapper_create(void);
+void mtmapper_destroy(mtmapper *mapper);
+
+/*
+ * The message of the last error. It remains valid until the next call that uses the mapper.
+ */
+const char *mtmapper_error(const mtmapper *mapper);
+
+/*
+ * Set an option. Options must be set before the world is opened.
+ *
+ * The options are named as the command-line options of minetestmapper, and take the same
+ * values:
+ *
+ *	colors, heightmap-nodes, heightmap-colors	<file>
+ *		The defaults are colors.txt, heightmap-nodes.txt and heightmap-colors.txt
+ *		in the world directory.
+ *	backend			auto|sqlite3|leveldb|redis|postgresql
+ *	bgcolor, blockcolor, origincolor, playercolor	<color>
+ *	min-y, max-y		<y>
+ *	height-level-0		<level>
+ *	heightmap-yscale	<scale>
+ *	surface-cache		<file>
+ *		Used by one mapper at a time (see above)
+ *	drawalpha		cumulative|cumulative-darken|average|none
+ *	heightmap, drawalpha, drawair, noshading, draworigin, drawplayers,
+ *	sqlite-cacheworldrow, fetch-surface-first
+ *		No value (NULL), or "1" to enable, "0" to disable
+ */
+int mtmapper_set_option(mtmapper *mapper, const char *name, const char *value);
+
+/*
+ * Read the colors files, and open the world (the world directory). If this fails, the
+ * mapper can only be destroyed.
+ */
+int mtmapper_open(mtmapper *mapper, const char *world);
+
+/*
+ * Render the map of the nodes from (x, z) up to (x + width * scale - 1, z + height * scale - 1)
+ * into rgba: height rows of width 8-bit RGBA pixels, stride bytes apart. The first row is
+ * the northernmost row (highest z). The scale factor is 1, 2, 4, 8 or 16 (1:<scale>), and
+ * x and z must be multiples of it.
+ *
+ * Returns MTMAPPER_EMPTY if the region contains no map blocks. The map is then filled
+ * with the background color.
+ *
+ * The map is identical to the same part of a map of the entire world: the nodes just west
+ * and north of the region are read as well, for the shading of its left column and top row.
+ */
+int mtmapper_render(mtmapper *mapper, int x, int z, int width, int height, int scale, uint8_t *rgba, size_t stride);
+
+int mtmapper_get_stats(const mtmapper *mapper, mtmapper_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBMINETESTMAPPER_H */
@@ -9,6 +9,7 @@
 
 #include <cstdlib>
 #include <getopt.h>
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <string>
@@ -20,6 +21,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include "TileGenerator.h"
+#include "TileServer.h"
 #include "PixelAttributes.h"
 
 using namespace std;
@@ -39,6 +41,20 @@ using namespace std;
 #define OPT_DRAWHEIGHTSCALE		0x8d
 #define OPT_SCALEFACTOR			0x8e
 #define OPT_SCALEINTERVAL		0x8f
+#define OPT_FETCH_SURFACE_FIRST		0x90
+#define OPT_VERBOSE_UNKNOWN_NODES	0x91
+#define OPT_PNG_COMPRESSION		0x92
+#define OPT_PNG_FILTER			0x93
+#define OPT_PNG_THREADS			0x94
+#define OPT_OUTPUT_FORMAT		0x95
+#define OPT_PYRAMID_LEVELS		0x96
+#define OPT_INCREMENTAL			0x97
+#define OPT_SURFACE_CACHE		0x98
+#define OPT_WATCH			0x99
+#define OPT_SERVE			0x9a
+#define OPT_SERVE_THREADS		0x9b
+#define OPT_SERVE_CACHE			0x9c
+#define OPT_JOBS			0x9d
 
 // Will be replaced with the actual name and location of the executable (if found)
 string executableName = "minetestmapper";
@@ -117,13 +133,27 @@ void usage()
 #if USE_SQLITE3
 			"  --sqlite-cacheworldrow\n"
 #endif
+			"  --fetch-surface-first\n"
 			"  --tiles <tilesize>[+<border>]|block|chunk\n"
 			"  --tileorigin <x>,<y>|world|map\n"
 			"  --tilecenter <x>,<y>|world|map\n"
 			"  --scalefactor 1:<n>\n"
 			"  --chunksize <size>\n"
+			"  --png-compression <level>\n"
+			"  --png-filter none|sub|up|average|paeth|adaptive\n"
+			"  --png-threads <n>\n"
+			"  --output-format png|ppm|pam|rgba|height16|heightfloat|pyramid\n"
+			"  --pyramid-levels <n>\n"
+			"  --incremental\n"
+			"  --surface-cache <file>\n"
+			"  --watch <seconds>\n"
+			"  --serve [<address>:]<port>\n"
+			"  --serve-threads <n>\n"
+			"  --serve-cache <memory-tiles>[,<disk-tiles>]\n"
+			"  --jobs <file>\n"
 			"  --verbose[=n]\n"
 			"  --verbose-search-colors[=n]\n"
+			"  --verbose-unknown-nodes\n"
 			"  --progress\n"
 			"Color formats:\n"
 			"\t'#000' or '#000000'                                  (RGB)\n"
@@ -524,6 +554,46 @@ static bool parseMapGeometry(istream &is, NodeCoord &coord1, NodeCoord &coord2,
 	return result;
 }
 
+// Every line of the file is a map: <output> <geometry> [1:<n>]
+// Empty lines, and lines starting with '#', are ignored.
+static void parseJobsFile(const string &fileName, std::vector<TileGenerator::Job> &jobs)
+{
+	std::ifstream in(fileName.c_str());
+	if (!in.is_open())
+		throw std::runtime_error(string("Failed to open jobs file '") + fileName + "'");
+	string line;
+	for (int linenr = 1; std::getline(in, line); linenr++) {
+		if (!line.empty() && line[line.length() - 1] == '\r')
+			line.erase(line.length() - 1);
+		size_t begin = line.find_first_not_of(" \t");
+		if (begin == string::npos || line[begin] == '#')
+			continue;
+		istringstream iss;
+		iss.str(line);
+		TileGenerator::Job job;
+		bool legacy;
+		job.scaleFactor = 0;
+		iss >> job.output >> std::ws;
+		bool valid = parseMapGeometry(iss, job.corner1, job.corner2, legacy, FuzzyBool::Maybe);
+		iss >> std::ws;
+		if (valid && !iss.eof()) {
+			int one;
+			char colon;
+			iss >> one >> colon >> job.scaleFactor;
+			valid = !iss.fail() && one == 1 && colon == ':'
+				&& (job.scaleFactor == 1 || job.scaleFactor == 2 || job.scaleFactor == 4
+					|| job.scaleFactor == 8 || job.scaleFactor == 16);
+			iss >> std::ws;
+		}
+		if (!valid || !iss.eof()) {
+			ostringstream oss;
+			oss << fileName << ":" << linenr << ": invalid job: '" << line << "' (expected: <output> <geometry> [1:<n>])";
+			throw std::runtime_error(oss.str());
+		}
+		jobs.push_back(job);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc) {
@@ -585,14 +655,28 @@ int main(int argc, char *argv[])
 		{"max-y", required_argument, 0, 'c'},
 		{"backend", required_argument, 0, 'd'},
 		{"sqlite-cacheworldrow", no_argument, 0, OPT_SQLITE_CACHEWORLDROW},
+		{"fetch-surface-first", no_argument, 0, OPT_FETCH_SURFACE_FIRST},
 		{"tiles", required_argument, 0, 't'},
 		{"tileorigin", required_argument, 0, 'T'},
 		{"tilecenter", required_argument, 0, 'T'},
 		{"tilebordercolor", required_argument, 0, 'B'},
 		{"scalefactor", required_argument, 0, OPT_SCALEFACTOR},
 		{"chunksize", required_argument, 0, OPT_CHUNKSIZE},
+		{"png-compression", required_argument, 0, OPT_PNG_COMPRESSION},
+		{"png-filter", required_argument, 0, OPT_PNG_FILTER},
+		{"png-threads", required_argument, 0, OPT_PNG_THREADS},
+		{"output-format", required_argument, 0, OPT_OUTPUT_FORMAT},
+		{"pyramid-levels", required_argument, 0, OPT_PYRAMID_LEVELS},
+		{"incremental", no_argument, 0, OPT_INCREMENTAL},
+		{"surface-cache", required_argument, 0, OPT_SURFACE_CACHE},
+		{"watch", required_argument, 0, OPT_WATCH},
+		{"serve", required_argument, 0, OPT_SERVE},
+		{"serve-threads", required_argument, 0, OPT_SERVE_THREADS},
+		{"serve-cache", required_argument, 0, OPT_SERVE_CACHE},
+		{"jobs", required_argument, 0, OPT_JOBS},
 		{"verbose", optional_argument, 0, 'v'},
 		{"verbose-search-colors", optional_argument, 0, OPT_VERBOSE_SEARCH_COLORS},
+		{"verbose-unknown-nodes", no_argument, 0, OPT_VERBOSE_UNKNOWN_NODES},
 		{"progress", no_argument, 0, OPT_PROGRESS_INDICATOR},
 		{NULL, 0, 0, 0}
 	};
@@ -605,7 +689,12 @@ int main(int argc, char *argv[])
 	string heightMapColorsFile;
 	string heightMapNodesFile;
 	bool foundGeometrySpec = false;
+	bool foundGeometry = false;
 	bool setFixedOrShrinkGeometry = false;
+	int watchInterval = 0;
+	string serveAddress;
+	int servePort = 0;
+	string jobsFile;
 
 	TileGenerator generator;
 	try {
@@ -614,7 +703,7 @@ int main(int argc, char *argv[])
 		while (1) {
 			c = getopt_long(argc, argv, "hi:o:", long_options, &option_index);
 			if (c == -1) {
-				if (input.empty() || output.empty()) {
+				if (input.empty() || (output.empty() && jobsFile.empty())) {
 					std::cerr << "Input (world directory) or output (PNG filename) missing" << std::endl;
 					usage();
 					return 0;
@@ -813,18 +902,21 @@ int main(int argc, char *argv[])
 						generator.verboseReadColors++;
 					}
 					break;
+				case OPT_VERBOSE_UNKNOWN_NODES:
+					generator.verboseUnknownNodes = true;
+					break;
 				case 'e':
 					generator.setDrawAlpha(true);
 					if (!optarg || !*optarg)
-						PixelAttribute::setMixMode(PixelAttribute::AlphaMixAverage);
+						generator.setAlphaMixMode(PixelAttribute::AlphaMixAverage);
 					else if (string(optarg) == "cumulative" || string(optarg) == "nodarken")
 						// "nodarken" is supported for backwards compatibility
-						PixelAttribute::setMixMode(PixelAttribute::AlphaMixCumulative);
+						generator.setAlphaMixMode(PixelAttribute::AlphaMixCumulative);
 					else if (string(optarg) == "darken" || string(optarg) == "cumulative-darken")
 						// "darken" is supported for backwards compatibility
-						PixelAttribute::setMixMode(PixelAttribute::AlphaMixCumulativeDarken);
+						generator.setAlphaMixMode(PixelAttribute::AlphaMixCumulativeDarken);
 					else if (string(optarg) == "average")
-						PixelAttribute::setMixMode(PixelAttribute::AlphaMixAverage);
+						generator.setAlphaMixMode(PixelAttribute::AlphaMixAverage);
 					else if (string(optarg) == "none")
 						generator.setDrawAlpha(false);
 					else {
@@ -842,6 +934,9 @@ int main(int argc, char *argv[])
 				case OPT_SQLITE_CACHEWORLDROW:
 					generator.setSqliteCacheWorldRow(true);
 					break;
+				case OPT_FETCH_SURFACE_FIRST:
+					generator.setFetchSurfaceFirst(true);
+					break;
 				case OPT_PROGRESS_INDICATOR:
 					generator.enableProgressIndicator();
 					break;
@@ -874,6 +969,137 @@ int main(int argc, char *argv[])
 						generator.setChunkSize(size);
 					}
 					break;
+				case OPT_PNG_COMPRESSION : {
+						istringstream iss;
+						iss.str(optarg);
+						int level;
+						iss >> level;
+						if (iss.fail() || level < 0 || level > 9) {
+							std::cerr << "Invalid PNG compression level (" << optarg << ") - expected: 0..9" << std::endl;
+							usage();
+							exit(1);
+						}
+						generator.setPngCompression(level);
+					}
+					break;
+				case OPT_PNG_FILTER : {
+						PngWriter::Filter filter;
+						if (!PngWriter::parseFilter(optarg, filter)) {
+							std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': '" << optarg << "'" << std::endl;
+							usage();
+							exit(1);
+						}
+						generator.setPngFilter(filter);
+					}
+					break;
+				case OPT_PNG_THREADS : {
+						istringstream iss;
+						iss.str(optarg);
+						int threads;
+						iss >> threads;
+						if (iss.fail() || threads < 0) {
+							std::cerr << "Invalid number of PNG threads (" << optarg << ")" << std::endl;
+							usage();
+							exit(1);
+						}
+						generator.setPngThreads(threads);
+					}
+					break;
+				case OPT_OUTPUT_FORMAT : {
+						ImageWriter::Format format;
+						if (!ImageWriter::parseFormat(optarg, format)) {
+							std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': '" << optarg << "'" << std::endl;
+							usage();
+							exit(1);
+						}
+						generator.setOutputFormat(format);
+					}
+					break;
+				case OPT_PYRAMID_LEVELS : {
+						istringstream iss;
+						iss.str(optarg);
+						int levels;
+						iss >> levels;
+						if (iss.fail() || levels < 0) {
+							std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': '" << optarg << "'" << std::endl;
+							usage();
+							exit(1);
+						}
+						generator.setPyramidLevels(levels);
+					}
+					break;
+				case OPT_INCREMENTAL :
+					generator.setIncremental(true);
+					break;
+				case OPT_SURFACE_CACHE :
+					generator.setSurfaceCache(optarg);
+					break;
+				case OPT_WATCH : {
+						istringstream iss;
+						iss.str(optarg);
+						iss >> watchInterval;
+						if (iss.fail() || watchInterval < 1) {
+							std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': '" << optarg << "'" << std::endl;
+							usage();
+							exit(1);
+						}
+						// Only what changed is rendered again
+						generator.setIncremental(true);
+					}
+					break;
+				case OPT_SERVE : {
+						string arg = optarg;
+						size_t colon = arg.find_last_of(':');
+						if (colon != string::npos) {
+							serveAddress = arg.substr(0, colon);
+							arg.erase(0, colon + 1);
+							// IPv6 addresses are written as [<address>]
+							if (serveAddress.length() >= 2 && serveAddress[0] == '[' && serveAddress[serveAddress.length() - 1] == ']')
+								serveAddress = serveAddress.substr(1, serveAddress.length() - 2);
+						}
+						istringstream iss;
+						iss.str(arg);
+						iss >> servePort;
+						if (iss.fail() || !iss.eof() || servePort < 1 || servePort > 65535) {
+							std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': '" << optarg << "'" << std::endl;
+							usage();
+							exit(1);
+						}
+					}
+					break;
+				case OPT_SERVE_THREADS : {
+						istringstream iss;
+						iss.str(optarg);
+						int threads;
+						iss >> threads;
+						if (iss.fail() || threads < 0) {
+							std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': '" << optarg << "'" << std::endl;
+							usage();
+							exit(1);
+						}
+						generator.setServerThreads(threads);
+					}
+					break;
+				case OPT_SERVE_CACHE : {
+						istringstream iss;
+						iss.str(optarg);
+						int memoryTiles;
+						int diskTiles = TILESERVER_DISK_TILES_DEFAULT;
+						char comma = ',';
+						iss >> memoryTiles;
+						if (!iss.fail() && !iss.eof())
+							iss >> comma >> diskTiles;
+						if (iss.fail() || !iss.eof() || comma != ',' || memoryTiles < 0 || diskTiles < 0) {
+							std::cerr << "Invalid parameter to '" << long_options[option_index].name << "': '" << optarg << "'" << std::endl;
+							usage();
+							exit(1);
+						}
+						generator.setServerCacheSize(memoryTiles, diskTiles);
+					}
+					break;
+				case OPT_JOBS :
+					jobsFile = optarg;
+					break;
 				case OPT_SCALEFACTOR: {
 						istringstream arg;
 						arg.str(optarg);
@@ -1057,6 +1283,7 @@ int main(int argc, char *argv[])
 						}
 						generator.setGeometry(coord1, coord2);
 						foundGeometrySpec = true;
+						foundGeometry = true;
 					}
 					break;
 				case OPT_DRAW_OBJECT: {
@@ -1181,6 +1408,20 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (!jobsFile.empty()) {
+		// The jobs specify the outputs and the geometries
+		if (!output.empty() || foundGeometry || servePort || watchInterval) {
+			std::cerr << "Option '--jobs' cannot be combined with '--output', a geometry, '--watch' or '--serve'" << std::endl;
+			usage();
+			return 1;
+		}
+		// As with a geometry option
+		if (!foundGeometrySpec)
+			generator.setBlockGeometry(false);
+		if (!setFixedOrShrinkGeometry)
+			generator.setShrinkGeometry(false);
+	}
+
 	try {
 		if (heightMap) {
 			parseDataFile(generator, input, heightMapNodesFile, heightMapNodesDefaultFile, &TileGenerator::parseHeightMapNodesFile);
@@ -1190,7 +1431,17 @@ int main(int argc, char *argv[])
 		else {
 			parseDataFile(generator, input, nodeColorsFile, nodeColorsDefaultFile, &TileGenerator::parseNodeColorsFile);
 		}
-		generator.generate(input, output);
+		if (!jobsFile.empty()) {
+			std::vector<TileGenerator::Job> jobs;
+			parseJobsFile(jobsFile, jobs);
+			generator.generateJobs(input, jobs);
+		}
+		else if (servePort)
+			generator.serve(input, output, serveAddress, servePort);
+		else if (watchInterval)
+			generator.watch(input, output, watchInterval);
+		else
+			generator.generate(input, output);
 	} catch(std::runtime_error e) {
 		std::cout<<"Exception: "<<e.what()<<std::endl;
 		return 1;
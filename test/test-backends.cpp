@@ -0,0 +1,117 @@
+
+// Render the test world through every backend that stores its keys as strings, and
+// compare the maps with the map rendered from sqlite3.
+//
+// Usage: test-backends <directory for the worlds> <colors.txt>
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include "BlockColumnIndex.h"
+#include "testworld.h"
+#if USE_LEVELDB
+#include <leveldb/db.h>
+#endif
+
+static const BlockPos::StrFormat keyFormats[] = { BlockPos::I64, BlockPos::XYZ, BlockPos::AXYZ };
+#define KEY_FORMAT_COUNT	3
+
+// The database key of a block: all formats are used, so that they are all read back
+static std::string blockKey(const BlockPos &pos)
+{
+	return pos.databasePosStrFmt(keyFormats[(pos.x + 2 * pos.z + 8) % KEY_FORMAT_COUNT]);
+}
+
+// Positions read from string keys must be looked up with the same keys after indexing
+static bool testIndexKeys(const TestBlockList &blocks)
+{
+	BlockColumnIndex index;
+	for (TestBlockList::const_iterator block = blocks.begin(); block != blocks.end(); ++block)
+		index.add(BlockPos(blockKey(block->pos)));
+	index.finalize();
+	if (index.blockCount() != blocks.size())
+		return testFailed("the index does not contain all blocks");
+	const BlockColumnIndex::ColumnList &columns = index.columns();
+	for (BlockColumnIndex::ColumnList::const_iterator column = columns.begin(); column != columns.end(); ++column) {
+		for (size_t i = column->yBegin; i < column->yEnd; i++) {
+			BlockPos pos = index.blockPos(*column, i);
+			std::string key;
+			try {
+				key = pos.databasePosStr();
+			}
+			catch (std::exception &e) {
+				return testFailed(std::string("key of indexed block: ") + e.what());
+			}
+			if (key != blockKey(pos))
+				return testFailed("indexed block has key " + key + " instead of " + blockKey(pos));
+		}
+	}
+	return true;
+}
+
+#if USE_LEVELDB
+static void writeLevelDBWorld(const std::string &dir, const TestBlockList &blocks)
+{
+	createTestWorld(dir, "leveldb");
+	std::string path = dir + "/map.db";
+	leveldb::DestroyDB(path, leveldb::Options());
+	leveldb::Options options;
+	options.create_if_missing = true;
+	leveldb::DB *db;
+	leveldb::Status status = leveldb::DB::Open(options, path, &db);
+	for (TestBlockList::const_iterator block = blocks.begin(); status.ok() && block != blocks.end(); ++block)
+		status = db->Put(leveldb::WriteOptions(), blockKey(block->pos), block->data);
+	if (status.ok())
+		delete db;
+	if (!status.ok())
+		throw std::runtime_error("Failed to write " + path + ": " + status.ToString());
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <directory> <colors.txt>" << std::endl;
+		return 2;
+	}
+	std::string dir = argv[1];
+	std::string colors = argv[2];
+	bool ok = true;
+	try {
+		createDirectory(dir);
+		TestBlockList blocks = testWorldBlocks();
+		ok = testIndexKeys(blocks) && ok;
+#if USE_SQLITE3
+		writeSQLiteWorld(dir + "/sqlite3", blocks);
+#endif
+#if USE_LEVELDB
+		writeLevelDBWorld(dir + "/leveldb", blocks);
+#endif
+
+		// Both ways of reading blocks: one by one, and in batches
+		std::vector<std::string> options[2];
+		options[0].push_back("colors");
+		options[0].push_back(colors);
+		options[1] = options[0];
+		options[1].push_back("fetch-surface-first");
+		options[1].push_back("");
+		for (int i = 0; i < 2; i++) {
+			std::vector<uint8_t> reference;
+#if USE_SQLITE3
+			if (!renderTestWorld(dir + "/sqlite3", options[i], reference))
+				ok = testFailed("rendering from sqlite3");
+#endif
+#if USE_LEVELDB
+			std::vector<uint8_t> pixels;
+			if (!renderTestWorld(dir + "/leveldb", options[i], pixels))
+				ok = testFailed("rendering from leveldb");
+			else if (!reference.empty() && pixels != reference)
+				ok = testFailed("the leveldb map differs from the sqlite3 map");
+#endif
+		}
+	}
+	catch (std::exception &e) {
+		ok = testFailed(e.what());
+	}
+	return ok ? 0 : 1;
+}
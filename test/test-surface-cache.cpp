@@ -0,0 +1,212 @@
+
+// Test the surface cache file: columns are kept between uses, a cache that is open
+// cannot be opened again, and the file never shrinks. Also test that library mappers
+// cannot share a cache, and that maps rendered from the cache are correct.
+//
+// Usage: test-surface-cache <directory for the cache files and the world> <colors.txt>
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include "SurfaceCacheFile.h"
+#include "libminetestmapper.h"
+#include "testworld.h"
+
+#define COLUMN_SIZE	100
+#define COLUMN_COUNT	3
+
+static size_t fileSize(const std::string &path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) ? 0 : st.st_size;
+}
+
+// Look up the test columns; store the ones that are not cached. Returns the number of
+// columns that were cached with the right data.
+static int useColumns(SurfaceCacheFile &cache)
+{
+	size_t slots[COLUMN_COUNT];
+	bool cached[COLUMN_COUNT];
+	for (int i = 0; i < COLUMN_COUNT; i++)
+		slots[i] = cache.findColumn(i, -i, 1000 + i, cached[i]);
+	cache.allocate();
+	int cachedCount = 0;
+	for (int i = 0; i < COLUMN_COUNT; i++) {
+		if (cached[i]) {
+			if (cache.columnData(slots[i])[COLUMN_SIZE - 1] != char('a' + i))
+				throw std::runtime_error("cached column has the wrong data");
+			cachedCount++;
+		}
+		else {
+			memset(cache.columnData(slots[i]), 'a' + i, COLUMN_SIZE);
+			cache.setStored(slots[i]);
+		}
+	}
+	return cachedCount;
+}
+
+static bool testReuse(const std::string &path)
+{
+	remove(path.c_str());
+	SurfaceCacheFile cache(path, COLUMN_SIZE);
+	cache.open("signature");
+	if (useColumns(cache) != 0)
+		return testFailed("a new cache has cached columns");
+	cache.close();
+	SurfaceCacheFile cache2(path, COLUMN_SIZE);
+	cache2.open("signature");
+	if (useColumns(cache2) != COLUMN_COUNT)
+		return testFailed("columns were not kept in the cache");
+	cache2.close();
+	return true;
+}
+
+static bool testLocking(const std::string &path)
+{
+	SurfaceCacheFile cache(path, COLUMN_SIZE);
+	SurfaceCacheFile cache2(path, COLUMN_SIZE);
+	cache.open("signature");
+	try {
+		cache2.open("signature");
+		return testFailed("a cache that is open was opened again");
+	}
+	catch (std::runtime_error &e) {
+		if (!strstr(e.what(), "cannot be shared"))
+			return testFailed(std::string("unexpected error: ") + e.what());
+	}
+	useColumns(cache);
+	cache.close();
+	// Once closed, it can be used again
+	cache2.open("signature");
+	if (useColumns(cache2) != COLUMN_COUNT)
+		return testFailed("columns were not kept after a failed open");
+	cache2.close();
+	return true;
+}
+
+static bool testNoShrink(const std::string &path)
+{
+	size_t size = fileSize(path);
+	SurfaceCacheFile cache(path, COLUMN_SIZE);
+	cache.open("other signature");
+	if (fileSize(path) != size)
+		return testFailed("the cache file was resized when it was discarded");
+	if (useColumns(cache) != 0)
+		return testFailed("columns of a different signature were used");
+	cache.close();
+	if (fileSize(path) != size)
+		return testFailed("the slots of a discarded cache were not reused");
+	SurfaceCacheFile cache2(path, COLUMN_SIZE);
+	cache2.open("other signature");
+	if (useColumns(cache2) != COLUMN_COUNT)
+		return testFailed("columns were not kept in a reused cache");
+	cache2.close();
+	return true;
+}
+
+#if USE_SQLITE3
+// Create a mapper that uses the cache, and open the world. opened is set if that succeeds.
+static mtmapper *openMapper(const std::string &world, const std::string &colors, const std::string &cache, bool &opened)
+{
+	mtmapper *mapper = mtmapper_create();
+	if (mtmapper_set_option(mapper, "colors", colors.c_str()) != MTMAPPER_OK
+			|| mtmapper_set_option(mapper, "surface-cache", cache.c_str()) != MTMAPPER_OK)
+		throw std::runtime_error(mtmapper_error(mapper));
+	opened = mtmapper_open(mapper, world.c_str()) == MTMAPPER_OK;
+	return mapper;
+}
+
+// Render the world, and check the map. Returns the number of blocks that were rendered.
+static long long renderCached(mtmapper *mapper, const std::vector<uint8_t> &reference)
+{
+	int size = TESTWORLD_MAX - TESTWORLD_MIN + 1;
+	std::vector<uint8_t> pixels(reference.size());
+	mtmapper_stats before, after;
+	mtmapper_get_stats(mapper, &before);
+	if (mtmapper_render(mapper, TESTWORLD_MIN, TESTWORLD_MIN, size, size, 1, &pixels[0], size * 4) != MTMAPPER_OK)
+		throw std::runtime_error(mtmapper_error(mapper));
+	if (pixels != reference)
+		throw std::runtime_error("the map rendered with the surface cache differs from the map rendered without it");
+	mtmapper_get_stats(mapper, &after);
+	return after.blocks_rendered - before.blocks_rendered;
+}
+
+static bool testMappers(const std::string &dir, const std::string &colors)
+{
+	std::string world = dir + "/world";
+	std::string cache = dir + "/world.cache";
+	writeSQLiteWorld(world, testWorldBlocks());
+	remove(cache.c_str());
+	std::vector<std::string> options;
+	options.push_back("colors");
+	options.push_back(colors);
+	std::vector<uint8_t> reference;
+	if (!renderTestWorld(world, options, reference))
+		return testFailed("rendering without the surface cache");
+
+	bool ok = true;
+	bool opened, opened2;
+	mtmapper *mapper = openMapper(world, colors, cache, opened);
+	mtmapper *mapper2 = openMapper(world, colors, cache, opened2);
+	try {
+		if (!opened)
+			throw std::runtime_error(mtmapper_error(mapper));
+		if (opened2)
+			ok = testFailed("two mappers opened the same surface cache");
+		else if (!strstr(mtmapper_error(mapper2), "cannot be shared"))
+			ok = testFailed(std::string("unexpected error: ") + mtmapper_error(mapper2));
+		if (!renderCached(mapper, reference))
+			ok = testFailed("no blocks were rendered with an empty surface cache");
+		if (renderCached(mapper, reference))
+			ok = testFailed("blocks were rendered again with the surface cache");
+	}
+	catch (std::exception &e) {
+		ok = testFailed(e.what());
+	}
+	mtmapper_destroy(mapper);
+	mtmapper_destroy(mapper2);
+	if (!ok)
+		return false;
+
+	// Once the first mapper is destroyed, the cache can be used, and it was kept
+	mapper = openMapper(world, colors, cache, opened);
+	try {
+		if (!opened)
+			ok = testFailed(std::string("the surface cache of a destroyed mapper: ") + mtmapper_error(mapper));
+		else if (renderCached(mapper, reference))
+			ok = testFailed("blocks were rendered again by the next mapper");
+	}
+	catch (std::exception &e) {
+		ok = testFailed(e.what());
+	}
+	mtmapper_destroy(mapper);
+	return ok;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <directory> <colors.txt>" << std::endl;
+		return 2;
+	}
+	std::string dir = argv[1];
+	std::string colors = argv[2];
+	bool ok = true;
+	try {
+		createDirectory(dir);
+		std::string path = dir + "/surface.cache";
+		ok = testReuse(path) && ok;
+		ok = testLocking(path) && ok;
+		ok = testNoShrink(path) && ok;
+#if USE_SQLITE3
+		ok = testMappers(dir, colors) && ok;
+#endif
+	}
+	catch (std::exception &e) {
+		ok = testFailed(e.what());
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "libminetestmapper.h"
+#include "testworld.h"
+#if USE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+static const char *const nodeNames[] = {
+	"air",
+	"default:stone",
+	"default:dirt",
+	"default:dirt_with_grass",
+	"default:sand",
+	"default:water_source",
+	"test:unknown_node",
+};
+#define NODE_AIR	0
+#define NODE_STONE	1
+#define NODE_DIRT	2
+#define NODE_GRASS	3
+#define NODE_SAND	4
+#define NODE_WATER	5
+#define NODE_UNKNOWN	6
+#define NODE_COUNT	7
+
+static int terrainHeight(int x, int z)
+{
+	return int(6 * sin(x / 7.0) + 5 * cos(z / 5.0) + 3 * sin((x + z) / 3.0));
+}
+
+static void appendU16(std::string &data, unsigned value)
+{
+	data += char(value >> 8);
+	data += char(value & 0xff);
+}
+
+static std::string compress(const std::string &data)
+{
+	uLongf size = compressBound(data.size());
+	std::string compressed(size, '\0');
+	if (compress2(reinterpret_cast<Bytef *>(&compressed[0]), &size, reinterpret_cast<const Bytef *>(data.data()), data.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+		throw std::runtime_error("compress2() failed");
+	compressed.resize(size);
+	return compressed;
+}
+
+// A map block of version 25. Node ids are assigned in reverse order in odd columns,
+// so that the blocks do not all have the same node id mapping.
+static std::string mapBlockData(int bx, int by, int bz)
+{
+	bool reverse = (bx + bz) & 1;
+	std::string nodes(4096 * 2, '\0');
+	for (int z = 0; z < 16; z++) {
+		for (int x = 0; x < 16; x++) {
+			int wx = bx * 16 + x;
+			int wz = bz * 16 + z;
+			int height = terrainHeight(wx, wz);
+			for (int y = 0; y < 16; y++) {
+				int wy = by * 16 + y;
+				int node;
+				if (wy > height)
+					node = wy <= 0 ? NODE_WATER : (wy == height + 1 && (wx * 7 + wz * 13) % 31 == 0) ? NODE_UNKNOWN : NODE_AIR;
+				else if (wy == height)
+					node = height <= 1 ? NODE_SAND : NODE_GRASS;
+				else if (wy > height - 3)
+					node = NODE_DIRT;
+				else
+					node = NODE_STONE;
+				int id = reverse ? NODE_COUNT - 1 - node : node;
+				int i = x + (y << 4) + (z << 8);
+				nodes[i * 2] = char(id >> 8);
+				nodes[i * 2 + 1] = char(id & 0xff);
+			}
+		}
+	}
+	nodes.append(4096 * 2, '\0');		// param1 and param2
+
+	std::string data;
+	data += char(25);			// Version
+	data += char(0);			// Flags
+	data += char(2);			// Content width
+	data += char(2);			// Params width
+	data += compress(nodes);
+	data += compress(std::string(1, '\0'));	// Node metadata
+	data += char(0);			// Static objects
+	appendU16(data, 0);
+	data.append(4, char(0xff));		// Timestamp
+	data += char(0);			// Name-id mapping
+	appendU16(data, NODE_COUNT);
+	for (int node = 0; node < NODE_COUNT; node++) {
+		appendU16(data, reverse ? NODE_COUNT - 1 - node : node);
+		appendU16(data, strlen(nodeNames[node]));
+		data += nodeNames[node];
+	}
+	data += char(10);			// Node timers
+	appendU16(data, 0);
+	return data;
+}
+
+TestBlockList testWorldBlocks(void)
+{
+	TestBlockList blocks;
+	for (int bz = TESTWORLD_MIN / 16; bz <= TESTWORLD_MAX / 16; bz++) {
+		for (int bx = TESTWORLD_MIN / 16; bx <= TESTWORLD_MAX / 16; bx++) {
+			for (int by = -1; by <= 0; by++) {
+				TestBlock block;
+				block.pos = BlockPos(bx, by, bz);
+				block.data = mapBlockData(bx, by, bz);
+				blocks.push_back(block);
+			}
+		}
+	}
+	return blocks;
+}
+
+void createDirectory(const std::string &dir)
+{
+	if (mkdir(dir.c_str(), 0777) && errno != EEXIST)
+		throw std::runtime_error("Failed to create " + dir + ": " + strerror(errno));
+}
+
+void createTestWorld(const std::string &dir, const std::string &backend)
+{
+	createDirectory(dir);
+	std::ofstream worldMt((dir + "/world.mt").c_str());
+	worldMt << "gameid = minetest\nbackend = " << backend << "\n";
+	if (!worldMt)
+		throw std::runtime_error("Failed to write " + dir + "/world.mt");
+}
+
+#if USE_SQLITE3
+void writeSQLiteWorld(const std::string &dir, const TestBlockList &blocks)
+{
+	createTestWorld(dir, "sqlite3");
+	std::string path = dir + "/map.sqlite";
+	remove(path.c_str());
+	sqlite3 *db;
+	sqlite3_stmt *insert = 0;
+	bool ok = sqlite3_open(path.c_str(), &db) == SQLITE_OK
+		&& sqlite3_exec(db, "CREATE TABLE blocks (pos INT NOT NULL PRIMARY KEY, data BLOB); BEGIN", 0, 0, 0) == SQLITE_OK
+		&& sqlite3_prepare_v2(db, "INSERT INTO blocks VALUES (?, ?)", -1, &insert, 0) == SQLITE_OK;
+	for (TestBlockList::const_iterator block = blocks.begin(); ok && block != blocks.end(); ++block) {
+		ok = sqlite3_bind_int64(insert, 1, block->pos.databasePosI64()) == SQLITE_OK
+			&& sqlite3_bind_blob(insert, 2, block->data.data(), block->data.size(), SQLITE_STATIC) == SQLITE_OK
+			&& sqlite3_step(insert) == SQLITE_DONE
+			&& sqlite3_reset(insert) == SQLITE_OK;
+	}
+	ok = ok && sqlite3_exec(db, "COMMIT", 0, 0, 0) == SQLITE_OK;
+	std::string error = sqlite3_errmsg(db);
+	sqlite3_finalize(insert);
+	sqlite3_close(db);
+	if (!ok)
+		throw std::runtime_error("Failed to write " + path + ": " + error);
+}
+#endif
+
+bool renderTestWorld(const std::string &dir, const std::vector<std::string> &options, std::vector<uint8_t> &pixels)
+{
+	int size = TESTWORLD_MAX - TESTWORLD_MIN + 1;
+	pixels.assign(size_t(size) * size * 4, 0);
+	mtmapper *mapper = mtmapper_create();
+	bool ok = true;
+	for (size_t i = 0; ok && i + 1 < options.size(); i += 2)
+		ok = mtmapper_set_option(mapper, options[i].c_str(), options[i + 1].empty() ? 0 : options[i + 1].c_str()) == MTMAPPER_OK;
+	ok = ok && mtmapper_open(mapper, dir.c_str()) == MTMAPPER_OK;
+	ok = ok && mtmapper_render(mapper, TESTWORLD_MIN, TESTWORLD_MIN, size, size, 1, &pixels[0], size * 4) == MTMAPPER_OK;
+	if (!ok) {
+		std::cerr << dir << ": " << mtmapper_error(mapper) << std::endl;
+		pixels.clear();
+	}
+	mtmapper_destroy(mapper);
+	return ok;
+}
+
+bool testFailed(const std::string &message)
+{
+	std::cerr << "FAILED: " << message << std::endl;
+	return false;
+}
@@ -0,0 +1,41 @@
+
+#ifndef TESTWORLD_H
+#define TESTWORLD_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "BlockPos.h"
+
+// A small generated world, for the tests: 4x4 block columns around the origin, two
+// blocks deep, with hills, water and a few unknown nodes.
+struct TestBlock
+{
+	BlockPos pos;
+	std::string data;		// In map block format version 25
+};
+typedef std::vector<TestBlock> TestBlockList;
+
+// The node coordinates of the world: TESTWORLD_MIN .. TESTWORLD_MAX in x and z
+#define TESTWORLD_MIN	(-32)
+#define TESTWORLD_MAX	31
+
+TestBlockList testWorldBlocks(void);
+
+// Create a directory, if it does not exist
+void createDirectory(const std::string &dir);
+// Create the world directory (if needed), and world.mt for the backend
+void createTestWorld(const std::string &dir, const std::string &backend);
+#if USE_SQLITE3
+void writeSQLiteWorld(const std::string &dir, const TestBlockList &blocks);
+#endif
+
+// Render the entire world with libminetestmapper. options are name, value pairs.
+// Returns false (and prints the error, and clears pixels) if rendering fails.
+bool renderTestWorld(const std::string &dir, const std::vector<std::string> &options, std::vector<uint8_t> &pixels);
+
+// Print a message and fail
+bool testFailed(const std::string &message);
+
+#endif // TESTWORLD_H